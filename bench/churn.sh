@@ -0,0 +1,257 @@
+#!/bin/bash
+# Link churn benchmark. Builds a scratch network namespace holding a few
+# watched devices, one section each, and while a storm of unrelated links
+# is created, brought up, taken down and deleted over and over, toggles
+# the watched devices and times how long the daemon takes to report each
+# transition. One JSON object is printed and appended to the results
+# file per run.
+#
+# Toggles are fed to one long running "ip -batch" so the kernel event
+# follows the write by microseconds, and every daemon output line is
+# stamped as it is read. The latency is from the write to the daemon
+# reporting the link up or down, which link_change() does inline unless
+# threads are configured. A transition not reported within the timeout
+# counts as missed.
+#
+# Usage: churn.sh [tupperware binary]
+# Needs root, bash and iproute2. Tunables, from the environment:
+#   BENCH_LINKS     links in the storm, per round    (5000)
+#   BENCH_WATCHED   watched devices                  (8)
+#   BENCH_TOGGLES   down/up cycles per watched device (20)
+#   BENCH_OPTIONS   global options, ';' separated    (link_filter = yes)
+#   BENCH_SPACING   seconds between toggles          (0.25)
+#   BENCH_TIMEOUT   seconds to wait for a transition (5)
+#   BENCH_OUTPUT    results file                     (bench-results.jsonl)
+
+set -e
+
+BIN=${1:-./tupperware}
+LINKS=${BENCH_LINKS:-5000}
+WATCHED=${BENCH_WATCHED:-8}
+TOGGLES=${BENCH_TOGGLES:-20}
+OPTIONS=${BENCH_OPTIONS:-"link_filter = yes"}
+SPACING=${BENCH_SPACING:-0.25}
+TIMEOUT=${BENCH_TIMEOUT:-5}
+OUTPUT=${BENCH_OUTPUT:-bench-results.jsonl}
+
+NS=tupchurn$$
+WORK=$(mktemp -d)
+PID=
+STORM=
+
+cleanup() {
+  [ -n "$STORM" ] && kill "$STORM" 2>/dev/null
+  if [ -n "$PID" ]; then
+    kill "$PID" 2>/dev/null
+    wait "$PID" 2>/dev/null
+  fi
+  [ -n "$IPC_PID" ] && kill "$IPC_PID" 2>/dev/null
+  ip netns del "$NS" 2>/dev/null
+  rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+[ -x "$BIN" ] || { echo "$BIN is not built" >&2; exit 1; }
+[ "$(id -u)" -eq 0 ] || { echo "Must run as root" >&2; exit 1; }
+[ -n "$EPOCHREALTIME" ] || { echo "Needs bash 5 or later" >&2; exit 1; }
+
+address() {
+  echo "10.$((128 + ($1 >> 16))).$((($1 >> 8) & 255)).$(($1 & 255))"
+}
+
+# Dummy devices are cheapest, but not built into every kernel
+link_type() {
+  if ip -n "$NS" link add tupprobe type dummy 2>/dev/null; then
+    ip -n "$NS" link del tupprobe
+    echo dummy
+  else
+    echo veth
+  fi
+}
+
+# CPU time of every thread, in nanoseconds
+cpu_ns() {
+  cat /proc/$PID/task/*/schedstat | awk '{ n += $1 } END { printf "%d", n }'
+}
+
+# Every line the daemon prints, prefixed with the time it was read
+stamp() {
+  while IFS= read -r line; do
+    printf '%s %s\n' "$EPOCHREALTIME" "$line"
+  done
+}
+
+# Ask for the SIGUSR1 table and wait until the dump is complete. Prints
+# the line the dump starts at.
+dump() {
+  start=$(($(wc -l < "$WORK/log") + 1))
+  kill -USR1 "$PID"
+  tries=0
+  while ! tail -n +$start "$WORK/log" | grep -q ' lookups, '; do
+    tries=$((tries + 1))
+    [ $tries -gt 300 ] && { echo "Daemon stopped answering" >&2; exit 1; }
+    sleep 0.1
+  done
+  echo $start
+}
+
+# Link wakeups, changes, CPU in milliseconds, overruns and resyncs
+link_counters() {
+  tail -n +$1 "$WORK/log" |
+  awk '/ link wakeups, / { print $2, $5, $8 + 0, $11, $14; exit }'
+}
+
+# Creates, raises, drops and deletes the storm links until killed,
+# counting link events generated
+storm() {
+  i=1
+  while [ $i -le $LINKS ]; do
+    echo "link add ts$i type $TYPE" >&3
+    echo "link set ts$i up" >&4
+    echo "link set ts$i down" >&5
+    echo "link del ts$i" >&6
+    i=$((i + 1))
+  done 3> "$WORK/add" 4> "$WORK/up" 5> "$WORK/down" 6> "$WORK/del"
+
+  events=0
+  while :; do
+    for phase in add up down del; do
+      ip -n "$NS" -force -batch "$WORK/$phase" 2>/dev/null || true
+      events=$((events + LINKS))
+      echo $events > "$WORK/events"
+    done
+  done
+}
+
+# Toggles every watched device to the given state at once, then waits
+# for the daemon to report each one. Appends "latency" or "missed" per
+# device to the results.
+toggle() {
+  state=$1
+  start=$(($(wc -l < "$WORK/log") + 1))
+  i=1
+  while [ $i -le $WATCHED ]; do
+    sent[$i]=$EPOCHREALTIME
+    echo "link set tw$i $state" >&"${IPC[1]}"
+    i=$((i + 1))
+  done
+
+  [ $state = up ] && word="up," || word="down."
+  deadline=$((SECONDS + TIMEOUT))
+  while [ $SECONDS -le $deadline ]; do
+    [ "$(tail -n +$start "$WORK/log" | awk -v w="$word" \
+         '$2 ~ /^tw[0-9]+$/ && $3 == w' | wc -l)" -ge $WATCHED ] && break
+    sleep 0.05
+  done
+
+  i=1
+  while [ $i -le $WATCHED ]; do
+    seen=$(tail -n +$start "$WORK/log" |
+           awk -v d=tw$i -v w="$word" '$2 == d && $3 == w { print $1; exit }')
+    if [ -n "$seen" ]; then
+      awk -v a="${sent[$i]}" -v b="$seen" \
+          'BEGIN { printf "%.3f\n", (b - a) * 1000 }' >> "$WORK/latency"
+    else
+      echo missed >> "$WORK/latency"
+    fi
+    i=$((i + 1))
+  done
+}
+
+ip netns add "$NS"
+ip -n "$NS" link set lo up
+ip netns exec "$NS" sysctl -qw net.ipv4.ping_group_range="0 2147483647"
+TYPE=$(link_type)
+
+# Probing is kept rare so link handling is all that is measured
+i=1
+while [ $i -le $WATCHED ]; do
+  echo "link add tw$i type $TYPE"
+  echo "address add $(address $i)/32 dev tw$i"
+  echo "link set tw$i up"
+  i=$((i + 1))
+done > "$WORK/links"
+ip -n "$NS" -batch "$WORK/links"
+
+{
+  echo "$OPTIONS" | tr ';' '\n'
+  i=1
+  while [ $i -le $WATCHED ]; do
+    printf '[w%d]\ndev = tw%d\naddress = %s\ntimeout = 120\ninterval = 60\n' \
+           $i $i "$(address $i)"
+    i=$((i + 1))
+  done
+} > "$WORK/conf"
+
+: > "$WORK/log"
+: > "$WORK/latency"
+ip netns exec "$NS" "$BIN" "$WORK/conf" > >(stamp >> "$WORK/log") 2>&1 &
+PID=$!
+
+tries=0
+while [ "$(grep -c ' up, Ping address' "$WORK/log")" -lt $WATCHED ]; do
+  tries=$((tries + 1))
+  if [ $tries -gt 300 ] || ! kill -0 "$PID" 2>/dev/null; then
+    echo "Links did not come up" >&2
+    tail -n 5 "$WORK/log" >&2
+    exit 1
+  fi
+  sleep 0.1
+done
+
+coproc IPC { exec ip -n "$NS" -force -batch -; }
+
+a=$(dump)
+cpu_a=$(cpu_ns)
+storm &
+STORM=$!
+begin=$EPOCHREALTIME
+
+# Toggles are spread out so they land all through the storm
+r=1
+while [ $r -le $TOGGLES ]; do
+  sleep "$SPACING"
+  toggle down
+  sleep "$SPACING"
+  toggle up
+  r=$((r + 1))
+done
+
+end=$EPOCHREALTIME
+kill "$STORM"
+wait "$STORM" 2>/dev/null || true
+STORM=
+b=$(dump)
+cpu_b=$(cpu_ns)
+
+set -- $(link_counters $a) $(link_counters $b)
+
+sort -n "$WORK/latency" |
+awk -v links=$LINKS -v watched=$WATCHED -v options="$OPTIONS" \
+    -v type="$TYPE" -v elapsed=$(awk -v a=$begin -v b=$end \
+                                 'BEGIN { print b - a }') \
+    -v events=$(cat "$WORK/events" 2>/dev/null || echo 0) \
+    -v cpu=$((cpu_b - cpu_a)) -v wakeups=$(($6 - $1)) \
+    -v changes=$(($7 - $2)) -v link_cpu=$(awk -v a=$3 -v b=$8 \
+                                          'BEGIN { print b - a }') \
+    -v overruns=$(($9 - $4)) -v resyncs=$((${10} - $5)) \
+    -v rev="$(git -C "$(dirname "$0")" rev-parse --short HEAD 2>/dev/null)" \
+    -v kernel="$(uname -r)" -v now="$(date -u +%Y-%m-%dT%H:%M:%SZ)" '
+  $1 == "missed" { missed++; next }
+  { lat[n++] = $1; sum += $1 }
+  END {
+    printf "{\"time\":\"%s\",\"revision\":\"%s\",\"kernel\":\"%s\"," \
+           "\"benchmark\":\"churn\",\"options\":\"%s\",\"link_type\":\"%s\"," \
+           "\"links\":%d,\"watched\":%d,\"duration\":%.1f," \
+           "\"storm_events_per_second\":%.0f,\"transitions\":%d," \
+           "\"missed\":%d,\"detect_mean_ms\":%.3f,\"detect_p50_ms\":%.3f," \
+           "\"detect_p99_ms\":%.3f,\"detect_max_ms\":%.3f," \
+           "\"link_wakeups\":%d,\"link_changes\":%d,\"link_cpu_ms\":%.3f," \
+           "\"cpu_ms\":%.3f,\"overruns\":%d,\"resyncs\":%d}\n",
+           now, rev, kernel, options, type, links, watched, elapsed,
+           (elapsed > 0 ? events / elapsed : 0), n + missed, missed,
+           (n ? sum / n : 0), (n ? lat[int(n * 0.50)] : 0),
+           (n ? lat[int(n * 0.99)] : 0), (n ? lat[n - 1] : 0),
+           wakeups, changes, link_cpu, cpu / 1e6, overruns, resyncs
+  }' | tee -a "$OUTPUT"
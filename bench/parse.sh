@@ -0,0 +1,75 @@
+#!/bin/sh
+# Config parse benchmark. Generates configs of each size, once as a
+# single file and once split over a conf.d directory pulled in with
+# include, and times "tupperware -t" loading them. One JSON object per
+# config is printed and appended to the results file; load_ms is the
+# best of the runs, as reported by the daemon itself.
+#
+# Usage: parse.sh [tupperware binary]
+# Needs neither root nor a network. Tunables, from the environment:
+#   BENCH_SECTIONS  config sizes, in sections        (1000 20000 100000)
+#   BENCH_FILES     files in the conf.d layout       (64)
+#   BENCH_RUNS      loads per config                 (3)
+#   BENCH_OUTPUT    results file                     (bench-results.jsonl)
+
+set -e
+
+BIN=${1:-./tupperware}
+SECTIONS=${BENCH_SECTIONS:-"1000 20000 100000"}
+FILES=${BENCH_FILES:-64}
+RUNS=${BENCH_RUNS:-3}
+OUTPUT=${BENCH_OUTPUT:-bench-results.jsonl}
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+trap 'exit 1' INT TERM
+
+[ -x "$BIN" ] || { echo "$BIN is not built" >&2; exit 1; }
+
+rev=$(git -C "$(dirname "$0")" rev-parse --short HEAD 2>/dev/null || true)
+now=$(date -u +%Y-%m-%dT%H:%M:%SZ)
+
+# Sections n, spread round robin over the given number of files
+generate() {
+  awk -v n=$1 -v files=$2 -v dir="$3" 'BEGIN {
+    for (i = 0; i < n; i++) {
+      f = dir "/" sprintf("%04d", i % files) ".conf"
+      printf "[tun%d]\ndev = tun%d\naddress = 10.%d.%d.%d\n" \
+             "interval = %d\ntimeout = 5\n",
+             i, i, int(i / 65536) % 256, int(i / 256) % 256, i % 256,
+             10 + i % 50 > f
+    }
+  }'
+}
+
+# Best load time of the runs, in milliseconds
+load() {
+  r=0
+  while [ $r -lt $RUNS ]; do
+    "$BIN" -t "$1" | awk '/ sections loaded from / { print $(NF) + 0 }'
+    r=$((r + 1))
+  done | sort -n | head -n 1
+}
+
+for n in $SECTIONS; do
+  for layout in file dir; do
+    rm -rf "$WORK/conf.d" "$WORK/main.conf"
+    mkdir "$WORK/conf.d"
+    if [ $layout = file ]; then
+      files=1
+      generate $n 1 "$WORK/conf.d"
+      mv "$WORK/conf.d/0000.conf" "$WORK/main.conf"
+    else
+      files=$FILES
+      generate $n $files "$WORK/conf.d"
+      echo "include = conf.d" > "$WORK/main.conf"
+    fi
+    ms=$(load "$WORK/main.conf")
+    [ -n "$ms" ] || { echo "Cannot load $n sections" >&2; exit 1; }
+
+    printf '{"time":"%s","revision":"%s","benchmark":"parse",' "$now" "$rev"
+    printf '"sections":%d,"files":%d,"cpus":%d,"load_ms":%s,' \
+           $n $files "$(getconf _NPROCESSORS_ONLN)" "$ms"
+    awk -v n=$n -v ms=$ms 'BEGIN { printf "\"us_per_section\":%.3f}\n", ms * 1000 / n }'
+  done
+done | tee -a "$OUTPUT"
@@ -0,0 +1,192 @@
+#!/bin/sh
+# Probe throughput benchmark. Builds a scratch network namespace holding
+# N veth devices, each with an address the kernel answers pings for, and
+# runs tupperware against them with one section per device. For every
+# option set and tunnel count one JSON object is printed and appended to
+# the results file, so runs can be compared over time. The default sets
+# compare a socket per section with the shared and batched modes.
+#
+# Usage: probe.sh [tupperware binary]
+# Needs root and iproute2. Tunables, from the environment:
+#   BENCH_TUNNELS   tunnel counts to run          (10 1000 10000)
+#   BENCH_OPTIONS   option sets, '|' separated, of global options,
+#                   ';' separated  (shared = no|shared = yes|batch = yes)
+#   BENCH_INTERVAL  probe interval in seconds     (1)
+#   BENCH_DURATION  measured seconds per run      (20)
+#   BENCH_WARMUP    seconds after all links up    (3)
+#   BENCH_OUTPUT    results file                  (bench-results.jsonl)
+
+set -e
+
+BIN=${1:-./tupperware}
+TUNNELS=${BENCH_TUNNELS:-"10 1000 10000"}
+OPTION_SETS=${BENCH_OPTIONS:-"shared = no|shared = yes|batch = yes"}
+INTERVAL=${BENCH_INTERVAL:-1}
+DURATION=${BENCH_DURATION:-20}
+WARMUP=${BENCH_WARMUP:-3}
+OUTPUT=${BENCH_OUTPUT:-bench-results.jsonl}
+
+NS=tupbench$$
+WORK=$(mktemp -d)
+PID=
+
+cleanup() {
+  if [ -n "$PID" ]; then
+    kill "$PID" 2>/dev/null || true
+    wait "$PID" 2>/dev/null || true
+  fi
+  ip netns del "$NS" 2>/dev/null || true
+  rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+[ -x "$BIN" ] || { echo "$BIN is not built" >&2; exit 1; }
+[ "$(id -u)" -eq 0 ] || { echo "Must run as root" >&2; exit 1; }
+
+# 10.128.0.0/9 leaves room for far more tunnels than anyone will run
+address() {
+  echo "10.$((128 + ($1 >> 16))).$((($1 >> 8) & 255)).$(($1 & 255))"
+}
+
+# Devices come in veth pairs whose far end is left idle; dummy devices
+# would do as well but are not built into every kernel
+make_links() {
+  i=1
+  while [ $i -le $1 ]; do
+    echo "link add tb$i type veth peer name tp$i"
+    echo "address add $(address $i)/32 dev tb$i"
+    echo "link set tb$i up"
+    echo "link set tp$i up"
+    i=$((i + 1))
+  done > "$WORK/links"
+  ip -n "$NS" -batch "$WORK/links"
+}
+
+make_config() {
+  echo "$OPTIONS" | tr ';' '\n'
+  echo "stats_file = $WORK/stats"
+  i=1
+  while [ $i -le $1 ]; do
+    printf '[t%d]\ndev = tb%d\naddress = %s\ntimeout = %s\ninterval = %s\n' \
+           $i $i "$(address $i)" $((INTERVAL * 2)) "$INTERVAL"
+    i=$((i + 1))
+  done
+}
+
+# CPU time of every thread, in nanoseconds
+cpu_ns() {
+  cat /proc/$PID/task/*/schedstat | awk '{ n += $1 } END { printf "%d", n }'
+}
+
+# Open file descriptors, sockets included
+fds() {
+  ls "/proc/$PID/fd" | wc -l
+}
+
+# Voluntary context switches: each one is the loop going back to sleep
+wakeups() {
+  cat /proc/$PID/task/*/status |
+  awk '/^voluntary_ctxt_switches/ { n += $2 } END { print n }'
+}
+
+# Ask for the SIGUSR1 table and wait until the dump is complete. Prints
+# the first line of it.
+dump() {
+  start=$(($(wc -l < "$WORK/log") + 1))
+  kill -USR1 "$PID"
+  tries=0
+  while ! tail -n +$start "$WORK/log" | grep -q ' lookups, '; do
+    tries=$((tries + 1))
+    [ $tries -gt 300 ] && { echo "Daemon stopped answering" >&2; exit 1; }
+    sleep 0.1
+  done
+  echo $start
+}
+
+# Probes sent and replies received, from the summary of a dump
+counters() {
+  tail -n +$1 "$WORK/log" | awk '/ sockets, / { print $3, $5; exit }'
+}
+
+run() {
+  n=$1
+  ip netns add "$NS"
+  ip -n "$NS" link set lo up
+  ip netns exec "$NS" sysctl -qw net.ipv4.ping_group_range="0 2147483647"
+  make_links $n
+  make_config $n > "$WORK/conf"
+
+  : > "$WORK/log"
+  ulimit -n $((n + 1024)) 2>/dev/null || true
+  ip netns exec "$NS" "$BIN" "$WORK/conf" >> "$WORK/log" 2>&1 &
+  PID=$!
+
+  tries=0
+  while [ "$(grep -c ' up, Ping address' "$WORK/log")" -lt $n ]; do
+    tries=$((tries + 1))
+    if [ $tries -gt $((600 + n / 10)) ] || ! kill -0 "$PID" 2>/dev/null; then
+      echo "Links did not come up" >&2
+      tail -n 5 "$WORK/log" >&2
+      exit 1
+    fi
+    sleep 0.1
+  done
+  sleep "$WARMUP"
+
+  a=$(dump)
+  cpu_a=$(cpu_ns)
+  wake_a=$(wakeups)
+  sleep "$DURATION"
+  b=$(dump)
+  cpu_b=$(cpu_ns)
+  wake_b=$(wakeups)
+  rss=$(awk '/^VmRSS/ { print $2 }' "/proc/$PID/status")
+  nfds=$(fds)
+
+  set -- $(counters $a) $(counters $b)
+
+  # Loopback answers take microseconds, so the round trip tupperware
+  # measures is almost all its own overhead. RTTs are over the whole
+  # run, everything else over the measured window only.
+  tail -n +$b "$WORK/log" |
+  awk -v n=$n -v options="$OPTIONS" -v interval=$INTERVAL \
+      -v duration=$DURATION -v cpu=$((cpu_b - cpu_a)) \
+      -v wakes=$((wake_b - wake_a)) \
+      -v probes=$(($3 - $1)) -v replies=$(($4 - $2)) -v rss=$rss \
+      -v fds=$nfds \
+      -v rev="$(git -C "$(dirname "$0")" rev-parse --short HEAD 2>/dev/null)" \
+      -v kernel="$(uname -r)" -v now="$(date -u +%Y-%m-%dT%H:%M:%SZ)" '
+    $4 ~ /^[0-9]+\/[0-9]+$/ && $5 ~ /%$/ {
+      split($4, rs, "/")
+      if (rs[1] > 0) { rtt += $6; sections++ }
+    }
+    / sockets, / { sockets = $1; syscalls = $(NF-1) }
+    END {
+      printf "{\"time\":\"%s\",\"revision\":\"%s\",\"kernel\":\"%s\"," \
+             "\"options\":\"%s\",\"tunnels\":%d,\"interval\":%s," \
+             "\"duration\":%s,\"probes\":%d,\"probes_per_second\":%.1f," \
+             "\"cpu_us_per_probe\":%.3f,\"wakeups_per_second\":%.1f," \
+             "\"rss_kb\":%d,\"sockets\":%d,\"fds\":%d," \
+             "\"syscalls_per_probe\":%s," \
+             "\"rtt_mean_ms\":%.4f,\"loss\":%.5f}\n",
+             now, rev, kernel, options, n, interval, duration, probes,
+             probes / duration,
+             probes ? cpu / 1e3 / probes : 0, wakes / duration,
+             rss, sockets, fds, syscalls, sections ? rtt / sections : 0,
+             probes ? 1 - replies / probes : 0
+    }' | tee -a "$OUTPUT"
+
+  kill "$PID"
+  wait "$PID" 2>/dev/null || true
+  PID=
+  ip netns del "$NS"
+}
+
+# Sets are read from their own descriptor so nothing run can eat them
+echo "$OPTION_SETS" | tr '|' '\n' > "$WORK/sets"
+while read -r OPTIONS <&3; do
+  for n in $TUNNELS; do
+    run $n
+  done
+done 3< "$WORK/sets"
@@ -1,6 +1,294 @@
 #include "common.h"
 #include <ev.h>
+#include <math.h>
 #include "ev_icmp.h"
+#include "heap.h"
+#include "wheel.h"
+
+#define WHEEL_SLOTS 4096
+
+struct shared_watcher {
+  struct icmp_shared *sh;
+  ev_io socket;
+  struct shared_watcher *next;
+};
+
+static __thread struct shared_watcher *shared_watchers = NULL;
+static __thread ev_prepare flusher;
+
+/* When tick is set every interval and timeout deadline lives in one
+ * timing wheel, driven by a single libev timer, instead of two libev
+ * timers per handle. With a clock but no tick they live in a heap
+ * shaped like libev's own, since libev's timers run on the wall clock.
+ * Like the shared watchers it belongs to the thread running the loop. */
+static __thread struct {
+  double tick;
+  struct wheel *w;
+  struct heap *h;
+  struct ev_loop *loop;
+  ev_timer driver;
+  ev_tstamp wakeup;
+  int running;
+  /* Stands in for ev_now() when set, so a simulation can run the
+   * scheduler on a virtual clock */
+  ev_tstamp (*clock)(struct ev_loop *);
+} sched;
+
+static void icmp_interval(struct ev_loop *loop, struct icmp_ev_handle *lh);
+static void icmp_timeout(struct ev_loop *loop, struct icmp_ev_handle *lh);
+
+static ev_tstamp loop_now(
+    struct ev_loop *loop)
+{
+  return sched.clock ? sched.clock(loop) : ev_now(loop);
+}
+
+/* Deadlines are kept by ev_icmp rather than by libev */
+static int scheduled(
+    void)
+{
+  return sched.tick || sched.clock;
+}
+
+static void sched_reschedule(
+    struct ev_loop *loop)
+{
+  ev_tstamp next = ev_icmp_next();
+  ev_tstamp now = loop_now(loop);
+
+  ev_timer_stop(loop, &sched.driver);
+  if (next < 0.0)
+    return;
+
+  sched.wakeup = next;
+  ev_timer_set(&sched.driver, next > now ? next - now : 0.0, 0.0);
+  ev_timer_start(loop, &sched.driver);
+}
+
+static void sched_driver_cb(
+    struct ev_loop *loop,
+    ev_timer *w,
+    int revents)
+{
+  ev_icmp_advance(loop);
+}
+
+static void wheel_interval_cb(
+    struct wheel_timer *t,
+    void *data)
+{
+  icmp_interval(sched.loop, data);
+}
+
+static void wheel_timeout_cb(
+    struct wheel_timer *t,
+    void *data)
+{
+  icmp_timeout(sched.loop, data);
+}
+
+static void heap_interval_cb(
+    struct heap_timer *t,
+    void *data)
+{
+  icmp_interval(sched.loop, data);
+}
+
+static void heap_timeout_cb(
+    struct heap_timer *t,
+    void *data)
+{
+  icmp_timeout(sched.loop, data);
+}
+
+static void sched_driver_arm(
+    struct ev_loop *loop,
+    ev_tstamp at)
+{
+  if (!sched.running &&
+      (!ev_is_active(&sched.driver) || at < sched.wakeup))
+    sched_reschedule(loop);
+}
+
+static void wheel_arm(
+    struct ev_loop *loop,
+    struct wheel_timer *t,
+    ev_tstamp at)
+{
+  if (!sched.w) {
+    sched.w = wheel_create(sched.tick, WHEEL_SLOTS, loop_now(loop));
+    assert(sched.w);
+    sched.loop = loop;
+    ev_timer_init(&sched.driver, sched_driver_cb, 0.0, 0.0);
+  }
+
+  wheel_add(sched.w, t, at);
+  sched_driver_arm(loop, at);
+}
+
+static void heap_arm(
+    struct ev_loop *loop,
+    struct heap_timer *t,
+    ev_tstamp at)
+{
+  ev_tstamp now = loop_now(loop);
+
+  if (!sched.h) {
+    sched.h = heap_create();
+    assert(sched.h);
+    sched.loop = loop;
+    ev_timer_init(&sched.driver, sched_driver_cb, 0.0, 0.0);
+  }
+
+  /* As the libev timers would be, and so never due again at once */
+  if (at <= now)
+    at = now + 0.001;
+  heap_add(sched.h, t, at);
+  sched_driver_arm(loop, at);
+}
+
+static void timeout_set(
+    struct ev_loop *loop,
+    struct icmp_ev_handle *lh,
+    ev_tstamp at)
+{
+  ev_tstamp now = loop_now(loop);
+
+  if (sched.tick) {
+    wheel_arm(loop, &lh->wheel_timeout, at);
+    return;
+  }
+  if (sched.clock) {
+    heap_arm(loop, &lh->heap_timeout, at);
+    return;
+  }
+
+  lh->timeout.repeat = at - now;
+  if (lh->timeout.repeat <= 0.0)
+    lh->timeout.repeat = 0.001;
+  ev_timer_again(loop, &lh->timeout);
+}
+
+static void timeout_clear(
+    struct ev_loop *loop,
+    struct icmp_ev_handle *lh)
+{
+  if (sched.w)
+    wheel_del(sched.w, &lh->wheel_timeout);
+  if (sched.h)
+    heap_del(sched.h, &lh->heap_timeout);
+  ev_timer_stop(loop, &lh->timeout);
+}
+
+static void interval_set(
+    struct icmp_ev_handle *lh,
+    ev_tstamp interval)
+{
+  __atomic_store(&lh->effective, &interval, __ATOMIC_RELAXED);
+  lh->interval.repeat = interval;
+}
+
+/* The coarsest point of a power of two grid in [at, at + slack]. Every
+ * handle due within the same step of the grid lands on one instant, so
+ * they fire together, and none fires before it is due. */
+static ev_tstamp slack_deadline(
+    ev_tstamp at,
+    ev_tstamp slack)
+{
+  ev_tstamp grid;
+
+  if (slack <= 0.0)
+    return at;
+  grid = ldexp(1.0, ilogb(slack));
+  return ceil(at / grid) * grid;
+}
+
+/* Arms the interval timer for next_probe, moved within the slack */
+static void interval_arm(
+    struct ev_loop *loop,
+    struct icmp_ev_handle *lh)
+{
+  ev_tstamp at = slack_deadline(lh->next_probe, lh->slack);
+
+  if (sched.tick) {
+    wheel_arm(loop, &lh->wheel_interval, at);
+    return;
+  }
+  if (sched.clock) {
+    heap_arm(loop, &lh->heap_interval, at);
+    return;
+  }
+
+  lh->interval.repeat = at - loop_now(loop);
+  if (lh->interval.repeat <= 0.0)
+    lh->interval.repeat = 0.001;
+  ev_timer_again(loop, &lh->interval);
+}
+
+/* Past backoff_after misses in a row every further one doubles the
+ * interval, up to backoff_max. The new interval applies from the next
+ * probe on. */
+static void backoff_miss(
+    struct icmp_ev_handle *lh)
+{
+  ev_tstamp next;
+
+  if (!lh->backoff_after)
+    return;
+  if (lh->misses < lh->backoff_after)
+    lh->misses++;
+  if (lh->misses < lh->backoff_after)
+    return;
+
+  next = lh->effective * 2;
+  if (next > lh->backoff_max)
+    next = lh->backoff_max;
+  if (next != lh->effective)
+    interval_set(lh, next);
+}
+
+/* A reply puts the configured interval back straight away */
+static void backoff_reset(
+    struct ev_loop *loop,
+    struct icmp_ev_handle *lh)
+{
+  lh->misses = 0;
+  if (lh->effective == lh->ic->interval)
+    return;
+
+  interval_set(lh, lh->ic->interval);
+  if (!lh->active)
+    return;
+  lh->next_probe = loop_now(loop) + lh->effective;
+  interval_arm(loop, lh);
+}
+
+static void icmp_reply(
+    struct ev_loop *loop,
+    struct icmp_ev_handle *lh,
+    int seqno,
+    ev_tstamp rtt)
+{
+  struct icmp_socket *ic = lh->ic;
+
+  if (seqno < 0) {
+    backoff_miss(lh);
+    if (lh->cb)
+      lh->cb(lh->data, seqno, -1.0);
+  }
+  else if (seqno) {
+    backoff_reset(loop, lh);
+    if (lh->cb)
+      lh->cb(lh->data, seqno, rtt);
+  }
+
+  if (ic->timeout) {
+    if (ic->results_len == 0) 
+      timeout_clear(loop, lh);
+    else
+      timeout_set(loop, lh, icmp_socket_oldest(ic) + ic->timeout);
+  }
+}
 
 static void icmp_receive_cb(
     struct ev_loop *loop,
@@ -8,112 +296,324 @@ static void icmp_receive_cb(
     int revents)
 {
   struct icmp_ev_handle *lh = w->data;
-  struct icmp_socket *ic = lh->ic;
-  ev_tstamp now = ev_now(loop);
-  ev_tstamp then;
+  ev_tstamp rtt;
+  int seqno;
+
+  seqno = icmp_socket_recv(lh->ic, &rtt);
+  if (seqno < 0 && errno == EAGAIN)
+    return;
+  icmp_reply(loop, lh, seqno, rtt);
+}
+
+static void icmp_shared_receive_cb(
+    struct ev_loop *loop,
+    ev_io *w,
+    int revents)
+{
+  struct shared_watcher *sw = w->data;
+  struct icmp_socket *ic;
+  ev_tstamp rtt;
   int seqno;
 
-  seqno = icmp_socket_recv(ic, &then);
-  if (seqno < 0 && lh->cb)
-    lh->cb(lh->data, seqno, -1.0);
+  while ((seqno = icmp_shared_recv(sw->sh, &ic, &rtt)) >= 0) {
+    if (ic)
+      icmp_reply(loop, ic->data, seqno, rtt);
+  }
+}
+
+static void shared_flush_cb(
+    struct ev_loop *loop,
+    ev_prepare *w,
+    int revents)
+{
+  struct shared_watcher *sw;
 
-  if (seqno && lh->cb)
-    lh->cb(lh->data, seqno, now-then);
+  for (sw=shared_watchers; sw != NULL; sw=sw->next) {
+    if (sw->sh->tx.len)
+      icmp_shared_flush(sw->sh);
+  }
+}
 
-  if (ic->timeout) {
-    if (ic->results_len == 0) 
-      ev_timer_stop(loop, &lh->timeout);
-    else {
-      assert((ic->results->sent_time + ic->timeout) - now > 0.0);
-      lh->timeout.repeat = (ic->results->sent_time + ic->timeout) - now;
-      ev_timer_again (loop, &lh->timeout);
+static void shared_watcher_start(
+    struct ev_loop *loop,
+    struct icmp_shared *sh)
+{
+  struct shared_watcher *sw;
+
+  /* Probes that come due during one loop iteration are sent together
+   * just before the loop blocks again */
+  if (sh->batch && !ev_is_active(&flusher)) {
+    ev_prepare_init(&flusher, shared_flush_cb);
+    ev_prepare_start(loop, &flusher);
+  }
+
+  for (sw=shared_watchers; sw != NULL; sw=sw->next) {
+    if (sw->sh == sh)
+      break;
+  }
+
+  if (!sw) {
+    sw = malloc(sizeof(*sw));
+    assert(sw);
+    sw->sh = sh;
+    ev_io_init(&sw->socket, icmp_shared_receive_cb, sh->fd, EV_READ);
+    sw->socket.data = sw;
+    sw->next = shared_watchers;
+    shared_watchers = sw;
+  }
+
+  ev_io_start(loop, &sw->socket);
+}
+
+static void shared_watcher_put(
+    struct ev_loop *loop,
+    struct icmp_shared *sh)
+{
+  struct shared_watcher **pp, *sw;
+
+  /* Only the last user takes the watcher down with the socket */
+  if (sh->refs > 1)
+    return;
+
+  for (pp=&shared_watchers; *pp != NULL; pp=&(*pp)->next) {
+    if ((*pp)->sh == sh) {
+      sw = *pp;
+      *pp = sw->next;
+      ev_io_stop(loop, &sw->socket);
+      free(sw);
+      return;
     }
   }
 }
 
 
-static void  icmp_timeout_cb(
+static void icmp_timeout(
   struct ev_loop *loop,
-  ev_timer *w,
-  int revents)
+  struct icmp_ev_handle *lh)
 {
-  struct icmp_ev_handle *lh = w->data;
   struct icmp_socket *ic = lh->ic;
   int seqno;
-  ev_tstamp now = ev_now(loop);
-
-  if (!ic->timeout)
-    ev_timer_stop(loop, &lh->timeout);
-
+  ev_tstamp now = loop_now(loop);
 
   while ((seqno = icmp_socket_timeout(ic, now)) != 0) {
+    backoff_miss(lh);
     if (lh->cb)
       lh->cb(lh->data, seqno, -1.0);
   }
 
-  if (ic->results_len > 0) {
-    lh->timeout.repeat = (ic->results->sent_time + ic->timeout) - now;
-    ev_timer_again(loop, &lh->timeout);
-  }
+  if (ic->timeout && ic->results_len > 0)
+    timeout_set(loop, lh, icmp_socket_oldest(ic) + ic->timeout);
   else 
-    ev_timer_stop(loop, &lh->timeout);
+    timeout_clear(loop, lh);
 
 }
 
-static void icmp_interval_cb(
+static void icmp_interval(
   struct ev_loop *loop,
-  ev_timer *w,
-  int revents)
+  struct icmp_ev_handle *lh)
 {
-  struct icmp_ev_handle *lh = w->data;
   struct icmp_socket *ic = lh->ic;
-  ev_tstamp now = ev_now(loop);
+  ev_tstamp now = loop_now(loop), late = 0.0;
+  /* Otherwise libev repeats the timer by itself */
+  int rearm = scheduled() || lh->slack > 0.0;
 
-  if (icmp_socket_send(ic, now) < 0 && lh->cb)
-    lh->cb(lh->data, 0, -1.0);
+  if (rearm) {
+    late = now - lh->next_probe;
+    lh->next_probe += lh->effective;
+    if (lh->next_probe < now)
+      lh->next_probe = now;
+    interval_arm(loop, lh);
+  }
+
+  if (lh->suppress && lh->suppress(lh->data, now))
+    return;
+
+  if (icmp_socket_send(ic, now) < 0) {
+    backoff_miss(lh);
+    if (lh->cb)
+      lh->cb(lh->data, 0, -1.0);
+  }
+  else if (rearm) {
+    icmp_counters.scheduled++;
+    if (late > 0.0)
+      icmp_counters.late_ns += (uint64_t)(late * 1e9);
+  }
 
   if (ic->timeout) {
-    if (ic->results_len == 1) {
-      ev_timer_set(&lh->timeout, ic->timeout, 0.0);
-      ev_timer_start(loop, &lh->timeout);
-    }
+    if (ic->results_len == 1)
+      timeout_set(loop, lh, now + ic->timeout);
   }
 
 }
 
+static void  icmp_timeout_cb(
+  struct ev_loop *loop,
+  ev_timer *w,
+  int revents)
+{
+  icmp_timeout(loop, w->data);
+}
+
+static void icmp_interval_cb(
+  struct ev_loop *loop,
+  ev_timer *w,
+  int revents)
+{
+  icmp_interval(loop, w->data);
+}
+
+
+int ev_icmp_scheduler(
+    double tick)
+{
+  if (sched.w || sched.h)
+    return 0;
+  if (tick < 0.0)
+    return 0;
+
+  sched.tick = tick;
+  return 1;
+}
+
+
+void ev_icmp_clock(
+    ev_tstamp (*now)(struct ev_loop *))
+{
+  sched.clock = now;
+}
+
+/* When the wheel or heap next has work, or -1 if neither has any. The
+ * scheduler's own timer does the same, but a caller driving time
+ * itself can run them with ev_icmp_advance() instead of running the
+ * loop. */
+ev_tstamp ev_icmp_next(
+    void)
+{
+  if (sched.w)
+    return wheel_next(sched.w);
+  if (sched.h)
+    return heap_next(sched.h);
+  return -1.0;
+}
+
+void ev_icmp_advance(
+    struct ev_loop *loop)
+{
+  if (!sched.w && !sched.h)
+    return;
+
+  sched.running = 1;
+  if (sched.w)
+    wheel_advance(sched.w, loop_now(loop));
+  else
+    heap_advance(sched.h, loop_now(loop));
+  sched.running = 0;
+  sched_reschedule(loop);
+}
+
+
+/* after is the number of misses in a row before backing off, 0 for
+ * never */
+void ev_icmp_backoff(
+    ev_icmp *h,
+    int after,
+    double max)
+{
+  h->backoff_after = after;
+  h->backoff_max = max > h->ic->interval ? max : h->ic->interval;
+}
+
+/* Takes effect from the next probe on */
+void ev_icmp_slack(
+    ev_icmp *h,
+    double slack)
+{
+  h->slack = slack > 0.0 ? slack : 0.0;
+}
+
+double ev_icmp_interval(
+    ev_icmp *h)
+{
+  double interval;
+
+  __atomic_load(&h->effective, &interval, __ATOMIC_RELAXED);
+  return interval;
+}
+
 
 int ev_icmp_init(
     ev_icmp *h,
     void (*icmp_callback)(void *, int, double),
-    char *addr,
+    const struct sockaddr *peer,
+    socklen_t len,
     double interval,
-    double timeout)
+    double timeout,
+    size_t outstanding,
+    int flags,
+    int netns)
 {
   assert(h);
-  h->ic = icmp_socket_create(addr, interval, timeout);
+  h->ic = icmp_socket_create(peer, len, interval, timeout, outstanding,
+                             flags, netns);
   if (!h->ic)
     return 0;
+  h->ic->data = h;
 
   ev_io_init(&h->socket, icmp_receive_cb, h->ic->fd, EV_READ);
   ev_timer_init(&h->interval, icmp_interval_cb, 0.0, interval);
   ev_timer_init(&h->timeout, icmp_timeout_cb, timeout, 0.0);
+  wheel_timer_init(&h->wheel_interval, wheel_interval_cb, h);
+  wheel_timer_init(&h->wheel_timeout, wheel_timeout_cb, h);
+  heap_timer_init(&h->heap_interval, heap_interval_cb, h);
+  heap_timer_init(&h->heap_timeout, heap_timeout_cb, h);
   h->interval.data = h;
   h->timeout.data = h;
   h->socket.data = h;
   h->cb = icmp_callback;
+  h->suppress = NULL;
+  h->effective = interval;
+  h->misses = 0;
+  h->backoff_after = 0;
+  h->backoff_max = interval;
+  h->slack = 0.0;
+  h->active = 0;
 
   return 1;
 }
 
 
+/* Probing carries on at the same pace; only what is in flight is lost */
+int ev_icmp_set_peer(
+    struct ev_loop *l,
+    ev_icmp *h,
+    const struct sockaddr *peer,
+    socklen_t len)
+{
+  if (icmp_socket_set_peer(h->ic, peer, len) < 0)
+    return -1;
+  timeout_clear(l, h);
+  return 0;
+}
+
+/* Takes effect from the next ev_icmp_start() */
+void ev_icmp_set_device(
+    ev_icmp *h,
+    const char *name,
+    int ifindex)
+{
+  icmp_socket_set_device(h->ic, name, ifindex);
+}
+
+
 void ev_icmp_destroy(
     struct ev_loop *l,
     ev_icmp *h)
 {
-  ev_io_stop(l, &h->socket);
-  ev_timer_stop(l, &h->interval);
-  ev_timer_stop(l, &h->timeout);
+  ev_icmp_stop(l, h);
+  if (h->ic->shared)
+    shared_watcher_put(l, h->ic->shared);
   icmp_socket_destroy(h->ic);
+  h->ic = NULL;
 
   return;
 }
@@ -123,9 +623,27 @@ void ev_icmp_start(
     struct ev_loop *l,
     ev_icmp *h)
 {
+  if (h->active)
+    return;
+  h->active = 1;
+
+  /* A link coming up is a fresh start */
+  h->misses = 0;
+  interval_set(h, h->ic->interval);
+
   icmp_socket_recreate(h->ic);
-  ev_io_init(&h->socket, icmp_receive_cb, h->ic->fd, EV_READ);
-  ev_timer_start(l, &h->interval); 
+  if (h->ic->shared)
+    shared_watcher_start(l, h->ic->shared);
+  else {
+    ev_io_set(&h->socket, h->ic->fd, EV_READ);
+    ev_io_start(l, &h->socket);
+  }
+
+  h->next_probe = loop_now(l);
+  if (scheduled() || h->slack > 0.0)
+    interval_arm(l, h);
+  else
+    ev_timer_start(l, &h->interval); 
 }
 
 
@@ -133,7 +651,12 @@ void ev_icmp_stop(
     struct ev_loop *l,
     ev_icmp *h)
 {
+  h->active = 0;
   ev_io_stop(l, &h->socket);
   ev_timer_stop(l, &h->interval);
-  ev_timer_stop(l, &h->timeout);
+  if (sched.w)
+    wheel_del(sched.w, &h->wheel_interval);
+  if (sched.h)
+    heap_del(sched.h, &h->heap_interval);
+  timeout_clear(l, h);
 }
@@ -1,19 +1,50 @@
 #ifndef _EV_ICMP_H_
 #define _EV_ICMP_H_
 #include <ev.h>
+#include "heap.h"
 #include "icmp.h"
+#include "wheel.h"
 
 typedef struct icmp_ev_handle {
   struct icmp_socket *ic;
   ev_io socket;
   ev_timer interval;
   ev_timer timeout;
+  struct wheel_timer wheel_interval;
+  struct wheel_timer wheel_timeout;
+  struct heap_timer heap_interval;
+  struct heap_timer heap_timeout;
+  ev_tstamp next_probe;
+  /* The interval probes are actually sent at, which grows while the
+   * target keeps missing and is read by other threads for stats */
+  ev_tstamp effective;
+  int misses;
+  int backoff_after;
+  ev_tstamp backoff_max;
+  /* Probes may go out up to this much after they are due, so probes
+   * due close together share a wakeup */
+  ev_tstamp slack;
+  int active;
   void *data;
   void (*cb)(void *, int seq, double rtt);
+  /* Asked before each probe, if set; nonzero skips that probe */
+  int (*suppress)(void *, ev_tstamp now);
 } ev_icmp;
 
 int ev_icmp_init(ev_icmp *h, void (*cb)(void *,int,double), 
-                               char *, double i, double t);
+                               const struct sockaddr *peer, socklen_t len,
+                               double i, double t,
+                               size_t outstanding, int flags, int netns);
+int ev_icmp_set_peer(struct ev_loop *l, ev_icmp *h,
+                     const struct sockaddr *peer, socklen_t len);
+void ev_icmp_set_device(ev_icmp *h, const char *name, int ifindex);
+int ev_icmp_scheduler(double tick);
+void ev_icmp_clock(ev_tstamp (*now)(struct ev_loop *));
+ev_tstamp ev_icmp_next(void);
+void ev_icmp_advance(struct ev_loop *l);
+void ev_icmp_backoff(ev_icmp *h, int after, double max);
+void ev_icmp_slack(ev_icmp *h, double slack);
+double ev_icmp_interval(ev_icmp *h);
 void ev_icmp_destroy(struct ev_loop *l, ev_icmp *h);
 void ev_icmp_start(struct ev_loop *l, ev_icmp *h);
 void ev_icmp_stop(struct ev_loop *l, ev_icmp *h);
@@ -1,52 +1,283 @@
 #include "common.h"
 #include <ev.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 #include "ev_link.h"
 
+#ifndef SOL_NETLINK
+#define SOL_NETLINK 270
+#endif
+
+static void ev_link_stale(
+    ev_link *h)
+{
+  (h->root ? h->root : h)->dirty = 1;
+}
+
+static void ev_link_change(
+    void *data,
+    char *name,
+    int ifindex,
+    int state)
+{
+  ev_link *h = data;
+  struct dev *d;
+  int index = -1;
+
+  d = h->devices[link_hash_name(name) & (EV_LINK_BUCKETS - 1)];
+  for (; d != NULL; d=d->next) {
+    if (strncmp(d->device, name, IFNAMSIZ) != 0)
+      continue;
+
+    /* A watched name now resolving to another ifindex leaves the
+     * kernel filter stale */
+    if (index < 0)
+      index = link_index(h->table, name);
+    if (d->ifindex != index)
+      ev_link_stale(h);
+
+    if (d->state != state) {
+      d->state = state;
+      h->changes++;
+      if (h->state_change_callback)
+        h->state_change_callback(d->data, d->device, ifindex, d->state);
+    }
+  }
+}
+
+/* Events arriving on the aggregating socket are handed to the watcher
+ * of the namespace they came from */
+static int ev_link_route(
+    void *data,
+    int nsid,
+    struct link_table **t,
+    void **arg)
+{
+  ev_link *h = data, *p;
+
+  if (nsid == h->nsid)
+    return 1;
+  for (p=h->peers; p != NULL; p=p->next) {
+    if (p->nsid == nsid) {
+      *t = p->table;
+      *arg = p;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static size_t collect_devices(
+    ev_link *h,
+    char **names,
+    int *indexes,
+    size_t *nindexes)
+{
+  struct dev *d, *o;
+  size_t i, nnames = 0;
+
+  for (i=0; i < EV_LINK_BUCKETS; i++) {
+    for (d=h->devices[i]; d != NULL; d=d->next) {
+      d->ifindex = link_index(h->table, d->device);
+      for (o=h->devices[i]; o != d; o=o->next) {
+        if (strncmp(o->device, d->device, IFNAMSIZ) == 0)
+          break;
+      }
+      if (o != d)
+        continue;
+      names[nnames++] = d->device;
+      if (d->ifindex)
+        indexes[(*nindexes)++] = d->ifindex;
+    }
+  }
+  return nnames;
+}
+
+/* Rebuild the kernel filter from the watched names and whatever
+ * ifindexes those names currently resolve to. A socket aggregating
+ * other namespaces carries their devices too. */
+static void ev_link_refilter(
+    ev_link *h)
+{
+  ev_link *p;
+  char **names = NULL;
+  int *indexes = NULL;
+  size_t ndevices, nnames = 0, nindexes = 0;
+
+  if (h->root)
+    h = h->root;
+  h->dirty = 0;
+  if (!h->filter)
+    return;
+
+  ndevices = h->ndevices;
+  for (p=h->peers; p != NULL; p=p->next)
+    ndevices += p->ndevices;
+
+  names = calloc(ndevices + 1, sizeof(*names));
+  indexes = calloc(ndevices + 1, sizeof(*indexes));
+  if (!names || !indexes)
+    goto fail;
+
+  nnames = collect_devices(h, names, indexes, &nindexes);
+  for (p=h->peers; p != NULL; p=p->next)
+    nnames += collect_devices(p, names + nnames, indexes, &nindexes);
+
+  if (link_filter(h->fd, indexes, nindexes, names, nnames) < 0)
+    goto fail;
+
+  if (h->unfiltered)
+    warnx("Filtering link events again");
+  h->unfiltered = 0;
+  free(names);
+  free(indexes);
+  return;
+
+fail:
+  /* A filter left over from fewer devices would hide the new ones */
+  if (!h->unfiltered) {
+    warn("Cannot filter link events for %zu devices, receiving all of "
+         "them", ndevices);
+    h->unfiltered = 1;
+    h->fallbacks++;
+  }
+  if (link_unfilter(h->fd) < 0)
+    warn("Cannot remove link event filter");
+  free(names);
+  free(indexes);
+}
+
+static void ev_link_refresh(
+    struct ev_loop *l,
+    ev_prepare *w,
+    int revents)
+{
+  ev_link *h = w->data;
+
+  if (h->dirty)
+    ev_link_refilter(h);
+}
+
+
 static void ev_link_recv(
     struct ev_loop *l,
     ev_io *w,
     int revents)
 {
-  int newstate = 0;
-  struct dev *d;
+  ev_link *h = w->data, *p;
+  unsigned long overruns = h->table->overruns;
+  struct timespec start, end;
 
-  ev_link *h = w->data;
-  if (link_recv(h->fd)) {
-    for (d=h->devices; d != NULL; d=d->next) {
-      newstate = link_online(d->device);
-      if (d->state != newstate) {
-        d->state = newstate;
-        if (h->state_change_callback) {
-          h->state_change_callback(d->device, d->state);
-        }
-      }
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+  h->wakeups++;
+  if (link_recv(h->fd, h->table, ev_link_change, h) < 0)
+    warn("Cannot read link events");
+
+  /* Lost events may have belonged to any aggregated namespace. The
+   * overrun is counted once, on the socket that had it. */
+  if (h->table->overruns != overruns) {
+    for (p=h->peers; p != NULL; p=p->next) {
+      if (link_resync(p->fd, p->table, 1) < 0)
+        warn("Cannot request link dump");
     }
   }
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+  h->cpu += (double)(end.tv_sec - start.tv_sec) +
+            (double)(end.tv_nsec - start.tv_nsec) / 1e9;
 }
 
 int ev_link_init(
-    ev_link *h, 
-    void (*cb)(char *, int))
+    ev_link *h,
+    void (*cb)(void *, char *, int, int),
+    int rcvbuf,
+    int filter,
+    int netns)
 {
   memset(h, 0, sizeof(*h));
-  h->fd = link_socket();
-  if (h->fd < 0)
+  h->fd = -1;
+  h->nsid = -1;
+  h->table = link_table_create();
+  if (!h->table)
+    return 0;
+
+  h->fd = link_socket(rcvbuf, netns);
+  if (h->fd < 0) {
+    link_table_destroy(h->table);
+    h->table = NULL;
     return 0;
+  }
 
   ev_io_init(&h->socket, ev_link_recv, h->fd, EV_READ);
   h->socket.data = h;
+  ev_prepare_init(&h->refresh, ev_link_refresh);
+  h->refresh.data = h;
   h->state_change_callback = cb;
+  h->filter = filter;
+  h->netns = netns;
+
+  return 1;
+}
+
+/* Have root's socket deliver h's events as well, so every namespace is
+ * served by one subscription. h keeps its own socket for dumps. Returns
+ * 0 if the kernel cannot do this, and h then listens for itself. */
+int ev_link_aggregate(
+    ev_link *root,
+    ev_link *h)
+{
+  int on = 1, group = RTNLGRP_LINK, self = -1;
+
+  if (root->listen_all < 0 || h->netns < 0)
+    return 0;
+
+  if (!root->listen_all) {
+    if (setsockopt(root->fd, SOL_NETLINK, NETLINK_LISTEN_ALL_NSID,
+                   &on, sizeof(on)) < 0) {
+      root->listen_all = -1;
+      return 0;
+    }
+    self = open("/proc/self/ns/net", O_RDONLY|O_CLOEXEC);
+    if (self > -1) {
+      root->nsid = link_nsid(self, 0);
+      close(self);
+    }
+    root->table->route = ev_link_route;
+    root->table->route_data = root;
+    root->listen_all = 1;
+  }
+
+  h->nsid = link_nsid(h->netns, 1);
+  if (h->nsid < 0)
+    return 0;
+  if (setsockopt(h->fd, SOL_NETLINK, NETLINK_DROP_MEMBERSHIP,
+                 &group, sizeof(group)) < 0)
+    return 0;
 
+  h->root = root;
+  h->next = root->peers;
+  root->peers = h;
+  ev_link_stale(root);
   return 1;
 }
 
 
 void ev_link_start(
-    struct ev_loop *l, 
+    struct ev_loop *l,
     ev_link *h)
 {
+  /* The root's filter covers its peers and is rebuilt by the root */
+  if (h->root)
+    ev_link_stale(h);
+  else {
+    ev_link_refilter(h);
+    ev_prepare_start(l, &h->refresh);
+  }
   ev_io_start(l, &h->socket);
-  link_send(h->fd);
+  if (link_resync(h->fd, h->table, 0) < 0)
+    warn("Cannot request link dump");
 }
 
 void ev_link_stop(
@@ -54,22 +285,89 @@ void ev_link_stop(
     ev_link *h)
 {
   ev_io_stop(l, &h->socket);
+  ev_prepare_stop(l, &h->refresh);
 }
 
 void ev_link_add_device(
     ev_link *h,
-    char *device)
+    char *device,
+    void *data)
 {
   struct dev *d = NULL;
+  size_t b;
+
   d = malloc(sizeof(*d));
   assert(d);
 
-  strncpy(d->device, device, 31);
-  d->state = link_online(device);
-  d->next = h->devices;
-  h->devices = d;
+  memset(d, 0, sizeof(*d));
+  strncpy(d->device, device, IFNAMSIZ-1);
+  d->state = link_online(h->table, device);
+  d->data = data;
+
+  b = link_hash_name(d->device) & (EV_LINK_BUCKETS - 1);
+  d->next = h->devices[b];
+  h->devices[b] = d;
+  h->ndevices++;
+  ev_link_stale(h);
+
+  /* Added while running: the link may already be up */
+  if (d->state && h->state_change_callback)
+    h->state_change_callback(d->data, d->device,
+                             link_index(h->table, device), d->state);
+}
+
+void ev_link_remove_device(
+    ev_link *h,
+    char *device,
+    void *data)
+{
+  struct dev *d, **pp;
+
+  pp = &h->devices[link_hash_name(device) & (EV_LINK_BUCKETS - 1)];
+  for (; *pp != NULL; pp=&(*pp)->next) {
+    d = *pp;
+    if (d->data == data && strncmp(d->device, device, IFNAMSIZ) == 0) {
+      *pp = d->next;
+      free(d);
+      h->ndevices--;
+      ev_link_stale(h);
+      return;
+    }
+  }
 }
 
 
-//void ev_link_destroy(struct ev_loop *l, ev_link *h);
+void ev_link_destroy(
+    struct ev_loop *l,
+    ev_link *h)
+{
+  ev_link **pp, *p;
+  struct dev *d, *next;
+  size_t i;
+
+  ev_link_stop(l, h);
+
+  if (h->root) {
+    for (pp=&h->root->peers; *pp != NULL; pp=&(*pp)->next) {
+      if (*pp == h) {
+        *pp = h->next;
+        break;
+      }
+    }
+    ev_link_stale(h->root);
+  }
+  for (p=h->peers; p != NULL; p=p->next)
+    p->root = NULL;
+
+  for (i=0; i < EV_LINK_BUCKETS; i++) {
+    for (d=h->devices[i]; d != NULL; d=next) {
+      next = d->next;
+      free(d);
+    }
+  }
 
+  close(h->fd);
+  link_table_destroy(h->table);
+  memset(h, 0, sizeof(*h));
+  h->fd = -1;
+}
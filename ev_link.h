@@ -3,21 +3,53 @@
 #include <ev.h>
 #include "link.h"
 
+#define EV_LINK_BUCKETS 256
+
 typedef struct link_ev_handle {
   int fd;
   ev_io socket;
-  void (*state_change_callback)(char *dev, int state);
+  struct link_table *table;
+  int netns;
+  int nsid;
+  int filter;
+  /* Set on the root when the kernel filter no longer matches the
+   * watched devices; it is rebuilt once per loop iteration */
+  int dirty;
+  ev_prepare refresh;
+  /* The filter did not fit and every event is let through until it
+   * does again; fallbacks counts the times that happened */
+  int unfiltered;
+  unsigned long fallbacks;
+  unsigned long wakeups;
+  unsigned long changes;
+  /* Thread CPU time spent reading and applying link events */
+  double cpu;
+  size_t ndevices;
+  void (*state_change_callback)(void *data, char *dev, int ifindex,
+                                int state);
   struct dev {
-    char device[32];
+    char device[IFNAMSIZ];
+    int ifindex;
     int state;
+    void *data;
     struct dev *next;
-  } *devices;
+  } *devices[EV_LINK_BUCKETS];
+
+  /* Namespaces whose events arrive on this socket, and the watcher
+   * whose socket carries ours */
+  int listen_all;
+  struct link_ev_handle *root;
+  struct link_ev_handle *peers;
+  struct link_ev_handle *next;
 } ev_link;
 
-int ev_link_init(ev_link *h, void (*cb)(char *, int));
+int ev_link_init(ev_link *h, void (*cb)(void *, char *, int, int),
+                 int rcvbuf, int filter, int netns);
+int ev_link_aggregate(ev_link *root, ev_link *h);
 void ev_link_destroy(struct ev_loop *l, ev_link *h);
 void ev_link_start(struct ev_loop *l, ev_link *h);
 void ev_link_stop(struct ev_loop *l, ev_link *h);
-void ev_link_add_device(ev_link *h, char *dev);
+void ev_link_add_device(ev_link *h, char *dev, void *data);
+void ev_link_remove_device(ev_link *h, char *dev, void *data);
 
 #endif
@@ -0,0 +1,168 @@
+#include "common.h"
+#include "heap.h"
+
+/* Index 0 marks a timer as not in the heap, so the root sits at 1 */
+#define HEAP_ROOT 1
+#define HEAP_PARENT(i) (((i) - HEAP_ROOT - 1) / 4 + HEAP_ROOT)
+#define HEAP_CHILD(i) (((i) - HEAP_ROOT) * 4 + HEAP_ROOT + 1)
+
+static void heap_place(
+    struct heap *h,
+    size_t i,
+    struct heap_node n)
+{
+  h->nodes[i] = n;
+  n.t->index = i;
+}
+
+static void heap_up(
+    struct heap *h,
+    size_t i)
+{
+  struct heap_node n = h->nodes[i];
+
+  while (i > HEAP_ROOT && h->nodes[HEAP_PARENT(i)].at > n.at) {
+    heap_place(h, i, h->nodes[HEAP_PARENT(i)]);
+    i = HEAP_PARENT(i);
+  }
+  heap_place(h, i, n);
+}
+
+static void heap_down(
+    struct heap *h,
+    size_t i)
+{
+  struct heap_node n = h->nodes[i];
+  size_t c, k, min;
+
+  for (;;) {
+    c = HEAP_CHILD(i);
+    if (c >= h->len + HEAP_ROOT)
+      break;
+
+    min = c;
+    for (k=c + 1; k < c + 4 && k < h->len + HEAP_ROOT; k++) {
+      if (h->nodes[k].at < h->nodes[min].at)
+        min = k;
+    }
+    if (h->nodes[min].at >= n.at)
+      break;
+
+    heap_place(h, i, h->nodes[min]);
+    i = min;
+  }
+  heap_place(h, i, n);
+}
+
+struct heap * heap_create(
+    void)
+{
+  struct heap *h = NULL;
+
+  h = malloc(sizeof(*h));
+  if (!h)
+    return NULL;
+  memset(h, 0, sizeof(*h));
+  return h;
+}
+
+void heap_destroy(
+    struct heap *h)
+{
+  if (!h)
+    return;
+
+  while (h->len)
+    heap_del(h, h->nodes[HEAP_ROOT].t);
+  free(h->nodes);
+  free(h);
+}
+
+void heap_timer_init(
+    struct heap_timer *t,
+    void (*cb)(struct heap_timer *, void *),
+    void *data)
+{
+  memset(t, 0, sizeof(*t));
+  t->cb = cb;
+  t->data = data;
+}
+
+int heap_pending(
+    struct heap_timer *t)
+{
+  return t->index != 0;
+}
+
+void heap_add(
+    struct heap *h,
+    struct heap_timer *t,
+    double at)
+{
+  struct heap_node *nodes;
+  size_t size;
+
+  /* Moving a pending timer is just a sift from where it is */
+  if (heap_pending(t)) {
+    h->nodes[t->index].at = at;
+    heap_up(h, t->index);
+    heap_down(h, t->index);
+    return;
+  }
+
+  if (h->len + HEAP_ROOT >= h->size) {
+    size = h->size ? h->size * 2 : 64;
+    nodes = realloc(h->nodes, size * sizeof(*nodes));
+    assert(nodes);
+    h->nodes = nodes;
+    h->size = size;
+  }
+
+  heap_place(h, h->len + HEAP_ROOT, (struct heap_node){ at, t });
+  h->len++;
+  heap_up(h, t->index);
+}
+
+void heap_del(
+    struct heap *h,
+    struct heap_timer *t)
+{
+  struct heap_node last;
+  size_t i = t->index;
+
+  if (!heap_pending(t))
+    return;
+
+  h->len--;
+  last = h->nodes[h->len + HEAP_ROOT];
+  t->index = 0;
+  if (last.t == t)
+    return;
+
+  heap_place(h, i, last);
+  heap_up(h, i);
+  heap_down(h, last.t->index);
+}
+
+/* Runs every timer due by now. A callback may add or cancel timers,
+ * itself included; one re-armed for now or earlier runs again. */
+void heap_advance(
+    struct heap *h,
+    double now)
+{
+  struct heap_timer *t;
+
+  while (h->len && h->nodes[HEAP_ROOT].at <= now) {
+    t = h->nodes[HEAP_ROOT].t;
+    heap_del(h, t);
+    t->cb(t, t->data);
+  }
+}
+
+double heap_next(
+    struct heap *h)
+{
+  if (h->len == 0)
+    return -1.0;
+  return h->nodes[HEAP_ROOT].at;
+}
@@ -0,0 +1,38 @@
+#ifndef _HEAP_H_
+#define _HEAP_H_
+#include "common.h"
+
+/* Timer heap with the wheel's interface, laid out as libev lays out its
+ * own timers: a 4-ary heap on absolute deadlines, each cached next to
+ * its timer so sifting never touches the timers. Insert and cancel are
+ * O(log n), the next deadline is O(1). */
+struct heap_timer {
+  size_t index;
+  void (*cb)(struct heap_timer *, void *);
+  void *data;
+};
+
+struct heap_node {
+  double at;
+  struct heap_timer *t;
+};
+
+struct heap {
+  size_t len;
+  size_t size;
+  struct heap_node *nodes;
+};
+
+struct heap * heap_create(void);
+void heap_destroy(struct heap *);
+
+void heap_timer_init(struct heap_timer *,
+                     void (*cb)(struct heap_timer *, void *), void *data);
+void heap_add(struct heap *, struct heap_timer *, double at);
+void heap_del(struct heap *, struct heap_timer *);
+int heap_pending(struct heap_timer *);
+
+void heap_advance(struct heap *, double now);
+double heap_next(struct heap *);
+
+#endif
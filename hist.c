@@ -0,0 +1,176 @@
+#include "common.h"
+#include "hist.h"
+
+static inline unsigned bucket_index(
+    uint32_t v)
+{
+  unsigned msb;
+
+  if (v < HIST_SUB)
+    return v;
+  msb = 31 - __builtin_clz(v);
+  return (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+         ((v >> (msb - HIST_SUB_BITS)) - HIST_SUB);
+}
+
+/* Largest value that lands in the bucket */
+static uint32_t bucket_value(
+    unsigned idx)
+{
+  unsigned group = idx / HIST_SUB;
+
+  if (group == 0)
+    return idx;
+  return (((uint32_t)(idx % HIST_SUB + HIST_SUB) + 1) << (group - 1)) - 1;
+}
+
+void hist_init(
+    struct hist *h)
+{
+  memset(h, 0, sizeof(*h));
+}
+
+void hist_record(
+    struct hist *h,
+    double rtt)
+{
+  double us = rtt * 1e6, d;
+  uint32_t v;
+
+  v = us >= HIST_MAX ? HIST_MAX : us < 0.0 ? 0 : (uint32_t)us;
+  h->buckets[bucket_index(v)]++;
+  h->sum += v;
+
+  if (h->count == 0) {
+    h->min = h->max = v;
+    h->ewma = rtt;
+  }
+  else {
+    if (v < h->min)
+      h->min = v;
+    if (v > h->max)
+      h->max = v;
+    h->ewma += (rtt - h->ewma) / 8.0;
+
+    d = rtt - h->last;
+    if (d < 0.0)
+      d = -d;
+    h->jitter += (d - h->jitter) / 16.0;
+  }
+
+  h->last = rtt;
+  h->count++;
+}
+
+/* p in [0, 1]. Returns seconds, rounded up to the bucket holding the
+ * sample of that rank and clamped to the exact extremes. */
+double hist_percentile(
+    const struct hist *h,
+    double p)
+{
+  uint64_t rank, seen = 0;
+  uint32_t v;
+  unsigned i;
+
+  if (h->count == 0)
+    return 0.0;
+
+  rank = (uint64_t)(p * (double)h->count + 0.5);
+  if (rank < 1)
+    rank = 1;
+  if (rank > h->count)
+    rank = h->count;
+
+  for (i=0; i < HIST_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= rank)
+      break;
+  }
+
+  v = bucket_value(i);
+  if (v > h->max)
+    v = h->max;
+  if (v < h->min)
+    v = h->min;
+  return (double)v / 1e6;
+}
+
+double hist_mean(
+    const struct hist *h)
+{
+  if (h->count == 0)
+    return 0.0;
+  return ((double)h->sum / (double)h->count) / 1e6;
+}
+
+/* Samples at or below each bound, for ascending bounds in seconds. A
+ * bucket counts towards a bound once its largest value is within it. */
+void hist_cumulative(
+    const struct hist *h,
+    const double *bounds,
+    size_t n,
+    uint64_t *counts)
+{
+  uint64_t seen = 0;
+  unsigned i = 0;
+  size_t b;
+
+  for (b=0; b < n; b++) {
+    for (; i < HIST_BUCKETS && bucket_value(i) <= bounds[b] * 1e6; i++)
+      seen += h->buckets[i];
+    counts[b] = seen;
+  }
+}
+
+
+void results_init(
+    struct probe_results *r)
+{
+  hist_init(&r->hist);
+  r->samples = 0;
+  r->failures = 0;
+  r->last_sent = 0;
+}
+
+/* A probe's outcome as ev_icmp reports it: a round trip, or none for a
+ * probe that failed to send or timed out */
+void results_record(
+    struct probe_results *r,
+    double now,
+    double rtt)
+{
+  r->last_sent = now;
+  if (rtt > 0.0)
+    hist_record(&r->hist, rtt);
+  else
+    r->failures++;
+  r->samples++;
+}
+
+/* Copy results another thread may be recording into. Every word is
+ * loaded whole, so no number is torn, but not all at one instant: the
+ * copy may mix adjacent probes and is only approximate. */
+void results_copy(
+    struct probe_results *to,
+    const struct probe_results *from)
+{
+  const struct hist *h = &from->hist;
+  size_t i;
+
+  to->samples = __atomic_load_n(&from->samples, __ATOMIC_RELAXED);
+  to->failures = __atomic_load_n(&from->failures, __ATOMIC_RELAXED);
+  __atomic_load(&from->last_sent, &to->last_sent, __ATOMIC_RELAXED);
+  to->hist.sum = __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+  to->hist.min = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+  to->hist.max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+  __atomic_load(&h->ewma, &to->hist.ewma, __ATOMIC_RELAXED);
+  __atomic_load(&h->jitter, &to->hist.jitter, __ATOMIC_RELAXED);
+  __atomic_load(&h->last, &to->hist.last, __ATOMIC_RELAXED);
+  /* The count is taken from the buckets copied, so percentiles and
+   * cumulative counts agree with it */
+  to->hist.count = 0;
+  for (i=0; i < HIST_BUCKETS; i++) {
+    to->hist.buckets[i] = __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+    to->hist.count += to->hist.buckets[i];
+  }
+}
@@ -0,0 +1,48 @@
+#ifndef _HIST_H_
+#define _HIST_H_
+#include "common.h"
+
+/* Log-linear latency histogram in microseconds. Values below
+ * HIST_SUB are counted exactly; above that every power of two is split
+ * into HIST_SUB equal buckets, so any value is reported within 1/16 of
+ * itself. Memory is fixed and recording a sample is O(1). */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 28
+#define HIST_MAX ((1u << HIST_MAX_BITS) - 1)
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist {
+  uint64_t count;
+  uint64_t sum;
+  uint32_t min;
+  uint32_t max;
+  /* Smoothed RTT (gain 1/8) and RFC 3550 interarrival jitter (gain
+   * 1/16) taken over consecutive replies, both in seconds */
+  double ewma;
+  double jitter;
+  double last;
+  uint32_t buckets[HIST_BUCKETS];
+};
+
+/* What is kept of a target's probes: the replies' round trips, and how
+ * many probes ended in a reply or a failure */
+struct probe_results {
+  struct hist hist;
+  int samples;
+  int failures;
+  double last_sent;
+};
+
+void hist_init(struct hist *);
+void hist_record(struct hist *, double rtt);
+double hist_percentile(const struct hist *, double p);
+double hist_mean(const struct hist *);
+void hist_cumulative(const struct hist *, const double *bounds, size_t n,
+                     uint64_t *counts);
+
+void results_init(struct probe_results *);
+void results_record(struct probe_results *, double now, double rtt);
+void results_copy(struct probe_results *, const struct probe_results *);
+
+#endif
@@ -1,26 +1,113 @@
 #include "common.h"
 #include "icmp.h"
+#include "netns.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/ip_icmp.h>
-#include <netdb.h>
+#include <netinet/icmp6.h>
 #include <errno.h>
 #include <err.h>
+#include <time.h>
+#include <sys/random.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
 
-#define ICMP_PAYLOAD "tupperware"
+#define ICMP_PACKET_LEN (sizeof(struct icmphdr) + sizeof(struct icmp_payload))
+#define ICMP_BUFFER_LEN 64
+#define ICMP_CONTROL_LEN 256
+#define ICMP_PKTINFO_LEN CMSG_SPACE(sizeof(struct in6_pktinfo))
 
-static int create_echo_packet(unsigned short seqno, void *data, int sz);
-static int create_icmp_socket(const char *addr);
-static int recreate_icmp_socket(int *fd);
+#ifndef SO_BINDTOIFINDEX
+#define SO_BINDTOIFINDEX 62
+#endif
+
+#define TSMODE_NONE 0
+#define TSMODE_RX 1
+#define TSMODE_RXTX 2
+
+struct rxstamp {
+  double sw;
+  double hw;
+};
+
+static int create_echo_packet(struct icmp_socket *ic, unsigned short seqno,
+                              void *data, int sz);
+static int create_icmp_socket(int family, struct sockaddr *peer,
+                              socklen_t len, int flags, int *tsmode,
+                              int netns);
+static int recreate_icmp_socket(struct icmp_socket *ic);
+
+__thread struct icmp_counters icmp_counters;
+static __thread struct icmp_shared *shared_sockets = NULL;
+
+static int kernel_socket(
+    int netns,
+    int family,
+    int type,
+    int protocol)
+{
+  return netns_socket(netns, family, type, protocol);
+}
+
+static int kernel_connect(
+    int fd,
+    const struct sockaddr *peer,
+    socklen_t len)
+{
+  return connect(fd, peer, len);
+}
+
+static int kernel_recvmmsg(
+    int fd,
+    struct mmsghdr *msgs,
+    unsigned int n,
+    int flags)
+{
+  return recvmmsg(fd, msgs, n, flags, NULL);
+}
+
+static uint64_t kernel_clock(
+    void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000000ull) + (uint64_t)ts.tv_nsec;
+}
+
+static double kernel_realtime(
+    void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+const struct icmp_transport icmp_transport_kernel = {
+  .socket = kernel_socket,
+  .close = close,
+  .setsockopt = setsockopt,
+  .connect = kernel_connect,
+  .sendmsg = sendmsg,
+  .sendmmsg = sendmmsg,
+  .recvmsg = recvmsg,
+  .recvmmsg = kernel_recvmmsg,
+  .clock = kernel_clock,
+  .realtime = kernel_realtime,
+};
+
+static const struct icmp_transport *transport = &icmp_transport_kernel;
 
 static int create_echo_packet(
+    struct icmp_socket *ic,
     unsigned short seqno, 
     void *data,
     int sz)
 {
-  if (sz < sizeof(struct icmphdr) + strlen(ICMP_PAYLOAD))
+  struct icmp_payload pl;
+
+  if (sz < sizeof(struct icmphdr) + sizeof(pl))
     return 0;
 
   if (!data)
@@ -29,94 +116,597 @@ static int create_echo_packet(
   char *payload = data + sizeof(struct icmphdr);
   struct icmphdr *rq = data;
 
-  rq->type = ICMP_ECHO;
+  /* An ICMPv6 echo is laid out as the ICMP one; only the types differ */
+  rq->type = ic->peer.ss_family == AF_INET6 ? ICMP6_ECHO_REQUEST : ICMP_ECHO;
   rq->code = 0;
   rq->un.echo.id = 0;
   rq->un.echo.sequence = htons(seqno);
-  memcpy(payload, ICMP_PAYLOAD, strlen(ICMP_PAYLOAD));
+
+  pl.sent = transport->clock();
+  pl.cookie = ic->cookie;
+  pl.generation = ic->generation;
+  memcpy(payload, &pl, sizeof(pl));
 
   return 1;
 }
 
+static int is_echo_reply(
+    int family,
+    const struct icmphdr *hdr)
+{
+  if (family == AF_INET6)
+    return hdr->type == ICMP6_ECHO_REPLY && hdr->code == 0;
+  return hdr->type == ICMP_ECHOREPLY && hdr->code == 0;
+}
+
+/* By index where the kernel allows it, so the name is never looked up */
+static int bind_device(
+    int fd,
+    const char *name,
+    int ifindex)
+{
+  if (transport->setsockopt(fd, SOL_SOCKET, SO_BINDTOIFINDEX, &ifindex,
+                            sizeof(ifindex)) == 0)
+    return 0;
+  if (errno != ENOPROTOOPT)
+    return -1;
+  return transport->setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, name,
+                               strlen(name) + 1);
+}
+
+/* Shared sockets cannot be bound to one device, so each probe says which
+ * device it leaves by. Clears the control data when there is none. */
+static void set_pktinfo(
+    struct icmp_socket *ic,
+    struct msghdr *msg,
+    void *control)
+{
+  struct cmsghdr *cm;
+  struct in_pktinfo pi;
+  struct in6_pktinfo pi6;
+
+  msg->msg_control = NULL;
+  msg->msg_controllen = 0;
+  if (!ic->ifindex)
+    return;
+
+  memset(control, 0, ICMP_PKTINFO_LEN);
+  msg->msg_control = control;
+  msg->msg_controllen = ICMP_PKTINFO_LEN;
+  cm = CMSG_FIRSTHDR(msg);
+  if (ic->peer.ss_family == AF_INET6) {
+    memset(&pi6, 0, sizeof(pi6));
+    pi6.ipi6_ifindex = ic->ifindex;
+    cm->cmsg_level = IPPROTO_IPV6;
+    cm->cmsg_type = IPV6_PKTINFO;
+    cm->cmsg_len = CMSG_LEN(sizeof(pi6));
+    memcpy(CMSG_DATA(cm), &pi6, sizeof(pi6));
+    msg->msg_controllen = CMSG_SPACE(sizeof(pi6));
+  }
+  else {
+    memset(&pi, 0, sizeof(pi));
+    pi.ipi_ifindex = ic->ifindex;
+    cm->cmsg_level = IPPROTO_IP;
+    cm->cmsg_type = IP_PKTINFO;
+    cm->cmsg_len = CMSG_LEN(sizeof(pi));
+    memcpy(CMSG_DATA(cm), &pi, sizeof(pi));
+    msg->msg_controllen = CMSG_SPACE(sizeof(pi));
+  }
+}
+
 static int recreate_icmp_socket(
-    int *fd)
+    struct icmp_socket *ic)
 {
-  struct sockaddr addr;
-  socklen_t len;
-  int yes = 1;
   int f = -1;
 
-  if (getpeername(*fd, &addr, &len) < 0)
+  f = create_icmp_socket(ic->peer.ss_family, (struct sockaddr *)&ic->peer,
+                         ic->peerlen, ic->flags, &ic->tsmode, ic->netns);
+  if (f < 0)
     return -1;
 
-  f = socket(addr.sa_family, SOCK_DGRAM|SOCK_CLOEXEC, IPPROTO_ICMP);
-  if (f < 0) {
+  /* Unbound, the probes still go out; they are just not pinned */
+  if (ic->ifindex && bind_device(f, ic->device, ic->ifindex) < 0)
+    warn("Cannot bind socket to %s", ic->device);
+
+  /* The kernel restarts its timestamp key counter with the socket */
+  if (ic->txstamps)
+    memset(ic->txstamps, 0, sizeof(*ic->txstamps));
+  ic->generation++;
+
+  if (ic->fd > -1) {
+    transport->close(ic->fd);
+    icmp_counters.sockets--;
+  }
+  ic->fd = f;
+  return f;
+}
+
+static int enable_timestamps(
+    int fd,
+    int flags)
+{
+  int val;
+
+  val = SOF_TIMESTAMPING_SOFTWARE|
+        SOF_TIMESTAMPING_RX_SOFTWARE|
+        SOF_TIMESTAMPING_TX_SOFTWARE|
+        SOF_TIMESTAMPING_OPT_ID|
+        SOF_TIMESTAMPING_OPT_TSONLY;
+  if (flags & ICMP_SOCKET_HWTIMESTAMP)
+    val |= SOF_TIMESTAMPING_RAW_HARDWARE|
+           SOF_TIMESTAMPING_RX_HARDWARE|
+           SOF_TIMESTAMPING_TX_HARDWARE;
+  if (transport->setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &val,
+                            sizeof(val)) == 0)
+    return TSMODE_RXTX;
+
+  val = 1;
+  if (transport->setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &val,
+                            sizeof(val)) == 0)
+    return TSMODE_RX;
+
+  warn("Cannot enable kernel timestamps, using event loop time");
+  return TSMODE_NONE;
+}
+
+static int create_icmp_socket(
+    int family,
+    struct sockaddr *peer,
+    socklen_t len,
+    int flags,
+    int *tsmode,
+    int netns)
+{
+  int fd = -1;
+  int yes = 1;
+  int type = SOCK_DGRAM|SOCK_CLOEXEC|SOCK_NONBLOCK;
+
+  fd = transport->socket(netns, family, type,
+                         family == AF_INET6 ? IPPROTO_ICMPV6 : IPPROTO_ICMP);
+  if (fd < 0) { 
     warn("Cannot create socket");
     goto fail;
   }
 
-  if (setsockopt(f, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0) {
+  if (transport->setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes,
+                            sizeof(yes)) < 0) {
     warn("Cannot set socket option");
     goto fail;
   }
 
-  if (connect(f, &addr, len) < 0) {
+  if (peer && transport->connect(fd, peer, len) < 0) {
     warn("Cannot connect to socket");
     goto fail;
   }
 
-  close(*fd);
-  *fd = f;
-  return f;
+  *tsmode = TSMODE_NONE;
+  if (flags & (ICMP_SOCKET_TIMESTAMP|ICMP_SOCKET_HWTIMESTAMP))
+    *tsmode = enable_timestamps(fd, flags);
+
+  icmp_counters.sockets++;
+  return fd;
 
 fail:
-  close(f);
+  if (fd > -1)
+    transport->close(fd);
+
   return -1;
+}
+
+static uint32_t address_hash(
+    const struct sockaddr *sa)
+{
+  const unsigned char *p;
+  size_t len;
+  uint32_t h = 2166136261u;
+
+  if (sa->sa_family == AF_INET) {
+    p = (const void *)&((const struct sockaddr_in *)sa)->sin_addr;
+    len = sizeof(struct in_addr);
+  }
+  else if (sa->sa_family == AF_INET6) {
+    p = (const void *)&((const struct sockaddr_in6 *)sa)->sin6_addr;
+    len = sizeof(struct in6_addr);
+  }
+  else
+    return 0;
 
+  while (len--) {
+    h ^= *p++;
+    h *= 16777619u;
+  }
+  return h;
 }
 
-static int create_icmp_socket(
-    const char *addr)
+static int address_equal(
+    const struct sockaddr *a,
+    const struct sockaddr *b)
 {
-  int rc = -1;
-  int fd = -1;
-  int yes = 1;
-  struct addrinfo hints, *ai = NULL;
+  if (a->sa_family != b->sa_family)
+    return 0;
 
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_socktype = SOCK_DGRAM;
-  hints.ai_protocol = 0;
+  if (a->sa_family == AF_INET)
+    return ((const struct sockaddr_in *)a)->sin_addr.s_addr ==
+           ((const struct sockaddr_in *)b)->sin_addr.s_addr;
+  else if (a->sa_family == AF_INET6)
+    return memcmp(&((const struct sockaddr_in6 *)a)->sin6_addr,
+                  &((const struct sockaddr_in6 *)b)->sin6_addr,
+                  sizeof(struct in6_addr)) == 0;
+  return 0;
+}
 
-  if ((rc = getaddrinfo(addr, NULL, &hints, &ai))) {
-    warnx("Cannot obtain IP address: %s", gai_strerror(rc));
-    goto fail;
+static void shared_insert(
+    struct icmp_shared *sh,
+    struct icmp_socket *ic)
+{
+  struct icmp_socket **buckets, *n, *next;
+  size_t i, nbuckets, b;
+
+  if (sh->len >= sh->nbuckets) {
+    nbuckets = sh->nbuckets * 2;
+    buckets = calloc(nbuckets, sizeof(*buckets));
+    assert(buckets);
+    for (i=0; i < sh->nbuckets; i++) {
+      for (n=sh->buckets[i]; n != NULL; n=next) {
+        next = n->hnext;
+        b = address_hash((struct sockaddr *)&n->peer) & (nbuckets - 1);
+        n->hnext = buckets[b];
+        buckets[b] = n;
+      }
+    }
+    free(sh->buckets);
+    sh->buckets = buckets;
+    sh->nbuckets = nbuckets;
   }
 
-  fd = socket(ai->ai_family, ai->ai_socktype|SOCK_CLOEXEC, IPPROTO_ICMP);
-  if (fd < 0) { 
-    warn("Cannot create socket");
-    goto fail;
+  /* Replies are told apart by address and cookie alone, so no two
+   * sockets probing the same address may share a cookie */
+  b = address_hash((struct sockaddr *)&ic->peer) & (sh->nbuckets - 1);
+  do {
+    for (n=sh->buckets[b]; n != NULL; n=n->hnext) {
+      if (n->cookie == ic->cookie &&
+          address_equal((struct sockaddr *)&n->peer,
+                        (struct sockaddr *)&ic->peer))
+        break;
+    }
+    if (n)
+      ic->cookie++;
+  } while (n);
+  ic->hnext = sh->buckets[b];
+  sh->buckets[b] = ic;
+  sh->len++;
+}
+
+static void shared_remove(
+    struct icmp_shared *sh,
+    struct icmp_socket *ic)
+{
+  struct icmp_socket **pp;
+  size_t b;
+  int i;
+
+  /* Nothing queued or awaiting a timestamp may refer to ic afterwards */
+  icmp_shared_flush(sh);
+  if (sh->txstamps) {
+    for (i=0; i < ICMP_TSKEYS; i++) {
+      if (sh->txstamps->keys[i].ic == ic)
+        sh->txstamps->keys[i].ic = NULL;
+    }
   }
 
-  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0) {
-    warn("Cannot set socket option");
+  b = address_hash((struct sockaddr *)&ic->peer) & (sh->nbuckets - 1);
+  for (pp=&sh->buckets[b]; *pp != NULL; pp=&(*pp)->hnext) {
+    if (*pp == ic) {
+      *pp = ic->hnext;
+      ic->hnext = NULL;
+      sh->len--;
+      return;
+    }
+  }
+}
+
+static int batch_init(
+    struct icmp_batch *b)
+{
+  int i;
+
+  memset(b, 0, sizeof(*b));
+  b->msgs = calloc(ICMP_BATCH, sizeof(*b->msgs));
+  b->iov = calloc(ICMP_BATCH, sizeof(*b->iov));
+  b->addrs = calloc(ICMP_BATCH, sizeof(*b->addrs));
+  b->packets = calloc(ICMP_BATCH, ICMP_BUFFER_LEN);
+  b->control = calloc(ICMP_BATCH, ICMP_CONTROL_LEN);
+  b->owner = calloc(ICMP_BATCH, sizeof(*b->owner));
+  b->sequence = calloc(ICMP_BATCH, sizeof(*b->sequence));
+  if (!b->msgs || !b->iov || !b->addrs || !b->packets || !b->control ||
+      !b->owner || !b->sequence)
+    return -1;
+
+  for (i=0; i < ICMP_BATCH; i++) {
+    b->iov[i].iov_base = b->packets + (i * ICMP_BUFFER_LEN);
+    b->iov[i].iov_len = ICMP_BUFFER_LEN;
+    b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+    b->msgs[i].msg_hdr.msg_iovlen = 1;
+    b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+    b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+  }
+  return 0;
+}
+
+/* Puts back what recvmmsg() overwrote in the first n messages, which
+ * are all it can have filled */
+static void batch_rearm(
+    struct icmp_batch *b,
+    size_t n)
+{
+  size_t i;
+
+  for (i=0; i < n; i++) {
+    b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+    b->msgs[i].msg_hdr.msg_control = b->control + (i * ICMP_CONTROL_LEN);
+    b->msgs[i].msg_hdr.msg_controllen = ICMP_CONTROL_LEN;
+  }
+}
+
+static void batch_free(
+    struct icmp_batch *b)
+{
+  free(b->msgs);
+  free(b->iov);
+  free(b->addrs);
+  free(b->packets);
+  free(b->control);
+  free(b->owner);
+  free(b->sequence);
+}
+
+static struct icmp_shared * shared_get(
+    int family,
+    int netns,
+    int flags)
+{
+  struct icmp_shared *sh;
+
+  for (sh=shared_sockets; sh != NULL; sh=sh->next) {
+    if (sh->family == family && sh->netns == netns) {
+      sh->refs++;
+      return sh;
+    }
+  }
+
+  sh = malloc(sizeof(*sh));
+  if (!sh)
+    return NULL;
+  memset(sh, 0, sizeof(*sh));
+  sh->fd = -1;
+
+  sh->nbuckets = 256;
+  sh->buckets = calloc(sh->nbuckets, sizeof(*sh->buckets));
+  if (!sh->buckets)
     goto fail;
+
+  if (flags & ICMP_SOCKET_BATCH) {
+    if (batch_init(&sh->tx) < 0 || batch_init(&sh->rx) < 0)
+      goto fail;
+    batch_rearm(&sh->rx, ICMP_BATCH);
+    sh->batch = 1;
   }
 
-  if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
-    warn("Cannot connect to socket");
+  sh->fd = create_icmp_socket(family, NULL, 0, flags, &sh->tsmode, netns);
+  if (sh->fd < 0)
     goto fail;
+
+  if (sh->tsmode == TSMODE_RXTX) {
+    sh->txstamps = calloc(1, sizeof(*sh->txstamps));
+    if (!sh->txstamps)
+      goto fail;
   }
 
-  freeaddrinfo(ai);
-  return fd;
+  sh->family = family;
+  sh->netns = netns;
+  sh->refs = 1;
+  sh->next = shared_sockets;
+  shared_sockets = sh;
+  return sh;
 
 fail:
-  if (ai)
-    freeaddrinfo(ai);
-  close(fd);
+  if (sh->fd > -1) {
+    transport->close(sh->fd);
+    icmp_counters.sockets--;
+  }
+  batch_free(&sh->tx);
+  batch_free(&sh->rx);
+  free(sh->buckets);
+  free(sh);
+  return NULL;
+}
 
-  return -1;
+static void shared_put(
+    struct icmp_shared *sh)
+{
+  struct icmp_shared **pp;
+
+  if (--sh->refs > 0)
+    return;
+
+  for (pp=&shared_sockets; *pp != NULL; pp=&(*pp)->next) {
+    if (*pp == sh) {
+      *pp = sh->next;
+      break;
+    }
+  }
+
+  icmp_shared_flush(sh);
+  transport->close(sh->fd);
+  icmp_counters.sockets--;
+  batch_free(&sh->tx);
+  batch_free(&sh->rx);
+  free(sh->txstamps);
+  free(sh->buckets);
+  free(sh);
+}
+
+static void advance_oldest(
+    struct icmp_socket *ic)
+{
+  uint16_t end = ic->seqno + 1;
+
+  if (ic->results_len == 0) {
+    ic->oldest = end;
+    return;
+  }
+
+  while (ic->oldest != end && !ic->results[ic->oldest & ic->results_mask].pending)
+    ic->oldest++;
+}
+
+static double timespec_double(
+    struct timespec *ts)
+{
+  return (double)ts->tv_sec + ((double)ts->tv_nsec / 1000000000.0);
+}
+
+static struct probe * find_probe(
+    struct icmp_socket *ic,
+    uint16_t seq)
+{
+  struct probe *p;
+
+  if (ic->results_len == 0)
+    return NULL;
+
+  if ((uint16_t)(seq - ic->oldest) > (uint16_t)(ic->seqno - ic->oldest))
+    return NULL;
+
+  p = &ic->results[seq & ic->results_mask];
+  if (!p->pending || p->sequence != seq)
+    return NULL;
+
+  return p;
+}
+
+static int match_result(
+    struct icmp_socket *ic,
+    uint16_t seq,
+    struct icmp_payload *pl,
+    struct rxstamp *rx,
+    double *rtt)
+{
+  struct probe *p;
+  uint64_t now;
+
+  /* Replies for another tunnel or an earlier socket are dropped here,
+   * before any per-probe state is looked at */
+  if (pl->cookie != ic->cookie || pl->generation != ic->generation) {
+    icmp_counters.rejected++;
+    return 0;
+  }
+
+  p = find_probe(ic, seq);
+  if (!p)
+    return 0;
+
+  /* Kernel stamps win when both ends of the probe have one. Hardware
+   * clocks are only comparable with each other. Otherwise the echoed
+   * monotonic send time is used, against the kernel receive stamp
+   * where there is one. */
+  if (rx->hw > 0.0 && p->hw_tx_time > 0.0)
+    *rtt = rx->hw - p->hw_tx_time;
+  else if (rx->sw > 0.0 && p->tx_time > 0.0)
+    *rtt = rx->sw - p->tx_time;
+  else {
+    now = transport->clock();
+    if (rx->sw > 0.0)
+      now -= (uint64_t)((transport->realtime() - rx->sw) * 1000000000.0);
+    *rtt = (double)(int64_t)(now - pl->sent) / 1000000000.0;
+  }
+
+  p->pending = 0;
+  ic->results_len--;
+  advance_oldest(ic);
+  return 1;
+}
+
+static void control_stamps(
+    struct msghdr *msg,
+    struct rxstamp *rx,
+    struct sock_extended_err **ee)
+{
+  struct cmsghdr *c;
+  struct scm_timestamping *ts;
+
+  rx->sw = rx->hw = 0.0;
+  if (ee)
+    *ee = NULL;
+
+  for (c=CMSG_FIRSTHDR(msg); c != NULL; c=CMSG_NXTHDR(msg, c)) {
+    if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_TIMESTAMPING) {
+      ts = (struct scm_timestamping *)CMSG_DATA(c);
+      rx->sw = timespec_double(&ts->ts[0]);
+      rx->hw = timespec_double(&ts->ts[2]);
+    }
+    else if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_TIMESTAMPNS)
+      rx->sw = timespec_double((struct timespec *)CMSG_DATA(c));
+    else if (ee &&
+             ((c->cmsg_level == SOL_IP && c->cmsg_type == IP_RECVERR) ||
+              (c->cmsg_level == SOL_IPV6 && c->cmsg_type == IPV6_RECVERR)))
+      *ee = (struct sock_extended_err *)CMSG_DATA(c);
+  }
+}
+
+static void txstamp_record(
+    struct icmp_txstamps *tx,
+    struct icmp_socket *ic,
+    uint16_t seq)
+{
+  struct icmp_tskey *k;
+
+  if (!tx)
+    return;
+
+  k = &tx->keys[tx->next & (ICMP_TSKEYS - 1)];
+  k->key = tx->next++;
+  k->sequence = seq;
+  k->ic = ic;
+}
+
+static void read_txstamps(
+    int fd,
+    struct icmp_txstamps *tx)
+{
+  char control[ICMP_CONTROL_LEN];
+  struct msghdr msg;
+  struct sock_extended_err *ee;
+  struct icmp_tskey *k;
+  struct rxstamp stamp;
+  struct probe *p;
+
+  for (;;) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    icmp_counters.syscalls++;
+    if (transport->recvmsg(fd, &msg, MSG_ERRQUEUE|MSG_DONTWAIT) < 0)
+      return;
+
+    control_stamps(&msg, &stamp, &ee);
+    if (!ee || ee->ee_origin != SO_EE_ORIGIN_TIMESTAMPING)
+      continue;
+
+    k = &tx->keys[ee->ee_data & (ICMP_TSKEYS - 1)];
+    if (k->key != ee->ee_data || !k->ic)
+      continue;
+    p = find_probe(k->ic, k->sequence);
+    k->ic = NULL;
+    if (!p)
+      continue;
+
+    /* Guard against a key that slipped out of step with our count */
+    if (stamp.sw >= p->sent_time - 0.001 && stamp.sw - p->sent_time < 1.0)
+      p->tx_time = stamp.sw;
+    if (stamp.hw > 0.0)
+      p->hw_tx_time = stamp.hw;
+  }
 }
 
 int icmp_socket_fd(
@@ -133,31 +723,79 @@ int icmp_socket_send(
     double timestamp)
 {
   int rc;
-  int len = sizeof(struct icmphdr) + 16;
+  int len = ICMP_PACKET_LEN;
   void *packet = alloca(len);
-  struct rlist *rl = NULL, *t = NULL;
+  struct probe *p;
+  struct icmp_batch *tx;
+  struct msghdr msg;
+  struct iovec iov;
+  char control[ICMP_PKTINFO_LEN];
+  uint16_t seq, span;
 
-  create_echo_packet(++ic->seqno, packet, len);
-  rc = send(ic->fd, packet, len, MSG_NOSIGNAL);
-  if (rc != len)
+  /* The reserved zero takes a slot of the span but is never a probe;
+   * the spare ring slot allows for it */
+  span = ic->seqno + 1 - ic->oldest;
+  if (ic->seqno < ic->oldest)
+    span--;
+  if (ic->results_len && span >= ic->outstanding) {
+    errno = ENOBUFS;
     return -1;
+  }
 
-  rl = malloc(sizeof(*rl));
-  assert(rl);
+  /* Sequence zero is reserved to mean "no probe" to the callers */
+  if (++ic->seqno == 0)
+    ic->seqno++;
+  seq = ic->seqno;
 
-  rl->sequence = ic->seqno;
-  rl->sent_time = timestamp;
-  rl->recv_time = -1.0;
-  rl->next = NULL;
-  if (!ic->results) {
-    ic->results = rl;
+  if (ic->shared && ic->shared->batch) {
+    /* Queued until the owner calls icmp_shared_flush(), normally once
+     * per event loop iteration */
+    tx = &ic->shared->tx;
+    if (tx->len == ICMP_BATCH)
+      icmp_shared_flush(ic->shared);
+    packet = tx->iov[tx->len].iov_base;
+    tx->iov[tx->len].iov_len = len;
+    memcpy(&tx->addrs[tx->len], &ic->peer, ic->peerlen);
+    tx->msgs[tx->len].msg_hdr.msg_namelen = ic->peerlen;
+    set_pktinfo(ic, &tx->msgs[tx->len].msg_hdr,
+                tx->control + (tx->len * ICMP_CONTROL_LEN));
+    tx->owner[tx->len] = ic;
+    tx->sequence[tx->len] = seq;
+    memset(packet, 0, len);
+    create_echo_packet(ic, seq, packet, len);
+    tx->len++;
+    rc = len;
   }
   else {
-    t = ic->results;
-    while (t->next != NULL)
-      t = t->next;
-    t->next = rl;
+    memset(packet, 0, len);
+    create_echo_packet(ic, seq, packet, len);
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = packet;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (ic->shared) {
+      msg.msg_name = &ic->peer;
+      msg.msg_namelen = ic->peerlen;
+      set_pktinfo(ic, &msg, control);
+    }
+    rc = transport->sendmsg(ic->shared ? ic->shared->fd : ic->fd, &msg,
+                            MSG_NOSIGNAL);
+    icmp_counters.syscalls++;
+    if (rc != len)
+      return -1;
+    icmp_counters.sent++;
+    txstamp_record(ic->shared ? ic->shared->txstamps : ic->txstamps, ic, seq);
   }
+
+  p = &ic->results[seq & ic->results_mask];
+  p->sequence = seq;
+  p->pending = 1;
+  p->sent_time = timestamp;
+  p->tx_time = 0.0;
+  p->hw_tx_time = 0.0;
+  if (ic->results_len == 0)
+    ic->oldest = seq;
   ic->results_len++;
 
   return rc;
@@ -167,86 +805,279 @@ int icmp_socket_send(
 
 int icmp_socket_recv(
     struct icmp_socket *ic,
-    double *timestamp)
+    double *rtt)
 {
   int rc;
-  int len = sizeof(struct icmphdr) + 16;
+  int len = ICMP_BUFFER_LEN;
   struct icmphdr *hdr = NULL;
-  struct rlist *rl, *la = NULL;
+  struct rxstamp stamp;
+  struct icmp_payload pl;
+  char control[ICMP_CONTROL_LEN];
+  struct iovec iov;
+  struct msghdr msg;
   uint16_t seq;
 
   void *packet = alloca(len);
-  rc = recv(ic->fd, packet, len, 0);
-  if (rc != len)
+
+  if (ic->txstamps)
+    read_txstamps(ic->fd, ic->txstamps);
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = packet;
+  iov.iov_len = len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  rc = transport->recvmsg(ic->fd, &msg, 0);
+  icmp_counters.syscalls++;
+  if (rc < 0)
+    return -1;
+  icmp_counters.received++;
+  if (rc != ICMP_PACKET_LEN) {
+    errno = EBADMSG;
     return -1;
+  }
 
   hdr = packet;
+  if (!is_echo_reply(ic->peer.ss_family, hdr)) {
+    errno = EBADMSG;
+    return -1;
+  }
+
+  control_stamps(&msg, &stamp, NULL);
+  seq = ntohs(hdr->un.echo.sequence);
+  memcpy(&pl, packet + sizeof(*hdr), sizeof(pl));
+  if (match_result(ic, seq, &pl, &stamp, rtt))
+    return seq;
+
+  return 0;
+}
+
+
+static int shared_dispatch(
+    struct icmp_shared *sh,
+    struct msghdr *msg,
+    int len,
+    struct icmp_socket **owner,
+    double *rtt)
+{
+  struct icmphdr *hdr = msg->msg_iov->iov_base;
+  struct sockaddr *from = msg->msg_name;
+  struct icmp_socket *ic;
+  struct rxstamp stamp;
+  struct icmp_payload pl;
+  uint16_t seq;
+
+  icmp_counters.received++;
+  if (len != ICMP_PACKET_LEN || (msg->msg_flags & MSG_TRUNC) ||
+      !is_echo_reply(from->sa_family, hdr))
+    return 0;
+
+  control_stamps(msg, &stamp, NULL);
   seq = ntohs(hdr->un.echo.sequence);
-  for (rl=ic->results; rl != NULL; rl=rl->next) {
-    if (rl->sequence == seq) {
-      if (!la)
-        ic->results = ic->results->next;
-      else
-        la->next = rl->next;
-
-      *timestamp = rl->sent_time;
-      free(rl);
-      ic->results_len--;
+  memcpy(&pl, (char *)hdr + sizeof(*hdr), sizeof(pl));
+  ic = sh->buckets[address_hash(from) & (sh->nbuckets - 1)];
+  for (; ic != NULL; ic=ic->hnext) {
+    if (ic->cookie != pl.cookie ||
+        !address_equal(from, (struct sockaddr *)&ic->peer))
+      continue;
+    if (match_result(ic, seq, &pl, &stamp, rtt)) {
+      *owner = ic;
       return seq;
     }
-    else {
-      la = rl;
-    }
+    return 0;
   }
 
+  icmp_counters.rejected++;
   return 0;
 }
 
 
+int icmp_shared_recv(
+    struct icmp_shared *sh,
+    struct icmp_socket **owner,
+    double *rtt)
+{
+  int rc;
+  int len = ICMP_BUFFER_LEN;
+  struct icmp_batch *rx = &sh->rx;
+  struct mmsghdr *m;
+  struct sockaddr_storage from;
+  char control[ICMP_CONTROL_LEN];
+  struct iovec iov;
+  struct msghdr msg;
+
+  void *packet = alloca(len);
+  *owner = NULL;
+
+  if (!sh->batch) {
+    if (sh->txstamps)
+      read_txstamps(sh->fd, sh->txstamps);
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = packet;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_name = &from;
+    msg.msg_namelen = sizeof(from);
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    rc = transport->recvmsg(sh->fd, &msg, 0);
+    icmp_counters.syscalls++;
+    if (rc < 0)
+      return -1;
+    return shared_dispatch(sh, &msg, rc, owner, rtt);
+  }
+
+  if (rx->pos == rx->len) {
+    if (sh->txstamps)
+      read_txstamps(sh->fd, sh->txstamps);
+
+    batch_rearm(rx, rx->len);
+    rx->pos = rx->len = 0;
+    rc = transport->recvmmsg(sh->fd, rx->msgs, ICMP_BATCH, MSG_DONTWAIT);
+    icmp_counters.syscalls++;
+    if (rc <= 0)
+      return -1;
+    rx->len = rc;
+  }
+
+  m = &rx->msgs[rx->pos++];
+  return shared_dispatch(sh, &m->msg_hdr, m->msg_len, owner, rtt);
+}
+
+
+int icmp_shared_flush(
+    struct icmp_shared *sh)
+{
+  struct icmp_batch *tx = &sh->tx;
+  struct icmp_payload *pl;
+  uint64_t now;
+  int i, rc, sent = 0;
+
+  /* Restamp queued probes so time spent waiting for the flush is not
+   * counted as round trip */
+  if (tx->len)
+    now = transport->clock();
+  for (i=0; i < tx->len; i++) {
+    pl = (struct icmp_payload *)((char *)tx->iov[i].iov_base +
+                                 sizeof(struct icmphdr));
+    pl->sent = now;
+  }
+
+  tx->pos = 0;
+  while (tx->pos < tx->len) {
+    rc = transport->sendmmsg(sh->fd, &tx->msgs[tx->pos], tx->len - tx->pos,
+                             MSG_NOSIGNAL);
+    icmp_counters.syscalls++;
+    if (rc < 0) {
+      if (errno == EINTR)
+        continue;
+      /* Drop the message that failed; its probe will time out */
+      tx->pos++;
+      continue;
+    }
+    for (i=0; i < rc; i++)
+      txstamp_record(sh->txstamps, tx->owner[tx->pos + i],
+                     tx->sequence[tx->pos + i]);
+    tx->pos += rc;
+    sent += rc;
+  }
+
+  icmp_counters.sent += sent;
+  tx->len = tx->pos = 0;
+  return sent;
+}
+
+
 int icmp_socket_timeout(
     struct icmp_socket *ic,
     double now)
 {
   assert(ic);
-  struct rlist *rl;
+  struct probe *p;
   int rc = 0;
   double t; 
 
-  if (!ic->results)
+  if (ic->results_len == 0)
     return 0;
 
-  t = (ic->results->sent_time + ic->timeout) - now;
+  p = &ic->results[ic->oldest & ic->results_mask];
+  t = (p->sent_time + ic->timeout) - now;
   if (t < 0.0) {
-    rl = ic->results;
-    ic->results = ic->results->next;
-    rc = rl->sequence;
-    free(rl);
+    rc = p->sequence;
+    p->pending = 0;
     ic->results_len--;
+    advance_oldest(ic);
   }
 
   return rc;
 }
 
+
+double icmp_socket_oldest(
+    struct icmp_socket *ic)
+{
+  assert(ic);
+  if (ic->results_len == 0)
+    return -1.0;
+
+  return ic->results[ic->oldest & ic->results_mask].sent_time;
+}
+
 struct icmp_socket * icmp_socket_create(
-    const char *addr,
+    const struct sockaddr *peer,
+    socklen_t peerlen,
     double interval,
-    double timeout) 
+    double timeout,
+    size_t outstanding,
+    int flags,
+    int netns) 
 {
   struct icmp_socket *ic = NULL;
+  size_t ringsz = 1;
 
   ic = malloc(sizeof(*ic));
   if (!ic)
     return NULL;
 
   memset(ic, 0, sizeof(*ic));
+  ic->fd = -1;
+  ic->flags = flags;
+  ic->netns = netns;
+  if (getrandom(&ic->cookie, sizeof(ic->cookie), GRND_NONBLOCK) !=
+      sizeof(ic->cookie))
+    ic->cookie = (uint32_t)random() ^ (uint32_t)(uintptr_t)ic;
 
-  ic->fd = create_icmp_socket(addr);
-  if (ic->fd < 0)
+  if (peerlen > sizeof(ic->peer)) {
+    errno = EINVAL;
     goto fail;
+  }
+  memcpy(&ic->peer, peer, peerlen);
+  ic->peerlen = peerlen;
 
-  ic->addr = strdup(addr);
-  if (!ic->addr)
-    goto fail;
+  if (flags & ICMP_SOCKET_SHARED) {
+    ic->shared = shared_get(ic->peer.ss_family, netns, flags);
+    if (!ic->shared)
+      goto fail;
+    shared_insert(ic->shared, ic);
+  }
+  else {
+    ic->fd = create_icmp_socket(ic->peer.ss_family,
+                                (struct sockaddr *)&ic->peer, ic->peerlen,
+                                flags, &ic->tsmode, netns);
+    if (ic->fd < 0)
+      goto fail;
+    if (ic->tsmode == TSMODE_RXTX) {
+      ic->txstamps = calloc(1, sizeof(*ic->txstamps));
+      if (!ic->txstamps)
+        goto fail;
+    }
+  }
 
   ic->seqno = 0;
   if (timeout < 0.001) 
@@ -256,18 +1087,39 @@ struct icmp_socket * icmp_socket_create(
     goto fail;
   ic->interval = interval;
 
-  ic->results = NULL;
+  /* By default allow as many probes as can be in flight before the
+   * oldest one times out, so the cap never throttles a healthy link */
+  if (outstanding == 0)
+    outstanding = (size_t)(timeout / interval) + 2;
+  if (outstanding > ICMP_OUTSTANDING_MAX)
+    outstanding = ICMP_OUTSTANDING_MAX;
+  ic->outstanding = outstanding;
+
+  /* One spare slot covers the hop over the reserved sequence zero */
+  while (ringsz <= outstanding)
+    ringsz <<= 1;
+  ic->results = calloc(ringsz, sizeof(*ic->results));
+  if (!ic->results)
+    goto fail;
+  ic->results_mask = ringsz - 1;
   ic->results_len = 0;
+  ic->oldest = 1;
 
   return ic;
 
 fail:
-  if (ic) {
-    if (ic->fd > -1)
-      close(ic->fd);
-    if (ic->addr)
-      free(ic->addr);
-  } 
+  if (ic->shared) {
+    shared_remove(ic->shared, ic);
+    shared_put(ic->shared);
+  }
+  if (ic->fd > -1) {
+    transport->close(ic->fd);
+    icmp_counters.sockets--;
+  }
+  free(ic->txstamps);
+  free(ic->results);
+  free(ic);
+  return NULL;
 }
 
 
@@ -277,28 +1129,93 @@ int icmp_socket_recreate(
   if (!ic)
     return -1;
 
-  if (recreate_icmp_socket(&ic->fd) < 0)
+  /* The shared socket is never torn down on behalf of a single peer,
+   * but replies to anything sent before now are no longer wanted */
+  if (ic->shared) {
+    ic->generation++;
+    return 0;
+  }
+
+  if (recreate_icmp_socket(ic) < 0)
     return -1;
 
   return 0;  
 }
 
 
+/* Pins later probes to a device, or lets them follow the routing table
+ * again with ifindex 0. A dedicated socket is bound when it is next
+ * created, which ev_icmp_start() does; a shared one names the device in
+ * every probe it sends. */
+void icmp_socket_set_device(
+    struct icmp_socket *ic,
+    const char *name,
+    int ifindex)
+{
+  ic->ifindex = ifindex;
+  snprintf(ic->device, sizeof(ic->device), "%s", name ? name : "");
+}
+
+
+/* Point the socket at a new address of the same family. Probes still
+ * out to the old one are forgotten rather than left to time out, and
+ * any late replies to them are rejected. */
+int icmp_socket_set_peer(
+    struct icmp_socket *ic,
+    const struct sockaddr *peer,
+    socklen_t peerlen)
+{
+  if (peer->sa_family != ic->peer.ss_family || peerlen > sizeof(ic->peer)) {
+    errno = EAFNOSUPPORT;
+    return -1;
+  }
+
+  if (ic->shared) {
+    shared_remove(ic->shared, ic);
+    memcpy(&ic->peer, peer, peerlen);
+    ic->peerlen = peerlen;
+    shared_insert(ic->shared, ic);
+  }
+  else {
+    if (ic->fd > -1 && transport->connect(ic->fd, peer, peerlen) < 0)
+      return -1;
+    memcpy(&ic->peer, peer, peerlen);
+    ic->peerlen = peerlen;
+  }
+
+  memset(ic->results, 0, (ic->results_mask + 1) * sizeof(*ic->results));
+  ic->results_len = 0;
+  advance_oldest(ic);
+  ic->generation++;
+  return 0;
+}
+
+
 void icmp_socket_destroy(
     struct icmp_socket *ic)
 {
-  struct rlist *rl;
   if (!ic)
     return;
 
-  if (ic->addr)
-    free(ic->addr);
-  if (ic->fd > -1)
-    close(ic->fd);
-  while (ic->results) {
-    rl = ic->results;
-    ic->results->next = rl->next;
-    free(rl);
+  if (ic->shared) {
+    shared_remove(ic->shared, ic);
+    shared_put(ic->shared);
+  }
+  if (ic->fd > -1) {
+    transport->close(ic->fd);
+    icmp_counters.sockets--;
   }
+  free(ic->txstamps);
+  free(ic->results);
+  free(ic);
   return;
 }
+
+
+/* Sockets already open keep being served by the transport that opened
+ * them, so this is only safe before the first one is created */
+void icmp_transport_set(
+    const struct icmp_transport *t)
+{
+  transport = t ? t : &icmp_transport_kernel;
+}
@@ -2,29 +2,164 @@
 #define _ICMP_H_
 #include "common.h"
 
+#include <sys/socket.h>
+#include <net/if.h>
+
+#define ICMP_SOCKET_SHARED 0x1
+#define ICMP_SOCKET_BATCH  0x2
+#define ICMP_SOCKET_TIMESTAMP   0x4
+#define ICMP_SOCKET_HWTIMESTAMP 0x8
+#define ICMP_OUTSTANDING_MAX 32768
+#define ICMP_BATCH 64
+#define ICMP_TSKEYS 256
+
+/* Echo payload. The peer hands it back untouched, so the reply alone
+ * says when its probe left and which socket incarnation sent it. */
+struct icmp_payload {
+  uint64_t sent;
+  uint32_t cookie;
+  uint32_t generation;
+};
+
+/* Kernel transmit timestamps arrive on the error queue tagged with a
+ * per-socket counter (SOF_TIMESTAMPING_OPT_ID). This maps the counter
+ * back to the probe it was issued for. */
+struct icmp_txstamps {
+  uint32_t next;
+  struct icmp_tskey {
+    uint32_t key;
+    uint16_t sequence;
+    struct icmp_socket *ic;
+  } keys[ICMP_TSKEYS];
+};
+
+/* Preallocated sendmmsg()/recvmmsg() vectors. Packets queued for
+ * transmit sit here until icmp_shared_flush(); received packets are
+ * handed out one at a time until the vector is used up. */
+struct icmp_batch {
+  size_t len;
+  size_t pos;
+  struct mmsghdr *msgs;
+  struct iovec *iov;
+  struct sockaddr_storage *addrs;
+  unsigned char *packets;
+  unsigned char *control;
+  struct icmp_socket **owner;
+  uint16_t *sequence;
+};
+
+/* One unconnected ping socket per address family and network namespace,
+ * shared by every icmp_socket created with ICMP_SOCKET_SHARED. Replies are routed back
+ * to their owner by source address. */
+struct icmp_shared {
+  int fd;
+  int family;
+  int netns;
+  int refs;
+  int batch;
+  int tsmode;
+  struct icmp_txstamps *txstamps;
+  struct icmp_batch tx;
+  struct icmp_batch rx;
+  size_t len;
+  size_t nbuckets;
+  struct icmp_socket **buckets;
+  struct icmp_shared *next;
+};
+
 struct icmp_socket {
-  char *addr;
   int fd;
+  int flags;
+  int netns;
+  int tsmode;
+  struct icmp_txstamps *txstamps;
+  uint32_t cookie;
+  uint32_t generation;
   uint16_t seqno;
   double timeout;
   double interval;
 
-  struct rlist {
+  struct sockaddr_storage peer;
+  socklen_t peerlen;
+  /* Device probes leave by, whatever the routing table says; 0 for none */
+  int ifindex;
+  char device[IFNAMSIZ];
+  struct icmp_shared *shared;
+  struct icmp_socket *hnext;
+  void *data;
+
+  /* Outstanding probes, indexed by sequence modulo the ring size. Every
+   * outstanding sequence lies in [oldest, seqno], which is never wider
+   * than the cap, so slots cannot collide. */
+  struct probe {
     uint16_t sequence;
+    uint16_t pending;
     double sent_time;
-    double recv_time;
-    struct rlist *next;
+    double tx_time;
+    double hw_tx_time;
   } *results;
+  size_t results_mask;
   size_t results_len;
+  size_t outstanding;
+  uint16_t oldest;
+
+};
 
+/* Every socket call icmp.c makes goes through one of these, so probes
+ * can be carried by something other than the kernel. The clock is
+ * CLOCK_MONOTONIC in nanoseconds and stamps each probe's payload. */
+struct icmp_transport {
+  int (*socket)(int netns, int family, int type, int protocol);
+  int (*close)(int fd);
+  int (*setsockopt)(int fd, int level, int name, const void *val,
+                    socklen_t len);
+  int (*connect)(int fd, const struct sockaddr *peer, socklen_t len);
+  ssize_t (*sendmsg)(int fd, const struct msghdr *msg, int flags);
+  int (*sendmmsg)(int fd, struct mmsghdr *msgs, unsigned int n, int flags);
+  ssize_t (*recvmsg)(int fd, struct msghdr *msg, int flags);
+  int (*recvmmsg)(int fd, struct mmsghdr *msgs, unsigned int n, int flags);
+  uint64_t (*clock)(void);
+  /* The clock receive stamps are taken on, in seconds */
+  double (*realtime)(void);
 };
 
-struct icmp_socket * icmp_socket_create(const char *, double, double);
+extern const struct icmp_transport icmp_transport_kernel;
+
+struct icmp_counters {
+  unsigned long sockets;
+  unsigned long sent;
+  unsigned long received;
+  unsigned long syscalls;
+  unsigned long rejected;
+  /* Probes sent from a deadline the scheduler set, and how long after
+   * their due time they went out in all, from tick rounding and slack */
+  unsigned long scheduled;
+  uint64_t late_ns;
+};
+
+/* Per thread; each event loop thread counts its own sockets */
+extern __thread struct icmp_counters icmp_counters;
+
+struct icmp_socket * icmp_socket_create(const struct sockaddr *peer,
+                                        socklen_t peerlen, double, double,
+                                        size_t outstanding, int flags,
+                                        int netns);
+int icmp_socket_set_peer(struct icmp_socket *, const struct sockaddr *peer,
+                         socklen_t peerlen);
+void icmp_socket_set_device(struct icmp_socket *, const char *name,
+                            int ifindex);
+int icmp_socket_fd(struct icmp_socket *);
 int icmp_socket_recreate(struct icmp_socket *);
-int icmp_socket_recv(struct icmp_socket *, double *timestamp);
+int icmp_socket_recv(struct icmp_socket *, double *rtt);
 int icmp_socket_send(struct icmp_socket *, double timestamp);
 int icmp_socket_timeout(struct icmp_socket *, double now);
+double icmp_socket_oldest(struct icmp_socket *);
+
+int icmp_shared_recv(struct icmp_shared *, struct icmp_socket **,
+                     double *rtt);
+int icmp_shared_flush(struct icmp_shared *);
 
 void icmp_socket_destroy(struct icmp_socket *);
+void icmp_transport_set(const struct icmp_transport *);
 
 #endif
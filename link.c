@@ -1,63 +1,243 @@
 #include "common.h"
 
+#include <stddef.h>
 #include <sys/socket.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
+#include <linux/net_namespace.h>
+#include <linux/filter.h>
 #include <net/if.h>
+#include <arpa/inet.h>
 
-struct devlist {
-  int ifindex;
-  char ifname[32];
-  struct devlist *next;
-} *devices = NULL;
+#include "link.h"
+#include "netns.h"
 
-static int add_device(
-    int index,
-    char *name)
+#define LINK_BUCKETS 256
+#define LINK_BUFSZ 8192
+/* Dumps go out with sequence 0; counter requests are told apart by this */
+#define LINK_SEQ_COUNTERS 1
+
+uint32_t link_hash_name(
+    const char *name)
 {
-  struct devlist *d;
-  for (d=devices; d != NULL; d=d->next) {
-    if(d->ifindex == index)
-      break;
+  uint32_t h = 2166136261u;
+
+  while (*name) {
+    h ^= (unsigned char)*name++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static uint32_t hash_index(
+    int ifindex)
+{
+  return (uint32_t)ifindex * 2654435761u;
+}
+
+static struct link_dev * find_index(
+    struct link_table *t,
+    int ifindex)
+{
+  struct link_dev *d;
+
+  d = t->byindex[hash_index(ifindex) & (t->nbuckets - 1)];
+  for (; d != NULL; d=d->inext) {
+    if (d->ifindex == ifindex)
+      return d;
+  }
+  return NULL;
+}
+
+static void name_link(
+    struct link_table *t,
+    struct link_dev *d)
+{
+  size_t b = link_hash_name(d->ifname) & (t->nbuckets - 1);
+  d->nnext = t->byname[b];
+  t->byname[b] = d;
+}
+
+static void name_unlink(
+    struct link_table *t,
+    struct link_dev *d)
+{
+  struct link_dev **pp;
+
+  pp = &t->byname[link_hash_name(d->ifname) & (t->nbuckets - 1)];
+  for (; *pp != NULL; pp=&(*pp)->nnext) {
+    if (*pp == d) {
+      *pp = d->nnext;
+      return;
+    }
+  }
+}
+
+static void grow_table(
+    struct link_table *t)
+{
+  struct link_dev **byindex, **byname, *d, *next;
+  size_t i, b, nbuckets = t->nbuckets * 2;
+
+  byindex = calloc(nbuckets, sizeof(*byindex));
+  byname = calloc(nbuckets, sizeof(*byname));
+  if (!byindex || !byname) {
+    free(byindex);
+    free(byname);
+    return;
   }
 
-  if (!d) {
-    d = malloc(sizeof(*d));
-    memset(d, 0, sizeof(*d));
-    assert(d);
-    d->ifindex = index;
-    strncpy(d->ifname, name, 30);
-    d->next = devices;
-    devices = d;
+  for (i=0; i < t->nbuckets; i++) {
+    for (d=t->byindex[i]; d != NULL; d=next) {
+      next = d->inext;
+      b = hash_index(d->ifindex) & (nbuckets - 1);
+      d->inext = byindex[b];
+      byindex[b] = d;
+      b = link_hash_name(d->ifname) & (nbuckets - 1);
+      d->nnext = byname[b];
+      byname[b] = d;
+    }
   }
-  else {
-    memset(d->ifname, 0, 31);
-    strncpy(d->ifname, name, 30);
+
+  free(t->byindex);
+  free(t->byname);
+  t->byindex = byindex;
+  t->byname = byname;
+  t->nbuckets = nbuckets;
+}
+
+static int add_device(
+    struct link_table *t,
+    int index,
+    char *name,
+    link_change_cb cb,
+    void *data)
+{
+  struct link_dev *d;
+  size_t b;
+
+  d = find_index(t, index);
+  if (d) {
+    d->seen = t->generation;
+    if (strncmp(d->ifname, name, IFNAMSIZ) == 0)
+      return 0;
+
+    /* Renamed: the old name goes away and the new one appears */
+    name_unlink(t, d);
+    if (cb)
+      cb(data, d->ifname, d->ifindex, 0);
+    memset(d->ifname, 0, sizeof(d->ifname));
+    strncpy(d->ifname, name, IFNAMSIZ-1);
+    name_link(t, d);
+    if (cb)
+      cb(data, d->ifname, d->ifindex, 1);
+    return 1;
   }
+
+  if (t->len >= t->nbuckets)
+    grow_table(t);
+
+  d = malloc(sizeof(*d));
+  assert(d);
+  memset(d, 0, sizeof(*d));
+  d->ifindex = index;
+  d->seen = t->generation;
+  strncpy(d->ifname, name, IFNAMSIZ-1);
+
+  b = hash_index(index) & (t->nbuckets - 1);
+  d->inext = t->byindex[b];
+  t->byindex[b] = d;
+  name_link(t, d);
+  t->len++;
+
+  if (cb)
+    cb(data, d->ifname, d->ifindex, 1);
   return 1;
 }
 
 static int del_device(
-    int index)
+    struct link_table *t,
+    int index,
+    link_change_cb cb,
+    void *data)
 {
-  struct devlist *d, *l;
-  if (devices->ifindex == index) {
-    d = devices;
-    devices = devices->next;
-    free(d);
-    return 1;
+  struct link_dev *d, **pp;
+
+  pp = &t->byindex[hash_index(index) & (t->nbuckets - 1)];
+  for (; *pp != NULL; pp=&(*pp)->inext) {
+    if ((*pp)->ifindex == index)
+      break;
+  }
+  if (!*pp)
+    return 0;
+
+  d = *pp;
+  *pp = d->inext;
+  name_unlink(t, d);
+  t->len--;
+
+  if (cb)
+    cb(data, d->ifname, d->ifindex, 0);
+  free(d);
+  return 1;
+}
+
+struct link_table * link_table_create(
+    void)
+{
+  struct link_table *t;
+
+  t = malloc(sizeof(*t));
+  if (!t)
+    return NULL;
+  memset(t, 0, sizeof(*t));
+
+  t->nbuckets = LINK_BUCKETS;
+  t->byindex = calloc(t->nbuckets, sizeof(*t->byindex));
+  t->byname = calloc(t->nbuckets, sizeof(*t->byname));
+  if (!t->byindex || !t->byname) {
+    link_table_destroy(t);
+    return NULL;
   }
+  return t;
+}
 
-  l = devices;
-  for (d=devices->next; d != NULL; d=d->next) {
-    if (d->ifindex == index) {
-      l->next = d->next;
+void link_table_destroy(
+    struct link_table *t)
+{
+  struct link_dev *d, *next;
+  size_t i;
+
+  if (!t)
+    return;
+
+  for (i=0; t->byindex && i < t->nbuckets; i++) {
+    for (d=t->byindex[i]; d != NULL; d=next) {
+      next = d->inext;
       free(d);
-      return 1;
     }
-    l = d;
   }
-  return 0;
+  free(t->byindex);
+  free(t->byname);
+  free(t->buf);
+  free(t);
+}
+
+static void sweep_devices(
+    struct link_table *t,
+    link_change_cb cb,
+    void *data)
+{
+  struct link_dev *d, *next;
+  size_t i;
+
+  for (i=0; i < t->nbuckets; i++) {
+    for (d=t->byindex[i]; d != NULL; d=next) {
+      next = d->inext;
+      if (d->seen != t->generation)
+        del_device(t, d->ifindex, cb, data);
+    }
+  }
 }
 
 static int append_attr(
@@ -89,47 +269,102 @@ static int parse_error(
 }
 
 static int parse_ifa(
-    struct nlmsghdr *h)
+    struct nlmsghdr *h,
+    struct link_table *t,
+    link_change_cb cb,
+    void *data)
 {
   int rc = 0;
   struct ifinfomsg *ifa = NLMSG_DATA(h);
   struct rtattr *rta = NLMSG_DATA(h) + sizeof(*ifa);
-  size_t rtalen = h->nlmsg_len - sizeof(*h) - sizeof(*ifa);
+  size_t rtalen = h->nlmsg_len - NLMSG_LENGTH(sizeof(*ifa));
+  struct rtnl_link_stats64 st;
+  struct link_dev *d;
+  char *name = NULL;
+  void *stats = NULL;
 
-  for (rta; RTA_OK(rta, rtalen); rta=RTA_NEXT(rta, rtalen)) {
-    if (rta->rta_type == IFLA_IFNAME) 
-      break;
+  for (; RTA_OK(rta, rtalen); rta=RTA_NEXT(rta, rtalen)) {
+    if (rta->rta_type == IFLA_IFNAME)
+      name = RTA_DATA(rta);
+    else if (rta->rta_type == IFLA_STATS64 &&
+             RTA_PAYLOAD(rta) >= sizeof(st))
+      stats = RTA_DATA(rta);
   }
 
   if (h->nlmsg_type == RTM_NEWLINK) {
-    assert(rta && rta->rta_type == IFLA_IFNAME);
-    if (ifa->ifi_flags & IFF_UP)
-      rc = add_device(ifa->ifi_index, RTA_DATA(rta));
+    if (!name)
+      return 0;
+    if (ifa->ifi_flags & IFF_UP) {
+      rc = add_device(t, ifa->ifi_index, name, cb, data);
+      /* Attributes are only 4 byte aligned */
+      if (stats && (d = find_index(t, ifa->ifi_index)) != NULL) {
+        memcpy(&st, stats, sizeof(st));
+        d->rx_packets = st.rx_packets;
+        d->tx_packets = st.tx_packets;
+      }
+    }
     else
-      rc = del_device(ifa->ifi_index);
+      rc = del_device(t, ifa->ifi_index, cb, data);
   }
   else if (h->nlmsg_type == RTM_DELLINK)
-    rc = del_device(ifa->ifi_index);
+    rc = del_device(t, ifa->ifi_index, cb, data);
   return rc;
 }
 
+/* A reply to link_request_counters(), for a device that may since have
+ * gone down */
+static void parse_stats(
+    struct nlmsghdr *h,
+    struct link_table *t)
+{
+  struct if_stats_msg *ism = NLMSG_DATA(h);
+  struct rtattr *rta = NLMSG_DATA(h) + NLMSG_ALIGN(sizeof(*ism));
+  int rtalen = h->nlmsg_len - NLMSG_LENGTH(NLMSG_ALIGN(sizeof(*ism)));
+  struct rtnl_link_stats64 st;
+  struct link_dev *d;
+
+  if (h->nlmsg_len < NLMSG_LENGTH(sizeof(*ism)))
+    return;
+  d = find_index(t, ism->ifindex);
+  if (!d)
+    return;
+  for (; RTA_OK(rta, rtalen); rta=RTA_NEXT(rta, rtalen)) {
+    if (rta->rta_type == IFLA_STATS_LINK_64 &&
+        RTA_PAYLOAD(rta) >= sizeof(st)) {
+      memcpy(&st, RTA_DATA(rta), sizeof(st));
+      d->rx_packets = st.rx_packets;
+      d->tx_packets = st.tx_packets;
+    }
+  }
+}
+
 
 int link_socket(
-    void)
+    int rcvbuf,
+    int netns)
 {
   int fd = -1;
   struct sockaddr_nl nl;
 
-  fd = socket(AF_NETLINK, SOCK_DGRAM|SOCK_CLOEXEC, NETLINK_ROUTE);
+  fd = netns_socket(netns, AF_NETLINK, SOCK_DGRAM|SOCK_CLOEXEC|SOCK_NONBLOCK,
+                    NETLINK_ROUTE);
   if (fd < 0)
     return -1;
 
+  /* FORCE lets a privileged daemon exceed net.core.rmem_max */
+  if (rcvbuf > 0 &&
+      setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) < 0 &&
+      setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0)
+    warn("Cannot set netlink receive buffer size");
+
   nl.nl_family = AF_NETLINK;
   nl.nl_pad = 0;
   nl.nl_pid = 0;
   nl.nl_groups = RTMGRP_LINK;
-  if (bind(fd, (struct sockaddr *)&nl, sizeof(nl)) < 0)
+  if (bind(fd, (struct sockaddr *)&nl, sizeof(nl)) < 0) {
+    close(fd);
     return -1;
+  }
   return fd; 
 }
 
@@ -160,54 +395,428 @@ int link_send(
   return 0;
 }
 
+static int compare_index(
+    const void *a,
+    const void *b)
+{
+  return *(const int *)a - *(const int *)b;
+}
+
+/* Asks for just the packet counters of each device in indexes, all in
+ * one datagram; the replies update the table as link_recv() reads them.
+ * Much cheaper than a dump, and unrelated to it. Sorts indexes. */
+int link_request_counters(
+    int fd,
+    struct link_table *t,
+    int *indexes,
+    size_t nindexes)
+{
+  size_t msglen = NLMSG_ALIGN(NLMSG_LENGTH(sizeof(struct if_stats_msg)));
+  struct nlmsghdr *h;
+  struct if_stats_msg *ism;
+  char *packet, *p;
+  size_t i;
+  int rc;
+
+  if (nindexes == 0)
+    return 0;
+  packet = calloc(nindexes, msglen);
+  if (!packet)
+    return -1;
+
+  qsort(indexes, nindexes, sizeof(*indexes), compare_index);
+  p = packet;
+  for (i=0; i < nindexes; i++) {
+    if (i > 0 && indexes[i] == indexes[i-1])
+      continue;
+    h = (struct nlmsghdr *)p;
+    h->nlmsg_len = NLMSG_LENGTH(sizeof(*ism));
+    h->nlmsg_type = RTM_GETSTATS;
+    h->nlmsg_flags = NLM_F_REQUEST;
+    h->nlmsg_seq = LINK_SEQ_COUNTERS;
+    h->nlmsg_pid = 0;
+    ism = NLMSG_DATA(h);
+    ism->ifindex = indexes[i];
+    ism->filter_mask = IFLA_STATS_FILTER_BIT(IFLA_STATS_LINK_64);
+    p += msglen;
+    t->counter_requests++;
+  }
+
+  rc = sendto(fd, packet, p - packet, 0, NULL, 0) < 0 ? -1 : 0;
+  free(packet);
+  return rc;
+}
+
+
+static int nsid_request(
+    int fd,
+    int type,
+    int nsfd,
+    int nsid)
+{
+  char packet[128], reply[512];
+  struct nlmsghdr *h = (struct nlmsghdr *)packet;
+  struct rtgenmsg *g = NLMSG_DATA(h);
+  struct rtattr *rta;
+  ssize_t len;
+  int attrlen;
+
+  memset(packet, 0, sizeof(packet));
+  h->nlmsg_len = NLMSG_LENGTH(sizeof(*g));
+  h->nlmsg_type = type;
+  h->nlmsg_flags = NLM_F_REQUEST|NLM_F_ACK;
+  g->rtgen_family = AF_UNSPEC;
+  append_attr(packet, NETNSA_FD, sizeof(nsfd), &nsfd);
+  if (type == RTM_NEWNSID)
+    append_attr(packet, NETNSA_NSID, sizeof(nsid), &nsid);
+
+  if (send(fd, packet, h->nlmsg_len, 0) < 0)
+    return -1;
+  len = recv(fd, reply, sizeof(reply), 0);
+  if (len < 0)
+    return -1;
+
+  h = (struct nlmsghdr *)reply;
+  if (!NLMSG_OK(h, len))
+    goto fail;
+  if (h->nlmsg_type == NLMSG_ERROR) {
+    errno = -parse_error(h);
+    return errno ? -1 : 0;
+  }
+  if (h->nlmsg_type != RTM_NEWNSID)
+    goto fail;
+
+  rta = NLMSG_DATA(h) + NLMSG_ALIGN(sizeof(*g));
+  attrlen = h->nlmsg_len - NLMSG_LENGTH(NLMSG_ALIGN(sizeof(*g)));
+  for (; RTA_OK(rta, attrlen); rta=RTA_NEXT(rta, attrlen)) {
+    if (rta->rta_type == NETNSA_NSID)
+      return *(int *)RTA_DATA(rta);
+  }
+
+fail:
+  errno = EPROTO;
+  return -1;
+}
+
+/* The id the current namespace knows the namespace in nsfd by, which
+ * is what NETLINK_LISTEN_ALL_NSID tags its events with. When assign is
+ * set one is allocated if the namespace has none yet. */
+int link_nsid(
+    int nsfd,
+    int assign)
+{
+  int fd = -1, nsid = -1;
+
+  fd = socket(AF_NETLINK, SOCK_DGRAM|SOCK_CLOEXEC, NETLINK_ROUTE);
+  if (fd < 0)
+    return -1;
+
+  if (assign && nsid_request(fd, RTM_NEWNSID, nsfd, -1) < 0 &&
+      errno != EEXIST)
+    goto fail;
+
+  nsid = nsid_request(fd, RTM_GETNSID, nsfd, 0);
+  if (nsid < 0 && errno == 0)
+    nsid = -1;
+
+fail:
+  close(fd);
+  return nsid;
+}
+
+
+/* Asks for a dump of every link. recover marks it as making up for
+ * lost events or an interrupted dump, which is what resyncs counts. */
+int link_resync(
+    int fd,
+    struct link_table *t,
+    int recover)
+{
+  if (recover)
+    t->recover = 1;
+
+  /* Only one dump may run per socket; ask again once it finishes */
+  if (t->dumping) {
+    t->resync_pending = 1;
+    return 0;
+  }
+
+  if (link_send(fd) < 0)
+    return -1;
+  if (t->recover)
+    t->resyncs++;
+  t->recover = 0;
+  t->dumping = 1;
+  t->resync_pending = 0;
+  t->generation++;
+  return 0;
+}
+
 
 int link_recv(
-    int fd)
+    int fd,
+    struct link_table *t,
+    link_change_cb cb,
+    void *arg)
 {
-  int loop = 1;
-  int rcvsz;
-  void *data = alloca(256*1024);
-  struct nlmsghdr *h = data;
-  int rc = 0;
+  char control[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cm;
+  struct link_table *dt;
+  ssize_t rcvsz;
+  struct nlmsghdr *h;
+  size_t len;
+  void *buf, *darg;
+  int rc = 0, err;
 
-  do {
-    memset(data, 0, 256*1024);
-    rcvsz = recv(fd, data, 256*1024, 0);
-    if (rcvsz < 0)
+  for (;;) {
+    if (!t->buf) {
+      t->buf = malloc(LINK_BUFSZ);
+      if (!t->buf)
+        return -1;
+      t->buflen = LINK_BUFSZ;
+    }
+
+    rcvsz = recv(fd, t->buf, t->buflen, MSG_PEEK|MSG_TRUNC);
+    if (rcvsz < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      if (errno == EINTR)
+        continue;
+      if (errno == ENOBUFS) {
+        /* Events were dropped; the table can only be trusted again
+         * after a fresh dump */
+        t->overruns++;
+        if (link_resync(fd, t, 1) < 0)
+          return -1;
+        continue;
+      }
       return -1;
+    }
+
+    if ((size_t)rcvsz > t->buflen) {
+      for (len=t->buflen; len < (size_t)rcvsz; len <<= 1);
+      buf = realloc(t->buf, len);
+      if (!buf)
+        return -1;
+      t->buf = buf;
+      t->buflen = len;
+    }
+
+    iov.iov_base = t->buf;
+    iov.iov_len = t->buflen;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    rcvsz = recvmsg(fd, &msg, 0);
+    if (rcvsz < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+        continue;
+      return -1;
+    }
+
+    /* Events from other namespaces carry the id they are known by */
+    dt = t;
+    darg = arg;
+    for (cm=CMSG_FIRSTHDR(&msg); cm != NULL; cm=CMSG_NXTHDR(&msg, cm)) {
+      if (cm->cmsg_level == SOL_NETLINK &&
+          cm->cmsg_type == NETLINK_LISTEN_ALL_NSID && t->route &&
+          !t->route(t->route_data, *(int *)CMSG_DATA(cm), &dt, &darg))
+        dt = NULL;
+    }
+    if (!dt)
+      continue;
+
+    for (h=t->buf; NLMSG_OK(h, rcvsz); h=NLMSG_NEXT(h, rcvsz)) {
+      if (dt != t) {
+        if (h->nlmsg_type == RTM_NEWLINK || h->nlmsg_type == RTM_DELLINK)
+          rc += parse_ifa(h, dt, cb, darg);
+        continue;
+      }
 
-    for (h=data; NLMSG_OK(h, rcvsz); h=NLMSG_NEXT(h, rcvsz)) {
-      if ((h->nlmsg_flags & NLM_F_MULTI) == 0)
-        loop = 0;
       if (h->nlmsg_type == NLMSG_DONE) {
-        loop = 0;
+        if (t->dumping) {
+          if (h->nlmsg_flags & NLM_F_DUMP_INTR) {
+            t->resync_pending = 1;
+            t->recover = 1;
+          }
+          else
+            sweep_devices(t, cb, arg);
+          t->dumping = 0;
+          if (t->resync_pending && link_resync(fd, t, 0) < 0)
+            return -1;
+        }
         break;
       }
       else if (h->nlmsg_type == NLMSG_ERROR) {
-        rc = parse_error(h);
-        if (rc < 0) {
-          errno = rc;
-          return rc;
+        err = parse_error(h);
+        /* A device went away before its counters were read */
+        if (h->nlmsg_seq == LINK_SEQ_COUNTERS) {
+          if (err < 0)
+            t->counter_errors++;
+          continue;
+        }
+        if (err < 0) {
+          if (t->dumping) {
+            t->dumping = 0;
+            t->resync_pending = 1;
+          }
+          errno = -err;
+          return -1;
         }
       }
       else if (h->nlmsg_type == RTM_NEWLINK ||
                h->nlmsg_type == RTM_DELLINK) {
-        rc += parse_ifa(h);
+        rc += parse_ifa(h, t, cb, arg);
       }
+      else if (h->nlmsg_type == RTM_NEWSTATS)
+        parse_stats(h, t);
     }
-  } while (loop);
+  }
 
   return rc;
 }
 
 
 int link_online(
-    char *dev)
+    struct link_table *t,
+    const char *dev)
+{
+  return link_index(t, dev) != 0;
+}
+
+int link_counters(
+    struct link_table *t,
+    const char *dev,
+    uint64_t *rx,
+    uint64_t *tx)
 {
-  struct devlist *d;
-  for (d=devices; d != NULL; d=d->next) {
-    if (strncmp(d->ifname, dev, 30) == 0)
-      return 1;
+  struct link_dev *d;
+
+  d = t->byname[link_hash_name(dev) & (t->nbuckets - 1)];
+  for (; d != NULL; d=d->nnext) {
+    if (strncmp(d->ifname, dev, IFNAMSIZ) == 0) {
+      *rx = d->rx_packets;
+      *tx = d->tx_packets;
+      return 0;
+    }
   }
-  return 0;  
+  return -1;
+}
+
+int link_index(
+    struct link_table *t,
+    const char *dev)
+{
+  struct link_dev *d;
+
+  d = t->byname[link_hash_name(dev) & (t->nbuckets - 1)];
+  for (; d != NULL; d=d->nnext) {
+    if (strncmp(d->ifname, dev, IFNAMSIZ) == 0)
+      return d->ifindex;
+  }
+  return 0;
+}
+
+/* At most 9 instructions per name, so BPF_MAXINSNS runs out at about
+ * 370 watched devices per socket */
+#define FILTER_LEN(nidx, nnames) (15 + 2 * (nidx) + 9 * (nnames))
+
+/* Link messages for anything other than the given ifindexes and names
+ * are dropped by the kernel before they reach the socket. Every test
+ * that succeeds returns straight away so jumps stay short no matter how
+ * many devices are watched. Indexes catch a watched device being
+ * renamed away, names catch one appearing. */
+int link_filter(
+    int fd,
+    const int *indexes,
+    size_t nindexes,
+    char **names,
+    size_t nnames)
+{
+  struct sock_filter *f, *p;
+  struct sock_fprog prog;
+  char name[IFNAMSIZ+3];
+  uint32_t v;
+  size_t i, w, nw;
+  int rc;
+
+  if (FILTER_LEN(nindexes, nnames) > BPF_MAXINSNS) {
+    errno = E2BIG;
+    return -1;
+  }
+
+  f = calloc(FILTER_LEN(nindexes, nnames), sizeof(*f));
+  if (!f)
+    return -1;
+  p = f;
+
+  /* Anything that is not a link change, or is part of a dump */
+  *p++ = (struct sock_filter)BPF_STMT(BPF_LD|BPF_H|BPF_ABS,
+                   offsetof(struct nlmsghdr, nlmsg_type));
+  *p++ = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K,
+                   htons(RTM_NEWLINK), 2, 0);
+  *p++ = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K,
+                   htons(RTM_DELLINK), 1, 0);
+  *p++ = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, 0xffffffff);
+  *p++ = (struct sock_filter)BPF_STMT(BPF_LD|BPF_H|BPF_ABS,
+                   offsetof(struct nlmsghdr, nlmsg_flags));
+  *p++ = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JSET|BPF_K,
+                   htons(NLM_F_MULTI), 0, 1);
+  *p++ = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, 0xffffffff);
+
+  *p++ = (struct sock_filter)BPF_STMT(BPF_LD|BPF_W|BPF_ABS,
+                   NLMSG_HDRLEN + offsetof(struct ifinfomsg, ifi_index));
+  for (i=0; i < nindexes; i++) {
+    *p++ = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K,
+                     htonl(indexes[i]), 0, 1);
+    *p++ = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, 0xffffffff);
+  }
+
+  /* X = offset of IFLA_IFNAME, then compare the NUL padded name a word
+   * at a time. The kernel zeroes attribute padding. */
+  *p++ = (struct sock_filter)BPF_STMT(BPF_LD|BPF_IMM,
+                   NLMSG_HDRLEN + NLMSG_ALIGN(sizeof(struct ifinfomsg)));
+  *p++ = (struct sock_filter)BPF_STMT(BPF_LDX|BPF_IMM, IFLA_IFNAME);
+  *p++ = (struct sock_filter)BPF_STMT(BPF_LD|BPF_W|BPF_ABS,
+                   SKF_AD_OFF + SKF_AD_NLATTR);
+  *p++ = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0, 0, 1);
+  *p++ = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, 0);
+  *p++ = (struct sock_filter)BPF_STMT(BPF_MISC|BPF_TAX, 0);
+
+  for (i=0; i < nnames; i++) {
+    memset(name, 0, sizeof(name));
+    strncpy(name, names[i], IFNAMSIZ-1);
+    nw = strlen(name) / 4 + 1;
+    for (w=0; w < nw; w++) {
+      memcpy(&v, name + w * 4, sizeof(v));
+      *p++ = (struct sock_filter)BPF_STMT(BPF_LD|BPF_W|BPF_IND,
+                       NLA_HDRLEN + w * 4);
+      *p++ = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K,
+                       ntohl(v), 0, w == nw-1 ? 1 : 2 * (nw - w) - 1);
+    }
+    *p++ = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, 0xffffffff);
+  }
+  *p++ = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, 0);
+
+  prog.len = p - f;
+  prog.filter = f;
+  rc = setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+  free(f);
+  return rc;
+}
+
+/* Lets every message through again */
+int link_unfilter(
+    int fd)
+{
+  int dummy = 0;
+
+  if (setsockopt(fd, SOL_SOCKET, SO_DETACH_FILTER, &dummy,
+                 sizeof(dummy)) < 0 && errno != ENOENT)
+    return -1;
+  return 0;
 }
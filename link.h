@@ -1,8 +1,70 @@
 #ifndef _LINK_H_
 #define _LINK_H_
-int link_socket(void);
+#include <net/if.h>
+
+struct link_table;
+typedef int (*link_route_cb)(void *data, int nsid, struct link_table **t,
+                             void **arg);
+
+/* Devices currently up, indexed both by ifindex and by name so a link
+ * message touches only the device it is about. */
+struct link_table {
+  size_t len;
+  size_t nbuckets;
+  struct link_dev {
+    int ifindex;
+    char ifname[IFNAMSIZ];
+    unsigned seen;
+    /* From IFLA_STATS64 in the last message about the device, or from
+     * the last reply to link_request_counters() */
+    uint64_t rx_packets;
+    uint64_t tx_packets;
+    struct link_dev *inext;
+    struct link_dev *nnext;
+  } **byindex, **byname;
+
+  /* Receive buffer, grown to the largest datagram seen so far */
+  void *buf;
+  size_t buflen;
+
+  /* A dump is outstanding; devices it does not mention are gone */
+  int dumping;
+  int resync_pending;
+  /* The next dump recovers from lost events and counts as a resync */
+  int recover;
+  unsigned generation;
+
+  unsigned long overruns;
+  unsigned long resyncs;
+  /* Devices whose counters were asked for alone, and requests failed */
+  unsigned long counter_requests;
+  unsigned long counter_errors;
+
+  /* Picks the table for events tagged with a namespace id */
+  link_route_cb route;
+  void *route_data;
+};
+
+typedef void (*link_change_cb)(void *data, char *name, int ifindex, int state);
+
+uint32_t link_hash_name(const char *name);
+
+struct link_table * link_table_create(void);
+void link_table_destroy(struct link_table *);
+
+int link_socket(int rcvbuf, int netns);
+int link_nsid(int nsfd, int assign);
 int link_send(int fd);
-int link_recv(int fd);
+int link_resync(int fd, struct link_table *, int recover);
+int link_request_counters(int fd, struct link_table *, int *indexes,
+                          size_t nindexes);
+int link_recv(int fd, struct link_table *, link_change_cb cb, void *data);
 
-int link_online(char *name);
+int link_index(struct link_table *, const char *);
+int link_filter(int fd, const int *indexes, size_t nindexes,
+                char **names, size_t nnames);
+int link_unfilter(int fd);
+int link_online(struct link_table *, const char *name);
+int link_counters(struct link_table *, const char *name, uint64_t *rx,
+                  uint64_t *tx);
 #endif
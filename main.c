@@ -2,40 +2,175 @@
 #include "ev_icmp.h"
 #include "ev_link.h"
 #include "ini.h"
+#include "netns.h"
+#include "shard.h"
+#include "hist.h"
+#include "metrics.h"
+#include "stats.h"
+#include "resolver.h"
 
 #include <ev.h>
 #include <sys/auxv.h>
 #include <signal.h>
+#include <netdb.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <pthread.h>
 
-struct {
+/* A section probing both families is split into one of each */
+#define FAMILY_BOTH -2
+
+#define SECTION_BUCKETS 256
+#define CONFIG_THREADS_MAX 16
+
+struct config {
   int entries;
   int argc;
   char **argv;
+  char *fname;
+  int shared;
+  int batch;
+  int timestamps;
+  int wheel;
+  double tick;
+  double slack;
+  int rcvbuf;
+  int link_filter;
+  char *metrics_socket;
+  int metrics_port;
+  char *stats_file;
+  int resolver_threads;
+  double resolve_ttl;
+  double started;
+  int flags;
+  int threads;
+  int nshards;
+  int next_shard;
+  struct shard *shards;
+
+  /* Sections by name, grown to keep about one per bucket */
+  struct entry **sections;
+  size_t nbuckets;
+
+  /* Files and directories to read once the main file is parsed */
+  char **includes;
+  int nincludes;
+
+  /* The daemon's own namespace comes first and is always attached */
+  struct netns {
+    char *name;
+    int fd;
+    int attached;
+    int retry;
+    ev_link link;
+    struct netns *next;
+  } *namespaces;
+  ev_io nswatch;
+  ev_timer nsretry;
+  ev_timer idle;
+
   struct entry {
     char *name;
     char *device;
     char *ping;
+    char *netns;
+    struct netns *ns;
+    struct shard *shard;
+    int nsfd;
     double interval;
     double timeout;
+    int outstanding;
+    int family;
+    int idle_only;
+    int backoff_after;
+    double backoff_max;
+    double slack;
+    int slot;
+
+    /* Written by the main thread until the first lookup completes and
+     * by the owning shard after that */
+    int resolved;
+    struct sockaddr_storage peer;
+    socklen_t peerlen;
 
-    double average;
-    int samples;
-    int failures;
-    double last_sent;
+    struct probe_results results;
+    /* A changed section replacing this one takes its results over on
+     * their shard and frees it */
+    struct entry *previous;
+    int replaced;
+
+    /* Probes are skipped while the device carries other traffic. The
+     * shard counts probes; the main thread reads the device counters
+     * and records when it last saw traffic that was not ours. */
+    unsigned long probes;
+    unsigned long suppressed;
+    double last_traffic;
+    uint64_t rx;
+    uint64_t tx;
+    unsigned long probes_seen;
+    unsigned long probes_dumped;
     struct entry *next;
+    struct entry *hnext;
     ev_icmp icmp;
   } *tuns;
 } config;
 
-void reload_cb(
-    struct ev_loop *loop,
-    ev_signal *w,
-    int revents)
+static struct metrics metrics;
+static struct stats stats;
+static struct resolver resolver;
+
+/* Runs on the shard owning the entry, which is the record's only writer */
+static void entry_publish(
+    struct entry *e)
+{
+  struct stats_record *r;
+
+  if (e->slot < 0)
+    return;
+  r = stats_begin(&stats, e->slot);
+  r->state = e->icmp.ic && e->icmp.active ? STATS_UP : STATS_DOWN;
+  r->samples = e->results.samples;
+  r->failures = e->results.failures;
+  r->mean = hist_mean(&e->results.hist);
+  r->ewma = e->results.hist.ewma;
+  r->min = (double)e->results.hist.min / 1e6;
+  r->max = (double)e->results.hist.max / 1e6;
+  r->jitter = e->results.hist.jitter;
+  r->last_sent = e->results.last_sent;
+  stats_end(r);
+}
+
+/* Runs on the main thread before the entry is handed to its shard */
+static void entry_publish_new(
+    struct entry *e)
+{
+  struct stats_record *r;
+
+  e->slot = stats_alloc(&stats);
+  if (e->slot < 0) {
+    if (stats.header)
+      warnx("No room in %s for section %s", config.stats_file, e->name);
+    return;
+  }
+
+  r = stats_begin(&stats, e->slot);
+  snprintf(r->section, sizeof(r->section), "%s", e->name);
+  snprintf(r->device, sizeof(r->device), "%s", e->device);
+  snprintf(r->address, sizeof(r->address), "%s", e->ping);
+  snprintf(r->netns, sizeof(r->netns), "%s", e->netns ? e->netns : "");
+  stats_end(r);
+  entry_publish(e);
+}
+
+/* Global options cannot change under running sockets, so a reload that
+ * touches them starts the daemon afresh */
+static void restart(
+    struct ev_loop *loop)
 {
   sigset_t set;
   char *path = (char *)getauxval(AT_EXECFN);
 
-  printf("Reloading daemon..\n");
+  printf("Restarting daemon..\n");
   fflush(stdout);
   sigemptyset(&set);
   sigaddset(&set, SIGHUP);
@@ -51,79 +186,940 @@ static void update_stats(
     double rtt)
 {
   struct entry *e = data;
-  int successes;
-
 
-  successes = e->samples - e->failures;
-  e->last_sent = ev_now(EV_DEFAULT);
-  if (rtt > 0.0)
-    e->average = ((e->average * (double)successes) + rtt) / ((double)successes + 1.0);
-  else
-    e->failures++;
-  e->samples++;
+  results_record(&e->results, ev_now(e->shard->loop), rtt);
+  entry_publish(e);
 
   return;
 }
 
 
+/* What the section is being probed at, backoff included */
+static double entry_interval(
+    struct entry *e)
+{
+  if (!e->icmp.ic)
+    return e->interval;
+  return ev_icmp_interval(&e->icmp);
+}
+
 static void print_stats(
     struct ev_loop *l,
     ev_signal *w,
     int revents)
 {
   double now = ev_now(l);
-  int successes;
+  unsigned long wakeups = 0, overruns = 0, resyncs = 0, suppressed = 0;
+  unsigned long changes = 0, fallbacks = 0, counters = 0;
+  double link_cpu = 0.0;
+  struct icmp_counters c;
+  unsigned long iterations = ev_iteration(l);
+  int successes, i;
   struct entry *e;
+  struct netns *ns;
+  struct shard *s;
+  struct probe_results r;
+  char addr[64];
 
   if (config.tuns)
-    printf("%16s/%-16s %6s %11s %8s %-8s\n", "device", "addr", "last", "rcv/sent", "percent", "rtt");
+    printf("%16s/%-16s %6s %8s %11s %8s %8s %8s %8s %8s %8s %8s %8s %8s\n",
+    "device", "addr", "last", "interval", "rcv/sent", "percent", "mean", "ewma",
+    "min", "p50", "p90", "p99", "max", "jitter");
 
+  /* Shards keep running while this reads their entries and counters,
+   * so the figures are approximate: a line may mix adjacent probes,
+   * but never shows a torn number. */
   for (e=config.tuns; e != NULL; e=e->next) {
-    successes = e->samples - e->failures;
-    printf("%16s/%-16s %5.1fs %5d/%-5d %6.1f%% %4.2fms\n",
-    e->device, e->ping,
-    (now - e->last_sent), successes, e->samples,
-    ((double)successes/(double)e->samples) * 100,
-    e->average * 1000);
+    results_copy(&r, &e->results);
+    successes = r.samples - r.failures;
+    snprintf(addr, sizeof(addr), "%s%s", e->ping,
+             e->family == AF_INET ? " v4" :
+             e->family == AF_INET6 ? " v6" : "");
+    printf("%16s/%-16s %5.1fs %7.1fs %5d/%-5d %6.1f%% "
+    "%6.2fms %6.2fms %6.2fms %6.2fms %6.2fms %6.2fms %6.2fms %6.2fms\n",
+    e->device, addr,
+    (now - r.last_sent), entry_interval(e), successes,
+    r.samples,
+    ((double)successes/(double)r.samples) * 100,
+    hist_mean(&r.hist) * 1000, r.hist.ewma * 1000,
+    (double)r.hist.min / 1000,
+    hist_percentile(&r.hist, 0.50) * 1000,
+    hist_percentile(&r.hist, 0.90) * 1000,
+    hist_percentile(&r.hist, 0.99) * 1000,
+    (double)r.hist.max / 1000, r.hist.jitter * 1000);
+    suppressed += __atomic_load_n(&e->suppressed, __ATOMIC_RELAXED);
+  }
+  memset(&c, 0, sizeof(c));
+  for (i=0; i < config.nshards; i++) {
+    s = &config.shards[i];
+    c.sockets += __atomic_load_n(&s->counters->sockets, __ATOMIC_RELAXED);
+    c.sent += __atomic_load_n(&s->counters->sent, __ATOMIC_RELAXED);
+    c.received += __atomic_load_n(&s->counters->received, __ATOMIC_RELAXED);
+    c.syscalls += __atomic_load_n(&s->counters->syscalls, __ATOMIC_RELAXED);
+    c.rejected += __atomic_load_n(&s->counters->rejected, __ATOMIC_RELAXED);
+    c.scheduled += __atomic_load_n(&s->counters->scheduled, __ATOMIC_RELAXED);
+    c.late_ns += __atomic_load_n(&s->counters->late_ns, __ATOMIC_RELAXED);
+    if (s->threaded)
+      iterations += ev_iteration(s->loop);
   }
+
+  if (now > config.started)
+    printf("%lu sockets, %lu sent, %lu received, %lu rejected, "
+    "%.1f wakeups/s, %.3fms send delay, %.2f syscalls/probe\n",
+    c.sockets, c.sent, c.received, c.rejected,
+    (double)iterations / (now - config.started),
+    c.scheduled ? (double)c.late_ns / (double)c.scheduled / 1e6 : 0.0,
+    c.sent ? (double)c.syscalls / (double)c.sent : 0.0);
+  for (ns=config.namespaces; ns != NULL; ns=ns->next) {
+    if (!ns->attached)
+      continue;
+    wakeups += ns->link.wakeups;
+    changes += ns->link.changes;
+    link_cpu += ns->link.cpu;
+    overruns += ns->link.table->overruns;
+    resyncs += ns->link.table->resyncs;
+    fallbacks += ns->link.fallbacks;
+    counters += ns->link.table->counter_requests;
+  }
+  printf("%lu link wakeups, %lu link changes, %.3fms link cpu, "
+  "%lu link overruns, %lu link resyncs, %lu probes suppressed, "
+  "%lu link filter fallbacks, %lu link counter requests\n",
+  wakeups, changes, link_cpu * 1000, overruns, resyncs, suppressed,
+  fallbacks, counters);
+  printf("%lu lookups, %lu lookup failures, %lu address changes\n",
+  resolver.lookups, resolver.failures, resolver.changes);
   fflush(stdout);
   return;
 }
 
 
+enum {
+  METRIC_PROBES,
+  METRIC_FAILURES,
+  METRIC_SUPPRESSED,
+  METRIC_LAST_PROBE,
+  METRIC_LINK_UP,
+  METRIC_INTERVAL,
+  METRIC_RTT,
+  METRIC_JITTER,
+};
+
+static const struct metrics_family metric_families[] = {
+  [METRIC_PROBES] = { "tupperware_probes", "counter",
+                      "Probes completed, answered or not" },
+  [METRIC_FAILURES] = { "tupperware_failures", "counter",
+                        "Probes that timed out" },
+  [METRIC_SUPPRESSED] = { "tupperware_probes_suppressed", "counter",
+                          "Probes skipped because the device was busy" },
+  [METRIC_LAST_PROBE] = { "tupperware_last_probe_age_seconds", "gauge",
+                          "Time since the last probe completed" },
+  [METRIC_LINK_UP] = { "tupperware_link_up", "gauge",
+                       "Whether the device is up and being probed" },
+  [METRIC_INTERVAL] = { "tupperware_probe_interval_seconds", "gauge",
+                        "Interval probes are sent at, including backoff" },
+  [METRIC_RTT] = { "tupperware_rtt_seconds", "histogram",
+                   "Round trip time of answered probes" },
+  [METRIC_JITTER] = { "tupperware_rtt_jitter_seconds", "gauge",
+                      "Smoothed variation between successive round trips" },
+};
+
+static const double rtt_bounds[] = {
+  0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05,
+  0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0
+};
+#define NBOUNDS (sizeof(rtt_bounds) / sizeof(rtt_bounds[0]))
+
+static void * metrics_first(
+    void *data)
+{
+  return config.tuns;
+}
+
+static void * metrics_next(
+    void *data,
+    void *item)
+{
+  return ((struct entry *)item)->next;
+}
+
+static void metrics_labels(
+    struct metrics_buf *b,
+    struct entry *e)
+{
+  metrics_label(b, "section", e->name, 1);
+  metrics_label(b, "device", e->device, 0);
+  metrics_label(b, "address", e->ping, 0);
+  if (e->family != AF_UNSPEC)
+    metrics_label(b, "family", e->family == AF_INET6 ? "ipv6" : "ipv4", 0);
+  if (e->netns)
+    metrics_label(b, "netns", e->netns, 0);
+}
+
+/* Read from the main thread while shards write, through the same
+ * approximate copy print_stats() takes */
+static void metrics_render(
+    void *data,
+    void *item,
+    size_t family,
+    struct metrics_buf *b)
+{
+  struct entry *e = item;
+  const char *name = metric_families[family].name;
+  struct probe_results r;
+  uint64_t counts[NBOUNDS];
+  size_t i;
+
+  results_copy(&r, &e->results);
+
+  switch (family) {
+  case METRIC_PROBES:
+  case METRIC_FAILURES:
+    metrics_printf(b, "%s_total{", name);
+    metrics_labels(b, e);
+    metrics_printf(b, "} %d\n", family == METRIC_PROBES ?
+                   r.samples : r.failures);
+    break;
+
+  case METRIC_SUPPRESSED:
+    metrics_printf(b, "%s_total{", name);
+    metrics_labels(b, e);
+    metrics_printf(b, "} %lu\n",
+                   __atomic_load_n(&e->suppressed, __ATOMIC_RELAXED));
+    break;
+
+  case METRIC_LAST_PROBE:
+    if (!r.samples)
+      break;
+    metrics_printf(b, "%s{", name);
+    metrics_labels(b, e);
+    metrics_printf(b, "} %.3f\n", ev_now(EV_DEFAULT) - r.last_sent);
+    break;
+
+  case METRIC_LINK_UP:
+    metrics_printf(b, "%s{", name);
+    metrics_labels(b, e);
+    metrics_printf(b, "} %d\n", e->icmp.ic && e->icmp.active);
+    break;
+
+  case METRIC_INTERVAL:
+    metrics_printf(b, "%s{", name);
+    metrics_labels(b, e);
+    metrics_printf(b, "} %g\n", entry_interval(e));
+    break;
+
+  case METRIC_RTT:
+    hist_cumulative(&r.hist, rtt_bounds, NBOUNDS, counts);
+    for (i=0; i < NBOUNDS; i++) {
+      metrics_printf(b, "%s_bucket{", name);
+      metrics_labels(b, e);
+      metrics_printf(b, ",le=\"%g\"} %lu\n", rtt_bounds[i],
+                     (unsigned long)counts[i]);
+    }
+    metrics_printf(b, "%s_bucket{", name);
+    metrics_labels(b, e);
+    metrics_printf(b, ",le=\"+Inf\"} %lu\n",
+                   (unsigned long)r.hist.count);
+    metrics_printf(b, "%s_count{", name);
+    metrics_labels(b, e);
+    metrics_printf(b, "} %lu\n", (unsigned long)r.hist.count);
+    metrics_printf(b, "%s_sum{", name);
+    metrics_labels(b, e);
+    metrics_printf(b, "} %.6f\n", (double)r.hist.sum / 1e6);
+    break;
+
+  case METRIC_JITTER:
+    metrics_printf(b, "%s{", name);
+    metrics_labels(b, e);
+    metrics_printf(b, "} %.6f\n", r.hist.jitter);
+    break;
+  }
+}
+
+
+/* Runs on the shard owning the entry. The link is up while it has an
+ * ifindex, and probes are pinned to it. */
+static void entry_link(
+    struct ev_loop *loop,
+    void *data,
+    int ifindex)
+{
+  struct entry *e = data;
+
+  if (!e->icmp.ic)
+    return;
+
+  if (ifindex) {
+    ev_icmp_set_device(&e->icmp, e->device, ifindex);
+    printf("%s%s%s up, Ping address %s, interval %.1fs, timeout %.1fs\n",
+            e->netns ? e->netns : "", e->netns ? "/" : "",
+            e->device, e->ping, e->interval, e->timeout);
+    ev_icmp_start(loop, &e->icmp);
+  }
+  else {
+    printf("%s%s%s down. Pinging suspended.\n",
+            e->netns ? e->netns : "", e->netns ? "/" : "", e->device);
+    ev_icmp_stop(loop, &e->icmp);
+  }
+  entry_publish(e);
+  fflush(stdout);
+}
+
+#define IDLE_SLACK 2
+
+/* Runs on the shard before each probe of an idle_only section */
+static int entry_suppress(
+    void *data,
+    ev_tstamp now)
+{
+  struct entry *e = data;
+  double seen;
+
+  __atomic_load(&e->last_traffic, &seen, __ATOMIC_RELAXED);
+  if (now - seen < e->interval) {
+    __atomic_store_n(&e->suppressed, e->suppressed + 1, __ATOMIC_RELAXED);
+    return 1;
+  }
+  __atomic_store_n(&e->probes, e->probes + 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/* Compare each idle_only device's packet counters from the last sample
+ * with the probes sent over it between the two samples, then ask for
+ * the next one. Each probe accounts for one packet out and one back; a
+ * couple more are let through for replies straddling a sample and for
+ * neighbour discovery. Only those devices' counters are asked for, not
+ * a dump of every link. */
+static void idle_check_cb(
+    struct ev_loop *loop,
+    ev_timer *w,
+    int revents)
+{
+  struct entry *e;
+  struct netns *ns;
+  uint64_t rx, tx;
+  double now = ev_now(loop);
+  int *indexes, ifindex;
+  size_t n;
+
+  for (e=config.tuns; e != NULL; e=e->next) {
+    if (!e->idle_only || !e->ns->attached)
+      continue;
+    if (link_counters(e->ns->link.table, e->device, &rx, &tx) < 0)
+      continue;
+    /* Counters going backwards mean the device was recreated */
+    if (rx >= e->rx && tx >= e->tx &&
+        (rx - e->rx) + (tx - e->tx) >
+          2 * (e->probes_dumped - e->probes_seen) + IDLE_SLACK)
+      __atomic_store(&e->last_traffic, &now, __ATOMIC_RELAXED);
+    e->rx = rx;
+    e->tx = tx;
+    e->probes_seen = e->probes_dumped;
+  }
+
+  indexes = malloc(config.entries * sizeof(*indexes));
+  assert(indexes);
+  for (ns=config.namespaces; ns != NULL; ns=ns->next) {
+    if (!ns->attached)
+      continue;
+    n = 0;
+    for (e=config.tuns; e != NULL; e=e->next) {
+      if (e->ns != ns || !e->idle_only)
+        continue;
+      ifindex = link_index(ns->link.table, e->device);
+      if (ifindex)
+        indexes[n++] = ifindex;
+    }
+    if (link_request_counters(ns->link.fd, ns->link.table, indexes, n) < 0)
+      warn("Cannot request link counters");
+  }
+  free(indexes);
+
+  for (e=config.tuns; e != NULL; e=e->next) {
+    if (e->idle_only)
+      e->probes_dumped = __atomic_load_n(&e->probes, __ATOMIC_RELAXED);
+  }
+}
+
+/* Counters are sampled as often as the shortest idle_only interval */
+static void idle_schedule(
+    struct ev_loop *loop)
+{
+  struct entry *e;
+  double period = 0.0;
+
+  for (e=config.tuns; e != NULL; e=e->next) {
+    if (e->idle_only && (period == 0.0 || e->interval < period))
+      period = e->interval;
+  }
+
+  if (period == 0.0) {
+    ev_timer_stop(loop, &config.idle);
+    return;
+  }
+  if (period != config.idle.repeat || !ev_is_active(&config.idle)) {
+    config.idle.repeat = period;
+    ev_timer_again(loop, &config.idle);
+  }
+}
+
+/* Sockets are created by the thread that will use them. The shard owns
+ * the namespace descriptor it is handed and closes it on detach. */
+static void shard_setup(
+    struct shard *s)
+{
+  if (config.wheel)
+    ev_icmp_scheduler(config.tick);
+}
+
+static void entry_attach(
+    struct ev_loop *loop,
+    void *data,
+    int nsfd)
+{
+  struct entry *e = data;
+
+  e->nsfd = nsfd;
+  e->icmp.data = e;
+  if (ev_icmp_init(&e->icmp, update_stats, (struct sockaddr *)&e->peer,
+                   e->peerlen, e->interval, e->timeout, e->outstanding,
+                   config.flags, nsfd)) {
+    if (e->idle_only)
+      e->icmp.suppress = entry_suppress;
+    ev_icmp_backoff(&e->icmp, e->backoff_after,
+                    e->backoff_max ? e->backoff_max : e->interval * 64);
+    ev_icmp_slack(&e->icmp, e->slack);
+    return;
+  }
+
+  if (!e->netns)
+    err(EXIT_FAILURE, "Cannot ping address %s", e->ping);
+  warn("Cannot ping address %s in %s", e->ping, e->netns);
+  e->icmp.ic = NULL;
+}
+
+static void entry_detach(
+    struct ev_loop *loop,
+    void *data,
+    int unused)
+{
+  struct entry *e = data;
+
+  if (e->icmp.ic) {
+    if (e->icmp.active)
+      entry_link(loop, e, 0);
+    ev_icmp_destroy(loop, &e->icmp);
+  }
+  if (e->nsfd > -1)
+    close(e->nsfd);
+  e->nsfd = -1;
+}
+
 static void link_change(
+    void *data,
     char *dev,
+    int ifindex,
     int state)
 {
+  struct entry *e = data;
+  shard_call(e->shard, entry_link, e, state ? ifindex : 0);
+}
+
+struct readdress {
   struct entry *e;
+  struct sockaddr_storage peer;
+  socklen_t peerlen;
+};
+
+/* Runs on the shard owning the entry */
+static void entry_readdress(
+    struct ev_loop *loop,
+    void *data,
+    int unused)
+{
+  struct readdress *ra = data;
+  struct entry *e = ra->e;
+
+  memcpy(&e->peer, &ra->peer, ra->peerlen);
+  e->peerlen = ra->peerlen;
+  if (e->icmp.ic &&
+      ev_icmp_set_peer(loop, &e->icmp, (struct sockaddr *)&e->peer,
+                       e->peerlen) < 0)
+    warn("Cannot move section %s to its new address", e->name);
+  free(ra);
+}
+
+/* Hands the entry to its shard to create its socket in its namespace */
+static int entry_hand_over(
+    struct entry *e)
+{
+  int fd = -1;
+
+  if (e->ns->fd > -1) {
+    fd = fcntl(e->ns->fd, F_DUPFD_CLOEXEC, 0);
+    if (fd < 0)
+      return -1;
+  }
+  shard_call(e->shard, entry_attach, e, fd);
+  return 0;
+}
+
+static void entry_resolved(
+    void *data,
+    const struct sockaddr *addr,
+    socklen_t len)
+{
+  struct entry *e = data;
+  struct readdress *ra;
+  char host[NI_MAXHOST];
+  int ifindex;
+
+  if (e->resolved) {
+    if (getnameinfo(addr, len, host, sizeof(host), NULL, 0,
+                    NI_NUMERICHOST) == 0)
+      printf("%s now resolves to %s\n", e->ping, host);
+    fflush(stdout);
+    ra = malloc(sizeof(*ra));
+    assert(ra);
+    ra->e = e;
+    memcpy(&ra->peer, addr, len);
+    ra->peerlen = len;
+    shard_call(e->shard, entry_readdress, ra, 0);
+    return;
+  }
+
+  memcpy(&e->peer, addr, len);
+  e->peerlen = len;
+  e->resolved = 1;
+  if (!e->ns->attached)
+    return;
+
+  if (entry_hand_over(e) < 0) {
+    warn("Cannot attach section %s", e->name);
+    return;
+  }
+  /* The link may have come up while the address was being looked up */
+  ifindex = link_index(e->ns->link.table, e->device);
+  if (ifindex)
+    shard_call(e->shard, entry_link, e, ifindex);
+}
+
+
+static void netns_detach(
+    struct ev_loop *loop,
+    struct netns *ns)
+{
+  struct entry *e;
+
   for (e=config.tuns; e != NULL; e=e->next) {
-    if (strcmp(e->device, dev) == 0) {
-      if (state) {
-        printf("%s up, Ping address %s, interval %.1fs, timeout %.1fs\n",
-                e->device, e->ping, e->interval, e->timeout);
-        ev_icmp_start(EV_DEFAULT, &e->icmp);
-      }
-      else {
-        printf("%s down. Pinging suspended.\n", e->device);
-        ev_icmp_stop(EV_DEFAULT, &e->icmp);
+    if (e->ns == ns)
+      shard_call(e->shard, entry_detach, e, 0);
+  }
+
+  if (ns->link.table)
+    ev_link_destroy(loop, &ns->link);
+  if (ns->fd > -1)
+    close(ns->fd);
+  ns->fd = -1;
+  ns->attached = 0;
+}
+
+/* Opens the namespace, then creates its link watcher and every ping
+ * socket of the sections in it from inside the namespace */
+static int netns_attach(
+    struct ev_loop *loop,
+    struct netns *ns)
+{
+  struct entry *e;
+  int saved;
+
+  if (ns->attached)
+    return 0;
+
+  if (ns->name) {
+    ns->fd = netns_open(ns->name);
+    if (ns->fd < 0)
+      return -1;
+    if (!ev_link_init(&ns->link, link_change, config.rcvbuf,
+                      config.link_filter, ns->fd))
+      goto fail;
+    ev_link_aggregate(&config.namespaces->link, &ns->link);
+  }
+
+  for (e=config.tuns; e != NULL; e=e->next) {
+    if (e->ns != ns)
+      continue;
+    if (e->resolved && entry_hand_over(e) < 0)
+      goto fail;
+    ev_link_add_device(&ns->link, e->device, e);
+  }
+
+  ns->attached = 1;
+  ns->retry = 0;
+  if (ns->name)
+    ev_link_start(loop, &ns->link);
+  return 0;
+
+fail:
+  saved = errno;
+  netns_detach(loop, ns);
+  ns->retry = 0;
+  errno = saved;
+  return -1;
+}
+
+static void netns_retry_cb(
+    struct ev_loop *loop,
+    ev_timer *w,
+    int revents)
+{
+  struct netns *ns;
+  int pending = 0;
+
+  /* ip-netns creates the file before mounting the namespace on it */
+  for (ns=config.namespaces; ns != NULL; ns=ns->next) {
+    if (!ns->retry || ns->attached)
+      continue;
+    if (netns_attach(loop, ns) == 0)
+      continue;
+    if (errno == EINVAL || errno == ENOENT)
+      ns->retry = pending = 1;
+    else
+      warn("Cannot attach network namespace %s", ns->name);
+  }
+  if (!pending)
+    ev_timer_stop(loop, w);
+}
+
+static void netns_change(
+    void *data,
+    const char *name,
+    int present)
+{
+  struct ev_loop *loop = data;
+  struct netns *ns;
+
+  for (ns=config.namespaces; ns != NULL; ns=ns->next) {
+    if (!ns->name || strcmp(ns->name, name) != 0)
+      continue;
+    if (present) {
+      printf("Network namespace %s appeared\n", name);
+      ns->retry = 1;
+      ev_timer_again(loop, &config.nsretry);
+      ev_invoke(loop, &config.nsretry, EV_TIMER);
+    }
+    else if (ns->attached) {
+      printf("Network namespace %s removed\n", name);
+      netns_detach(loop, ns);
+    }
+    fflush(stdout);
+  }
+}
+
+static void netns_watch_cb(
+    struct ev_loop *loop,
+    ev_io *w,
+    int revents)
+{
+  if (netns_read(w->fd, netns_change, loop) < 0)
+    warn("Cannot read network namespace changes");
+}
+
+static struct netns * netns_get(
+    const char *name)
+{
+  struct netns *ns, **pp;
+
+  for (pp=&config.namespaces; *pp != NULL; pp=&(*pp)->next) {
+    ns = *pp;
+    if (ns->name == name || (ns->name && name && strcmp(ns->name, name) == 0))
+      return ns;
+  }
+
+  ns = malloc(sizeof(*ns));
+  assert(ns);
+  memset(ns, 0, sizeof(*ns));
+  ns->fd = -1;
+  if (name) {
+    ns->name = strdup(name);
+    assert(ns->name);
+  }
+  *pp = ns;
+  return ns;
+}
+
+
+static int netns_used(
+    struct netns *ns)
+{
+  struct entry *e;
+
+  for (e=config.tuns; e != NULL; e=e->next) {
+    if (e->ns == ns)
+      return 1;
+  }
+  return 0;
+}
+
+/* Attach every namespace that is not yet, and watch /run/netns for the
+ * ones that are missing */
+static void netns_attach_all(
+    struct ev_loop *loop)
+{
+  struct netns *ns;
+  int fd;
+
+  for (ns=config.namespaces->next; ns != NULL; ns=ns->next) {
+    if (ns->attached || ns->retry || !netns_used(ns))
+      continue;
+    if (netns_attach(loop, ns) == 0)
+      continue;
+    warn("Cannot attach network namespace %s", ns->name);
+    if (errno == EINVAL || errno == ENOENT) {
+      ns->retry = 1;
+      ev_timer_again(loop, &config.nsretry);
+    }
+  }
+
+  if (config.namespaces->next && !ev_is_active(&config.nswatch)) {
+    fd = netns_watch();
+    if (fd < 0)
+      warn("Cannot watch %s for new namespaces", NETNS_RUN_DIR);
+    else {
+      ev_io_init(&config.nswatch, netns_watch_cb, fd, EV_READ);
+      ev_io_start(loop, &config.nswatch);
+    }
+  }
+}
+
+
+static int cloexec_file(
+    FILE *f)
+{
+  int fd = fileno(f);
+  int flags = 0;
+
+  flags = fcntl(fd, F_GETFD);
+  flags |= FD_CLOEXEC;
+  if (fcntl(fd, F_SETFD, flags) < 0)
+    return -1;
+  return 0;
+}
+
+static int parse_bool(
+    const char *value)
+{
+  if (strcasecmp(value, "yes") == 0 ||
+      strcasecmp(value, "true") == 0 ||
+      strcasecmp(value, "on") == 0 ||
+      strcmp(value, "1") == 0)
+    return 1;
+  if (strcasecmp(value, "no") == 0 ||
+      strcasecmp(value, "false") == 0 ||
+      strcasecmp(value, "off") == 0 ||
+      strcmp(value, "0") == 0)
+    return 0;
+  return -1;
+}
+
+static struct entry * section_find(
+    struct config *c,
+    const char *name)
+{
+  struct entry *e;
+
+  if (!c->nbuckets)
+    return NULL;
+  e = c->sections[link_hash_name(name) & (c->nbuckets - 1)];
+  for (; e != NULL; e=e->hnext) {
+    if (strcmp(e->name, name) == 0)
+      return e;
+  }
+  return NULL;
+}
+
+static void section_link(
+    struct config *c,
+    struct entry *e)
+{
+  struct entry **sections, *s, *next;
+  size_t i, b, nbuckets;
+
+  nbuckets = c->nbuckets ? c->nbuckets : SECTION_BUCKETS;
+  while (nbuckets < (size_t)c->entries)
+    nbuckets *= 2;
+  if (nbuckets != c->nbuckets) {
+    sections = calloc(nbuckets, sizeof(*sections));
+    assert(sections);
+    for (i=0; i < c->nbuckets; i++) {
+      for (s=c->sections[i]; s != NULL; s=next) {
+        next = s->hnext;
+        b = link_hash_name(s->name) & (nbuckets - 1);
+        s->hnext = sections[b];
+        sections[b] = s;
       }
-      fflush(stdout);
+    }
+    free(c->sections);
+    c->sections = sections;
+    c->nbuckets = nbuckets;
+  }
+
+  b = link_hash_name(e->name) & (c->nbuckets - 1);
+  e->hnext = c->sections[b];
+  c->sections[b] = e;
+}
+
+static void section_unlink(
+    struct config *c,
+    struct entry *e)
+{
+  struct entry **pp;
+
+  if (!c->nbuckets)
+    return;
+  pp = &c->sections[link_hash_name(e->name) & (c->nbuckets - 1)];
+  for (; *pp != NULL; pp=&(*pp)->hnext) {
+    if (*pp == e) {
+      *pp = e->hnext;
+      return;
+    }
+  }
+}
+
+static int config_parse_global(
+    struct config *c,
+    const char *name,
+    const char *value)
+{
+  if (strcmp(name, "shared") == 0) {
+    c->shared = parse_bool(value);
+    if (c->shared < 0) {
+      warnx("Config parse failure. Value %s in %s should be yes or no",
+            value, name);
+      return 0;
+    }
+  }
+  else if (strcmp(name, "batch") == 0) {
+    c->batch = parse_bool(value);
+    if (c->batch < 0) {
+      warnx("Config parse failure. Value %s in %s should be yes or no",
+            value, name);
+      return 0;
+    }
+  }
+  else if (strcmp(name, "timestamps") == 0) {
+    if (strcmp(value, "loop") == 0)
+      c->timestamps = 0;
+    else if (strcmp(value, "software") == 0)
+      c->timestamps = ICMP_SOCKET_TIMESTAMP;
+    else if (strcmp(value, "hardware") == 0)
+      c->timestamps = ICMP_SOCKET_TIMESTAMP|ICMP_SOCKET_HWTIMESTAMP;
+    else {
+      warnx("Config parse failure. Value %s in %s should be loop, software"
+            " or hardware", value, name);
+      return 0;
+    }
+  }
+  else if (strcmp(name, "scheduler") == 0) {
+    if (strcmp(value, "wheel") == 0)
+      c->wheel = 1;
+    else if (strcmp(value, "heap") == 0)
+      c->wheel = 0;
+    else {
+      warnx("Config parse failure. Value %s in %s should be heap or wheel",
+            value, name);
+      return 0;
+    }
+  }
+  else if (strcmp(name, "tick") == 0) {
+    c->tick = atof(value);
+    if (c->tick < 0.001 || c->tick > 1.0) {
+      warnx("Config parse failure. Value %s in %s should be between"
+            " 0.001 and 1", value, name);
+      return 0;
+    }
+  }
+  else if (strcmp(name, "slack") == 0) {
+    c->slack = atof(value);
+    if (c->slack < 0.0 || c->slack > 60.0) {
+      warnx("Config parse failure. Value %s in %s should be between"
+            " 0 and 60", value, name);
+      return 0;
+    }
+  }
+  else if (strcmp(name, "link_filter") == 0) {
+    c->link_filter = parse_bool(value);
+    if (c->link_filter < 0) {
+      warnx("Config parse failure. Value %s in %s should be yes or no",
+            value, name);
+      return 0;
+    }
+  }
+  else if (strcmp(name, "threads") == 0) {
+    c->threads = atoi(value);
+    if (c->threads < 0 || c->threads > SHARD_MAX) {
+      warnx("Config parse failure. Value %s in %s should be between"
+            " 0 and %d", value, name, SHARD_MAX);
+      return 0;
+    }
+  }
+  else if (strcmp(name, "netlink_rcvbuf") == 0) {
+    c->rcvbuf = atoi(value);
+    if (c->rcvbuf < 0 || c->rcvbuf > 256 * 1024 * 1024) {
+      warnx("Config parse failure. Value %s in %s should be between"
+            " 0 and 268435456", value, name);
+      return 0;
+    }
+  }
+  else if (strcmp(name, "metrics_socket") == 0) {
+    free(c->metrics_socket);
+    c->metrics_socket = strdup(value);
+    assert(c->metrics_socket);
+  }
+  else if (strcmp(name, "metrics_port") == 0) {
+    c->metrics_port = atoi(value);
+    if (c->metrics_port < 0 || c->metrics_port > 65535) {
+      warnx("Config parse failure. Value %s in %s should be between"
+            " 0 and 65535", value, name);
+      return 0;
+    }
+  }
+  else if (strcmp(name, "resolver_threads") == 0) {
+    c->resolver_threads = atoi(value);
+    if (c->resolver_threads < 1 ||
+        c->resolver_threads > RESOLVER_THREADS_MAX) {
+      warnx("Config parse failure. Value %s in %s should be between"
+            " 1 and %d", value, name, RESOLVER_THREADS_MAX);
+      return 0;
+    }
+  }
+  else if (strcmp(name, "resolve_ttl") == 0) {
+    c->resolve_ttl = atof(value);
+    if (c->resolve_ttl != 0.0 &&
+        (c->resolve_ttl < 1.0 || c->resolve_ttl > 86400.0)) {
+      warnx("Config parse failure. Value %s in %s should be 0 or between"
+            " 1 and 86400", value, name);
+      return 0;
     }
   }
-}
-
-
-static int cloexec_file(
-    FILE *f)
-{
-  int fd = fileno(f);
-  int flags = 0;
+  else if (strcmp(name, "include") == 0) {
+    c->includes = realloc(c->includes,
+                          sizeof(*c->includes) * (c->nincludes + 1));
+    assert(c->includes);
+    c->includes[c->nincludes] = strdup(value);
+    assert(c->includes[c->nincludes]);
+    c->nincludes++;
+  }
+  else if (strcmp(name, "stats_file") == 0) {
+    free(c->stats_file);
+    c->stats_file = strdup(value);
+    assert(c->stats_file);
+  }
+  else {
+    warnx("Config parse failure. Unknown global option: %s", name);
+    return 0;
+  }
 
-  flags = fcntl(fd, F_GETFD);
-  flags |= FD_CLOEXEC;
-  if (fcntl(fd, F_SETFD, flags) < 0)
-    return -1;
-  return 0;
+  return 1;
 }
 
 static int config_parse(
@@ -132,29 +1128,53 @@ static int config_parse(
     const char *name,
     const char *value)
 {
+  struct config *c = data;
   struct entry *e;
-  for (e=config.tuns; e != NULL; e = e->next) {
-    if (strncmp(e->name, section, 64) == 0) {
-      break;
-    }
-  }
+
+  if (section[0] == 0)
+    return config_parse_global(c, name, value);
+
+  e = section_find(c, section);
   if (!e) {
     e = malloc(sizeof(*e));
+    assert(e);
     e->name = strdup(section);
+    assert(e->name);
     e->device = NULL; 
     e->ping = NULL;
     e->interval = 0.0;
     e->timeout = 0.0;
-    e->next = config.tuns;
-    e->samples = 0;
-    e->average = 0;
-    e->failures = 0;
-    e->last_sent = 0;
-    config.tuns = e;
-    config.entries++;
+    e->outstanding = 0;
+    e->family = -1;
+    e->idle_only = -1;
+    e->backoff_after = 0;
+    e->backoff_max = 0.0;
+    e->slack = -1.0;
+    e->netns = NULL;
+    e->ns = NULL;
+    e->shard = NULL;
+    e->previous = NULL;
+    e->replaced = 0;
+    e->nsfd = -1;
+    e->slot = -1;
+    e->resolved = 0;
+    e->icmp.ic = NULL;
+    e->next = c->tuns;
+    results_init(&e->results);
+    e->probes = 0;
+    e->suppressed = 0;
+    e->last_traffic = 0;
+    /* No baseline until the first dump */
+    e->rx = UINT64_MAX;
+    e->tx = UINT64_MAX;
+    e->probes_seen = 0;
+    e->probes_dumped = 0;
+    c->tuns = e;
+    c->entries++;
+    section_link(c, e);
   }
 
-  if (strncmp(name, "dev", 3) == 0) {
+  if (strcmp(name, "dev") == 0) {
     if (e->device) {
       warnx("Config parse failure. Duplicate entry: %s / %s", section, name);
       return 0;
@@ -162,7 +1182,7 @@ static int config_parse(
     e->device = strdup(value);
     assert(e->device);
   }
-  else if (strncmp(name, "address", 7) == 0) {
+  else if (strcmp(name, "address") == 0) {
     if (e->ping) {
       warnx("Config parse failure. Duplicate entry: %s / %s", section, name);
       return 0;
@@ -170,7 +1190,7 @@ static int config_parse(
     e->ping = strdup(value);
     assert(e->ping);
   }
-  else if (strncmp(name, "timeout", 7) == 0) {
+  else if (strcmp(name, "timeout") == 0) {
     if (e->timeout != 0.0) {
       warnx("Config parse failure. Duplicate entry: %s / %s", section, name);
       return 0;
@@ -182,7 +1202,7 @@ static int config_parse(
       return 0;
     }
   }
-  else if (strncmp(name, "interval", 8) == 0) {
+  else if (strcmp(name, "interval") == 0) {
     if (e->interval != 0.0) {
       warnx("Config parse failure. Duplicate entry: %s / %s", section, name);
       return 0;
@@ -194,6 +1214,93 @@ static int config_parse(
       return 0;
     }
   }
+  else if (strcmp(name, "outstanding") == 0) {
+    if (e->outstanding != 0) {
+      warnx("Config parse failure. Duplicate entry: %s / %s", section, name);
+      return 0;
+    }
+    e->outstanding = atoi(value);
+    if (e->outstanding < 1 || e->outstanding > ICMP_OUTSTANDING_MAX) {
+      warnx("Config parse failure. Value %s in %s / %s should be between"
+            " 1 and %d", value, section, name, ICMP_OUTSTANDING_MAX);
+      return 0;
+    }
+  }
+  else if (strcmp(name, "netns") == 0) {
+    if (e->netns) {
+      warnx("Config parse failure. Duplicate entry: %s / %s", section, name);
+      return 0;
+    }
+    e->netns = strdup(value);
+    assert(e->netns);
+  }
+  else if (strcmp(name, "backoff_after") == 0) {
+    if (e->backoff_after != 0) {
+      warnx("Config parse failure. Duplicate entry: %s / %s", section, name);
+      return 0;
+    }
+    e->backoff_after = atoi(value);
+    if (e->backoff_after < 1 || e->backoff_after > 1000) {
+      warnx("Config parse failure. Value %s in %s / %s should be between"
+            " 1 and 1000", value, section, name);
+      return 0;
+    }
+  }
+  else if (strcmp(name, "backoff_max") == 0) {
+    if (e->backoff_max != 0.0) {
+      warnx("Config parse failure. Duplicate entry: %s / %s", section, name);
+      return 0;
+    }
+    e->backoff_max = atof(value);
+    if (e->backoff_max < 1.0 || e->backoff_max > 86400.0) {
+      warnx("Config parse failure. Value %s in %s / %s should be between"
+            " 1 and 86400", value, section, name);
+      return 0;
+    }
+  }
+  else if (strcmp(name, "slack") == 0) {
+    if (e->slack >= 0.0) {
+      warnx("Config parse failure. Duplicate entry: %s / %s", section, name);
+      return 0;
+    }
+    e->slack = atof(value);
+    if (e->slack < 0.0 || e->slack > 60.0) {
+      warnx("Config parse failure. Value %s in %s / %s should be between"
+            " 0 and 60", value, section, name);
+      return 0;
+    }
+  }
+  else if (strcmp(name, "family") == 0) {
+    if (e->family != -1) {
+      warnx("Config parse failure. Duplicate entry: %s / %s", section, name);
+      return 0;
+    }
+    if (strcmp(value, "any") == 0)
+      e->family = AF_UNSPEC;
+    else if (strcmp(value, "ipv4") == 0)
+      e->family = AF_INET;
+    else if (strcmp(value, "ipv6") == 0)
+      e->family = AF_INET6;
+    else if (strcmp(value, "both") == 0)
+      e->family = FAMILY_BOTH;
+    else {
+      warnx("Config parse failure. Value %s in %s / %s should be any, ipv4,"
+            " ipv6 or both", value, section, name);
+      return 0;
+    }
+  }
+  else if (strcmp(name, "idle_only") == 0) {
+    if (e->idle_only != -1) {
+      warnx("Config parse failure. Duplicate entry: %s / %s", section, name);
+      return 0;
+    }
+    e->idle_only = parse_bool(value);
+    if (e->idle_only < 0) {
+      warnx("Config parse failure. Value %s in %s / %s should be yes or no",
+            value, section, name);
+      return 0;
+    }
+  }
   else {
     warnx("Config parse failure. Unknown option: %s / %s", section, name);
     return 0;
@@ -202,41 +1309,69 @@ static int config_parse(
   return 1;
 }
 
-int main(
-    int argc,
-    char **argv) 
+static void config_defaults(
+    struct config *c)
 {
-  struct ev_loop *loop = EV_DEFAULT;
-  ev_signal sig, sig2;
-  ev_link link;
-  int fail = 0;
-  char *fname = NULL;
-  FILE *inifile = NULL;
-  struct entry *e = NULL;
+  c->entries = 0;
+  c->tuns = NULL;
+  c->shared = 0;
+  c->batch = 0;
+  c->timestamps = 0;
+  c->wheel = 0;
+  c->tick = 0.01;
+  c->slack = 0.0;
+  c->rcvbuf = 0;
+  c->link_filter = 1;
+  c->threads = 0;
+  c->metrics_socket = NULL;
+  c->metrics_port = 0;
+  c->stats_file = NULL;
+  c->resolver_threads = 4;
+  c->resolve_ttl = 300.0;
+  c->sections = NULL;
+  c->nbuckets = 0;
+  c->includes = NULL;
+  c->nincludes = 0;
+}
 
-  config.entries = 0;
-  config.tuns = NULL;
-  config.argc = argc;
-  config.argv = argv;
+/* The section keeps probing IPv4 as "name/ipv4" and a copy placed
+ * after it probes IPv6 as "name/ipv6", each with its own statistics */
+static void entry_split(
+    struct config *c,
+    struct entry *e)
+{
+  struct entry *v6;
+  char *name;
 
-  if (argc > 1) 
-    fname = argv[1];
-  else
-    fname = CONFIGFILE;
-  inifile = fopen(fname, "r");
-  if (!inifile)
-    err(EXIT_FAILURE, "Cannot open config file: %s", fname);
-  if (cloexec_file(inifile) < 0)
-    err(EXIT_FAILURE, "Cannot reset flags on file");
+  v6 = malloc(sizeof(*v6));
+  assert(v6);
+  memcpy(v6, e, sizeof(*v6));
+  v6->device = strdup(e->device);
+  v6->ping = strdup(e->ping);
+  v6->netns = e->netns ? strdup(e->netns) : NULL;
+  assert(v6->device && v6->ping && (!e->netns || v6->netns));
+  if (asprintf(&v6->name, "%s/ipv6", e->name) < 0 ||
+      asprintf(&name, "%s/ipv4", e->name) < 0)
+    abort();
+  section_unlink(c, e);
+  free(e->name);
+  e->name = name;
+  e->family = AF_INET;
+  v6->family = AF_INET6;
 
-  if (ini_parse_file(inifile, config_parse, &config) != 0)
-    errx(EXIT_FAILURE, "Cannot parse config file %s", fname);
-  fclose(inifile);
+  e->next = v6;
+  c->entries++;
+  section_link(c, e);
+  section_link(c, v6);
+}
 
-  if (!ev_link_init(&link, link_change))
-    err(EXIT_FAILURE, "Cannot initialize link watcher");
+static int config_check(
+    struct config *c)
+{
+  struct entry *e;
+  int fail = 0;
 
-  for (e=config.tuns; e != NULL; e=e->next) {
+  for (e=c->tuns; e != NULL; e=e->next) {
     assert(e->name);
     if (!e->device) {
       warnx("Config parse failure. Option \"dev\" must be set in section"
@@ -258,24 +1393,540 @@ int main(
             " \"%s\"", e->name);
       fail = 1;
     }
+    if (e->slack < 0.0)
+      e->slack = c->slack;
+    if (e->idle_only == -1)
+      e->idle_only = 0;
+    if (e->family == -1)
+      e->family = AF_UNSPEC;
+    else if (e->family == FAMILY_BOTH && e->device && e->ping) {
+      entry_split(c, e);
+      e = e->next;
+    }
+  }
+  return fail ? -1 : 0;
+}
+
+static int config_read(
+    const char *fname,
+    ini_handler handler,
+    void *data)
+{
+  FILE *inifile = NULL;
+  int rc;
+
+  inifile = fopen(fname, "r");
+  if (!inifile) {
+    warn("Cannot open config file: %s", fname);
+    return -1;
+  }
+  if (cloexec_file(inifile) < 0) {
+    warn("Cannot reset flags on file");
+    fclose(inifile);
+    return -1;
+  }
+
+  rc = ini_parse_file(inifile, handler, data);
+  fclose(inifile);
+  if (rc != 0) {
+    warnx("Cannot parse config file %s", fname);
+    return -1;
+  }
+  return 0;
+}
+
+/* An included file, parsed into a configuration of its own */
+struct config_file {
+  char *path;
+  struct config c;
+  int rc;
+};
+
+struct config_files {
+  struct config_file *files;
+  int nfiles;
+  int next;
+};
+
+/* Included files hold sections only */
+static int config_parse_include(
+    void *data,
+    const char *section,
+    const char *name,
+    const char *value)
+{
+  struct config_file *f = data;
+
+  if (section[0] == 0) {
+    warnx("Config parse failure. Option %s in %s must be in a section",
+          name, f->path);
+    return 0;
+  }
+  return config_parse(&f->c, section, name, value);
+}
+
+static void * config_read_files(
+    void *data)
+{
+  struct config_files *fs = data;
+  struct config_file *f;
+  int i;
+
+  while ((i = __atomic_fetch_add(&fs->next, 1, __ATOMIC_RELAXED)) <
+         fs->nfiles) {
+    f = &fs->files[i];
+    config_defaults(&f->c);
+    f->rc = config_read(f->path, config_parse_include, f);
+  }
+  return NULL;
+}
+
+static int include_filter(
+    const struct dirent *d)
+{
+  size_t len = strlen(d->d_name);
+
+  return d->d_name[0] != '.' && len > 5 &&
+         strcmp(d->d_name + len - 5, ".conf") == 0;
+}
+
+/* Adds the file, or every *.conf file in the directory in name order */
+static int include_expand(
+    struct config_files *fs,
+    const char *path)
+{
+  struct dirent **names = NULL;
+  struct stat st;
+  char *file;
+  int i, n = 1;
+
+  if (stat(path, &st) < 0) {
+    warn("Cannot include %s", path);
+    return -1;
+  }
+  if (S_ISDIR(st.st_mode)) {
+    n = scandir(path, &names, include_filter, alphasort);
+    if (n < 0) {
+      warn("Cannot include %s", path);
+      return -1;
+    }
+  }
+
+  fs->files = realloc(fs->files, sizeof(*fs->files) * (fs->nfiles + n));
+  assert(fs->files || fs->nfiles + n == 0);
+  for (i=0; i < n; i++) {
+    if (!names)
+      file = strdup(path);
+    else if (asprintf(&file, "%s/%s", path, names[i]->d_name) < 0)
+      file = NULL;
+    assert(file);
+    fs->files[fs->nfiles++].path = file;
+    if (names)
+      free(names[i]);
+  }
+  free(names);
+  return 0;
+}
+
+/* Included files are parsed in parallel, each into its own section
+ * table, then merged in include order. A section may only be defined
+ * in one file. Relative paths start from the main file's directory. */
+static int config_include(
+    struct config *c,
+    const char *fname)
+{
+  struct config_files fs = { NULL, 0, 0 };
+  struct config_file *f;
+  struct entry *e, *tail;
+  pthread_t threads[CONFIG_THREADS_MAX];
+  sigset_t all, old;
+  const char *slash = strrchr(fname, '/');
+  char *path;
+  int i, nthreads, fail = 0;
+
+  for (i=0; i < c->nincludes; i++) {
+    if (c->includes[i][0] == '/' || !slash)
+      path = strdup(c->includes[i]);
+    else if (asprintf(&path, "%.*s/%s", (int)(slash - fname), fname,
+                      c->includes[i]) < 0)
+      path = NULL;
+    assert(path);
+    if (include_expand(&fs, path) < 0)
+      fail = 1;
+    free(path);
+  }
+
+  nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads > CONFIG_THREADS_MAX)
+    nthreads = CONFIG_THREADS_MAX;
+  if (nthreads > fs.nfiles)
+    nthreads = fs.nfiles;
+
+  /* The calling thread parses too; signals belong to the main loop */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  for (i=1; i < nthreads; i++) {
+    if (pthread_create(&threads[i], NULL, config_read_files, &fs) != 0)
+      break;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  nthreads = i;
+  config_read_files(&fs);
+  for (i=1; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+
+  /* Sections from files that failed are handed over too, so the caller
+   * frees them with the rest */
+  for (i=0; i < fs.nfiles; i++) {
+    f = &fs.files[i];
+    if (f->rc < 0)
+      fail = 1;
+    for (e=f->c.tuns, tail=NULL; e != NULL; tail=e, e=e->next) {
+      c->entries++;
+      if (section_find(c, e->name)) {
+        warnx("Config parse failure. Section \"%s\" in %s is already"
+              " defined", e->name, f->path);
+        fail = 1;
+        continue;
+      }
+      section_link(c, e);
+    }
+    if (tail) {
+      tail->next = c->tuns;
+      c->tuns = f->c.tuns;
+    }
+    free(f->c.sections);
+    free(f->path);
+  }
+  free(fs.files);
+  return fail ? -1 : 0;
+}
+
+static int config_load(
+    struct config *c,
+    const char *fname)
+{
+  int i, rc;
+
+  rc = config_read(fname, config_parse, c);
+  if (rc == 0 && c->nincludes)
+    rc = config_include(c, fname);
+
+  for (i=0; i < c->nincludes; i++)
+    free(c->includes[i]);
+  free(c->includes);
+  c->includes = NULL;
+  c->nincludes = 0;
+
+  if (rc < 0)
+    return -1;
+  return config_check(c);
+}
+
+static void entry_free(
+    struct entry *e)
+{
+  free(e->name);
+  free(e->device);
+  free(e->ping);
+  free(e->netns);
+  free(e);
+}
+
+static void entry_release(
+    struct ev_loop *loop,
+    void *data,
+    int unused)
+{
+  struct entry *e = data;
+
+  stats_free(&stats, e->slot);
+  entry_free(e);
+}
+
+static int entry_same(
+    struct entry *a,
+    struct entry *b)
+{
+  return strcmp(a->device, b->device) == 0 &&
+         strcmp(a->ping, b->ping) == 0 && a->family == b->family &&
+         ((!a->netns && !b->netns) ||
+          (a->netns && b->netns && strcmp(a->netns, b->netns) == 0));
+}
+
+/* Called on the main thread once the entry is off config.tuns. The
+ * owning shard tears it down and frees it after anything still queued
+ * for it. */
+static void entry_remove(
+    struct ev_loop *loop,
+    struct entry *e)
+{
+  resolver_unwatch(&resolver, e->ping, e->family, e);
+  if (e->ns->attached)
+    ev_link_remove_device(&e->ns->link, e->device, e);
+  shard_call(e->shard, entry_detach, e, 0);
+  if (!e->replaced)
+    shard_call(e->shard, entry_release, e, 0);
+}
+
+/* Runs on the shard both entries share, after the previous one was
+ * detached, so its results are no longer being written */
+static void entry_inherit(
+    struct ev_loop *loop,
+    void *data,
+    int unused)
+{
+  struct entry *e = data, *o = e->previous;
+
+  e->results = o->results;
+  __atomic_store_n(&e->suppressed, o->suppressed, __ATOMIC_RELAXED);
+  e->previous = NULL;
+  entry_release(loop, o, 0);
+  entry_publish(e);
+}
+
+/* The entry is attached once its address is known */
+static void entry_add(
+    struct ev_loop *loop,
+    struct entry *e)
+{
+  e->ns = netns_get(e->netns);
+  if (!e->shard)
+    e->shard = &config.shards[config.next_shard++ % config.nshards];
+  entry_publish_new(e);
+  /* Queued before anything that could attach the entry */
+  if (e->previous)
+    shard_call(e->shard, entry_inherit, e, 0);
+  if (e->ns->attached)
+    ev_link_add_device(&e->ns->link, e->device, e);
+  resolver_watch(&resolver, e->ping, e->family, entry_resolved, e);
+}
+
+/* Re-read the file and apply only what changed, by section name.
+ * Sections that are unchanged keep their sockets, timers and
+ * statistics; changed ones are replaced, carrying their statistics over
+ * when they still probe the same address over the same device. */
+static void reload_cb(
+    struct ev_loop *loop,
+    ev_signal *w,
+    int revents)
+{
+  struct config next;
+  struct entry *e, *o, **pp;
+  struct netns *ns;
+  int added = 0, removed = 0, changed = 0;
+
+  printf("Reloading configuration..\n");
+  fflush(stdout);
+
+  config_defaults(&next);
+  if (config_load(&next, config.fname) < 0 || next.entries == 0) {
+    warnx("Keeping the running configuration");
+    goto out;
+  }
+
+  if (next.shared != config.shared || next.batch != config.batch ||
+      next.timestamps != config.timestamps || next.wheel != config.wheel ||
+      next.tick != config.tick || next.rcvbuf != config.rcvbuf ||
+      next.link_filter != config.link_filter ||
+      next.threads != config.threads ||
+      next.metrics_port != config.metrics_port ||
+      !next.metrics_socket != !config.metrics_socket ||
+      (next.metrics_socket &&
+       strcmp(next.metrics_socket, config.metrics_socket) != 0) ||
+      next.resolver_threads != config.resolver_threads ||
+      next.resolve_ttl != config.resolve_ttl ||
+      !next.stats_file != !config.stats_file ||
+      (next.stats_file && strcmp(next.stats_file, config.stats_file) != 0)) {
+    restart(loop);
+    goto out;
+  }
+
+  /* Scrapes walking the sections cannot survive them being freed */
+  metrics_reset(loop, &metrics);
+
+  for (pp=&config.tuns; *pp != NULL;) {
+    o = *pp;
+    e = section_find(&next, o->name);
+    if (e && entry_same(o, e) && e->interval == o->interval &&
+        e->timeout == o->timeout && e->outstanding == o->outstanding &&
+        e->idle_only == o->idle_only &&
+        e->backoff_after == o->backoff_after &&
+        e->backoff_max == o->backoff_max && e->slack == o->slack) {
+      pp = &o->next;
+      continue;
+    }
+
+    /* The replacement stays on the old shard, which hands the results
+     * over once the old entry is detached */
+    if (e && entry_same(o, e)) {
+      e->previous = o;
+      e->shard = o->shard;
+      o->replaced = 1;
+      changed++;
+    }
+    else if (!e)
+      removed++;
+
+    *pp = o->next;
+    config.entries--;
+    section_unlink(&config, o);
+    entry_remove(loop, o);
+  }
+
+  while ((e = next.tuns) != NULL) {
+    next.tuns = e->next;
+    if (section_find(&config, e->name)) {
+      entry_free(e);
+      continue;
+    }
+    added++;
+    e->next = config.tuns;
+    config.tuns = e;
+    config.entries++;
+    section_link(&config, e);
+    entry_add(loop, e);
+  }
+
+  /* Namespaces nothing refers to any more are let go */
+  for (ns=config.namespaces->next; ns != NULL; ns=ns->next) {
+    if (!netns_used(ns)) {
+      ns->retry = 0;
+      if (ns->attached)
+        netns_detach(loop, ns);
+    }
+  }
+  netns_attach_all(loop);
+  idle_schedule(loop);
+
+  printf("%d sections added, %d removed, %d changed, %d total\n",
+         added - changed, removed, changed, config.entries);
+
+out:
+  while ((e = next.tuns) != NULL) {
+    next.tuns = e->next;
+    entry_free(e);
+  }
+  free(next.sections);
+  free(next.metrics_socket);
+  free(next.stats_file);
+  fflush(stdout);
+}
+
+int main(
+    int argc,
+    char **argv) 
+{
+  struct ev_loop *loop = EV_DEFAULT;
+  ev_signal sig, sig2;
+  struct entry *e = NULL;
+  struct netns *ns = NULL;
+  struct timespec start, end;
+  int cpus[SHARD_MAX];
+  int ncpus, i, opt, test = 0;
+
+  config_defaults(&config);
+  config.argc = argc;
+  config.argv = argv;
+  config.flags = 0;
+  config.namespaces = NULL;
 
-   e->icmp.data = e;
-    if (!ev_icmp_init(&e->icmp, update_stats, e->ping, e->interval, e->timeout))
-      err(EXIT_FAILURE, "Cannot ping address");
-    ev_link_add_device(&link, e->device);
+  while ((opt = getopt(argc, argv, "t")) != -1) {
+    if (opt != 't') {
+      fprintf(stderr, "Usage: %s [-t] [config file]\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+    test = 1;
   }
 
-  if (fail)
+  if (optind < argc) 
+    config.fname = argv[optind];
+  else
+    config.fname = CONFIGFILE;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (config_load(&config, config.fname) < 0)
     exit(EXIT_FAILURE);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  /* -t only checks the configuration, and times loading it */
+  if (test) {
+    printf("%d sections loaded from %s in %.3fms\n", config.entries,
+           config.fname, (end.tv_sec - start.tv_sec) * 1e3 +
+           (end.tv_nsec - start.tv_nsec) / 1e6);
+    exit(0);
+  }
+
+  if (config.shared)
+    config.flags |= ICMP_SOCKET_SHARED;
+  if (config.batch)
+    config.flags |= ICMP_SOCKET_SHARED|ICMP_SOCKET_BATCH;
+  config.flags |= config.timestamps;
+
+  /* Without threads a single shard runs on the main loop */
+  config.nshards = config.threads ? config.threads : 1;
+  config.shards = calloc(config.nshards, sizeof(*config.shards));
+  assert(config.shards);
+  ncpus = shard_cpus(cpus, SHARD_MAX);
+  for (i=0; i < config.nshards; i++) {
+    shard_init(&config.shards[i], i, config.threads ? NULL : loop);
+    if (shard_start(&config.shards[i], ncpus > 0 ? cpus[i % ncpus] : -1,
+                    shard_setup) < 0)
+      err(EXIT_FAILURE, "Cannot start shard %d", i);
+  }
+
+  ns = netns_get(NULL);
+  if (!ev_link_init(&ns->link, link_change, config.rcvbuf,
+                    config.link_filter, -1))
+    err(EXIT_FAILURE, "Cannot initialize link watcher");
+
+  /* Room for the sections reloads may add */
+  if (config.stats_file &&
+      stats_create(&stats, config.stats_file,
+                   config.entries * 2 > 1024 ? config.entries * 2 : 1024) < 0)
+    err(EXIT_FAILURE, "Cannot create %s", config.stats_file);
+
+  if (resolver_init(&resolver, loop, config.resolver_threads,
+                    config.resolve_ttl) < 0)
+    err(EXIT_FAILURE, "Cannot start resolver");
+
+  /* Every name is looked up at once; sections are attached as their
+   * answers come in */
+  for (e=config.tuns; e != NULL; e=e->next) {
+    e->ns = netns_get(e->netns);
+    e->shard = &config.shards[config.next_shard++ % config.nshards];
+    entry_publish_new(e);
+    resolver_watch(&resolver, e->ping, e->family, entry_resolved, e);
+  }
+
   if (config.entries == 0)
     err(EXIT_FAILURE, "No devices set to watch. Exiting.");
 
+  if (netns_attach(loop, config.namespaces) < 0)
+    err(EXIT_FAILURE, "Cannot ping address");
+
+  ev_timer_init(&config.nsretry, netns_retry_cb, 0.0, 1.0);
+  netns_attach_all(loop);
+  ev_timer_init(&config.idle, idle_check_cb, 0.0, 0.0);
+  idle_schedule(loop);
+
+  metrics_init(&metrics, &(struct metrics_source){
+    metric_families, sizeof(metric_families) / sizeof(metric_families[0]),
+    metrics_first, metrics_next, metrics_render, NULL });
+  if (config.metrics_socket &&
+      metrics_listen_unix(&metrics, config.metrics_socket) < 0)
+    err(EXIT_FAILURE, "Cannot listen on %s", config.metrics_socket);
+  if (config.metrics_port &&
+      metrics_listen_tcp(&metrics, config.metrics_port) < 0)
+    err(EXIT_FAILURE, "Cannot listen on port %d", config.metrics_port);
+  metrics_start(loop, &metrics);
+
   ev_signal_init(&sig2, print_stats, SIGUSR1);
   ev_signal_init(&sig, reload_cb, SIGHUP);
   ev_signal_start(loop, &sig);
   ev_signal_start(loop, &sig2);
 
-  ev_link_start(loop, &link);
+  config.started = ev_now(loop);
+  ev_link_start(loop, &config.namespaces->link);
 
   ev_run(loop, 0);
 
@@ -0,0 +1,332 @@
+#include "common.h"
+
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "metrics.h"
+
+/* Room kept free for one item's samples before rendering it */
+#define METRICS_MARGIN (16 * 1024)
+
+static const char metrics_header[] =
+  "HTTP/1.0 200 OK\r\n"
+  "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+  "Connection: close\r\n"
+  "\r\n";
+
+void metrics_printf(
+    struct metrics_buf *b,
+    const char *fmt,
+    ...)
+{
+  va_list ap;
+  int n;
+
+  va_start(ap, fmt);
+  n = vsnprintf(b->data + b->len, b->size - b->len, fmt, ap);
+  va_end(ap);
+
+  /* A line that does not fit is dropped whole rather than cut */
+  if (n > 0 && (size_t)n < b->size - b->len)
+    b->len += n;
+}
+
+/* Label values are escaped as the exposition format requires */
+void metrics_label(
+    struct metrics_buf *b,
+    const char *name,
+    const char *value,
+    int first)
+{
+  const char *p;
+  size_t room;
+
+  metrics_printf(b, "%s%s=\"", first ? "" : ",", name);
+  for (p=value; *p; p++) {
+    room = b->size - b->len;
+    if (room < 3)
+      return;
+    if (*p == '\\' || *p == '"') {
+      b->data[b->len++] = '\\';
+      b->data[b->len++] = *p;
+    }
+    else if (*p == '\n') {
+      b->data[b->len++] = '\\';
+      b->data[b->len++] = 'n';
+    }
+    else
+      b->data[b->len++] = *p;
+  }
+  metrics_printf(b, "\"");
+}
+
+static void client_close(
+    struct ev_loop *loop,
+    struct metrics_client *c)
+{
+  ev_io_stop(loop, &c->io);
+  close(c->fd);
+  c->fd = -1;
+}
+
+/* Render until the buffer is nearly full or the scrape is complete */
+static void client_fill(
+    struct metrics_client *c)
+{
+  struct metrics_source *src = &c->m->src;
+  const struct metrics_family *f;
+
+  while (!c->done && c->buf.len + METRICS_MARGIN < c->buf.size) {
+    if (c->family == src->nfamilies) {
+      metrics_printf(&c->buf, "# EOF\n");
+      c->done = 1;
+      break;
+    }
+
+    f = &src->families[c->family];
+    if (!c->started) {
+      metrics_printf(&c->buf, "# TYPE %s %s\n# HELP %s %s\n",
+                     f->name, f->type, f->name, f->help);
+      c->item = src->first(src->data);
+      c->started = 1;
+    }
+
+    if (!c->item) {
+      c->family++;
+      c->started = 0;
+      continue;
+    }
+
+    src->render(src->data, c->item, c->family, &c->buf);
+    c->item = src->next(src->data, c->item);
+  }
+}
+
+static void client_write(
+    struct ev_loop *loop,
+    struct metrics_client *c)
+{
+  ssize_t n;
+
+  for (;;) {
+    if (c->off == c->buf.len) {
+      if (c->done) {
+        client_close(loop, c);
+        return;
+      }
+      c->off = c->buf.len = 0;
+      client_fill(c);
+    }
+
+    n = send(c->fd, c->buf.data + c->off, c->buf.len - c->off, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        client_close(loop, c);
+      return;
+    }
+    c->off += n;
+  }
+}
+
+static void client_cb(
+    struct ev_loop *loop,
+    ev_io *w,
+    int revents)
+{
+  struct metrics_client *c = w->data;
+  ssize_t n;
+
+  if (c->writing) {
+    client_write(loop, c);
+    return;
+  }
+
+  /* Any request gets the metrics; only its end is looked for */
+  n = recv(c->fd, c->req + c->reqlen, sizeof(c->req) - 1 - c->reqlen, 0);
+  if (n < 0 && (errno == EAGAIN || errno == EINTR))
+    return;
+  if (n <= 0) {
+    client_close(loop, c);
+    return;
+  }
+  c->reqlen += n;
+  c->req[c->reqlen] = 0;
+  if (!strstr(c->req, "\r\n\r\n") && !strstr(c->req, "\n\n") &&
+      c->reqlen < sizeof(c->req) - 1)
+    return;
+
+  c->m->scrapes++;
+  c->writing = 1;
+  c->buf.len = 0;
+  metrics_printf(&c->buf, "%s", metrics_header);
+  ev_io_stop(loop, &c->io);
+  ev_io_set(&c->io, c->fd, EV_WRITE);
+  ev_io_start(loop, &c->io);
+  client_write(loop, c);
+}
+
+static void accept_cb(
+    struct ev_loop *loop,
+    ev_io *w,
+    int revents)
+{
+  struct metrics *m = w->data;
+  struct metrics_client *c = NULL;
+  int fd, i;
+
+  fd = accept4(w->fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+  if (fd < 0)
+    return;
+
+  for (i=0; i < METRICS_CLIENTS; i++) {
+    if (m->clients[i].fd < 0) {
+      c = &m->clients[i];
+      break;
+    }
+  }
+  if (!c) {
+    close(fd);
+    return;
+  }
+
+  /* Buffers are kept from one scrape to the next */
+  if (!c->buf.data) {
+    c->buf.data = malloc(METRICS_BUFSZ);
+    if (!c->buf.data) {
+      close(fd);
+      return;
+    }
+    c->buf.size = METRICS_BUFSZ;
+  }
+
+  c->fd = fd;
+  c->writing = 0;
+  c->family = 0;
+  c->started = 0;
+  c->done = 0;
+  c->item = NULL;
+  c->off = 0;
+  c->reqlen = 0;
+  c->buf.len = 0;
+  ev_io_init(&c->io, client_cb, fd, EV_READ);
+  c->io.data = c;
+  ev_io_start(loop, &c->io);
+}
+
+int metrics_init(
+    struct metrics *m,
+    struct metrics_source *src)
+{
+  int i;
+
+  memset(m, 0, sizeof(*m));
+  m->unix_fd = -1;
+  m->tcp_fd = -1;
+  m->src = *src;
+  for (i=0; i < METRICS_CLIENTS; i++) {
+    m->clients[i].fd = -1;
+    m->clients[i].m = m;
+  }
+  return 0;
+}
+
+int metrics_listen_unix(
+    struct metrics *m,
+    const char *path)
+{
+  struct sockaddr_un sun;
+  int fd = -1;
+
+  if (strlen(path) >= sizeof(sun.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  strcpy(sun.sun_path, path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    goto fail;
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+    goto fail;
+  if (listen(fd, 16) < 0)
+    goto fail;
+
+  m->unix_fd = fd;
+  return 0;
+
+fail:
+  if (fd > -1)
+    close(fd);
+  return -1;
+}
+
+/* Loopback only; anything wider belongs behind a proper proxy */
+int metrics_listen_tcp(
+    struct metrics *m,
+    int port)
+{
+  struct sockaddr_in sin;
+  int fd = -1, yes = 1;
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(port);
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    goto fail;
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0)
+    goto fail;
+  if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+    goto fail;
+  if (listen(fd, 16) < 0)
+    goto fail;
+
+  m->tcp_fd = fd;
+  return 0;
+
+fail:
+  if (fd > -1)
+    close(fd);
+  return -1;
+}
+
+void metrics_start(
+    struct ev_loop *loop,
+    struct metrics *m)
+{
+  if (m->unix_fd > -1) {
+    ev_io_init(&m->unix_io, accept_cb, m->unix_fd, EV_READ);
+    m->unix_io.data = m;
+    ev_io_start(loop, &m->unix_io);
+  }
+  if (m->tcp_fd > -1) {
+    ev_io_init(&m->tcp_io, accept_cb, m->tcp_fd, EV_READ);
+    m->tcp_io.data = m;
+    ev_io_start(loop, &m->tcp_io);
+  }
+}
+
+/* Scrapes in progress hold a cursor into the items; drop them when the
+ * items are about to change underneath */
+void metrics_reset(
+    struct ev_loop *loop,
+    struct metrics *m)
+{
+  int i;
+
+  for (i=0; i < METRICS_CLIENTS; i++) {
+    if (m->clients[i].fd > -1 && m->clients[i].writing)
+      client_close(loop, &m->clients[i]);
+  }
+}
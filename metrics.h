@@ -0,0 +1,77 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+#include "common.h"
+#include <ev.h>
+
+#define METRICS_CLIENTS 8
+#define METRICS_BUFSZ (64 * 1024)
+#define METRICS_REQSZ 2048
+
+/* OpenMetrics text served over HTTP/1.0 from the event loop. The body
+ * is rendered a few items at a time into a buffer owned by the client
+ * slot, refilled only once the socket has taken what is already there,
+ * so a large scrape is spread over many loop iterations and reuses the
+ * same memory every time. */
+struct metrics_buf {
+  char *data;
+  size_t len;
+  size_t size;
+};
+
+struct metrics_family {
+  const char *name;
+  const char *type;
+  const char *help;
+};
+
+/* Items are walked with first/next once per family; render writes the
+ * samples of one family for one item */
+struct metrics_source {
+  const struct metrics_family *families;
+  size_t nfamilies;
+  void * (*first)(void *data);
+  void * (*next)(void *data, void *item);
+  void (*render)(void *data, void *item, size_t family,
+                 struct metrics_buf *);
+  void *data;
+};
+
+struct metrics;
+
+struct metrics_client {
+  int fd;
+  int writing;
+  ev_io io;
+  size_t family;
+  int started;
+  int done;
+  void *item;
+  size_t off;
+  size_t reqlen;
+  char req[METRICS_REQSZ];
+  struct metrics_buf buf;
+  struct metrics *m;
+};
+
+struct metrics {
+  int unix_fd;
+  int tcp_fd;
+  ev_io unix_io;
+  ev_io tcp_io;
+  struct metrics_source src;
+  unsigned long scrapes;
+  struct metrics_client clients[METRICS_CLIENTS];
+};
+
+int metrics_init(struct metrics *, struct metrics_source *);
+int metrics_listen_unix(struct metrics *, const char *path);
+int metrics_listen_tcp(struct metrics *, int port);
+void metrics_start(struct ev_loop *, struct metrics *);
+void metrics_reset(struct ev_loop *, struct metrics *);
+
+void metrics_printf(struct metrics_buf *, const char *fmt, ...)
+     __attribute__((format(printf, 2, 3)));
+void metrics_label(struct metrics_buf *, const char *name,
+                   const char *value, int first);
+
+#endif
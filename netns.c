@@ -0,0 +1,161 @@
+#include "common.h"
+
+#include <sched.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/inotify.h>
+
+#include "netns.h"
+
+static __thread int self_ns = -1;
+static int run_wd = -1;
+static int dir_wd = -1;
+
+static int enter(
+    int nsfd)
+{
+  if (self_ns < 0) {
+    self_ns = open("/proc/thread-self/ns/net", O_RDONLY|O_CLOEXEC);
+    if (self_ns < 0)
+      return -1;
+  }
+  return setns(nsfd, CLONE_NEWNET);
+}
+
+static void leave(
+    void)
+{
+  /* Carrying on in the wrong namespace would silently misplace every
+   * socket created afterwards */
+  if (setns(self_ns, CLONE_NEWNET) < 0)
+    err(EXIT_FAILURE, "Cannot return to own network namespace");
+}
+
+/* Names without a slash are looked up under /run/netns like ip-netns
+ * does, anything else is taken as a path such as /proc/<pid>/ns/net */
+int netns_open(
+    const char *name)
+{
+  char path[PATH_MAX];
+  int fd = -1;
+
+  if (strchr(name, '/'))
+    snprintf(path, sizeof(path), "%s", name);
+  else
+    snprintf(path, sizeof(path), "%s/%s", NETNS_RUN_DIR, name);
+
+  fd = open(path, O_RDONLY|O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  /* ip-netns creates the file before bind mounting the namespace on
+   * it, so make sure it really is one */
+  if (enter(fd) < 0) {
+    close(fd);
+    return -1;
+  }
+  leave();
+  return fd;
+}
+
+int netns_socket(
+    int nsfd,
+    int domain,
+    int type,
+    int protocol)
+{
+  int fd, e;
+
+  if (nsfd < 0)
+    return socket(domain, type, protocol);
+
+  if (enter(nsfd) < 0)
+    return -1;
+  fd = socket(domain, type, protocol);
+  e = errno;
+  leave();
+  errno = e;
+  return fd;
+}
+
+static int watch_dir(
+    int fd)
+{
+  dir_wd = inotify_add_watch(fd, NETNS_RUN_DIR,
+                             IN_CREATE|IN_DELETE|IN_MOVED_TO|IN_MOVED_FROM|
+                             IN_ONLYDIR);
+  return dir_wd;
+}
+
+int netns_watch(
+    void)
+{
+  int fd = -1;
+
+  fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  /* /run/netns only exists once the first namespace has been named,
+   * and goes away again if someone cleans it up */
+  run_wd = inotify_add_watch(fd, "/run", IN_CREATE|IN_MOVED_TO|IN_ONLYDIR);
+  if (run_wd < 0)
+    goto fail;
+  if (watch_dir(fd) < 0 && errno != ENOENT)
+    goto fail;
+  return fd;
+
+fail:
+  close(fd);
+  return -1;
+}
+
+int netns_read(
+    int fd,
+    netns_change_cb cb,
+    void *data)
+{
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event *ev;
+  ssize_t len;
+  char *p;
+  int rc = 0;
+
+  for (;;) {
+    len = read(fd, buf, sizeof(buf));
+    if (len < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      return -1;
+    }
+
+    for (p=buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+      ev = (struct inotify_event *)p;
+
+      if (ev->wd == run_wd) {
+        if (dir_wd < 0 && ev->len && strcmp(ev->name, "netns") == 0)
+          watch_dir(fd);
+        continue;
+      }
+      if (ev->wd != dir_wd)
+        continue;
+
+      if (ev->mask & IN_IGNORED) {
+        dir_wd = -1;
+        continue;
+      }
+      if (!ev->len)
+        continue;
+
+      if (ev->mask & (IN_CREATE|IN_MOVED_TO))
+        cb(data, ev->name, 1);
+      else if (ev->mask & (IN_DELETE|IN_MOVED_FROM))
+        cb(data, ev->name, 0);
+      rc++;
+    }
+  }
+
+  return rc;
+}
@@ -0,0 +1,14 @@
+#ifndef _NETNS_H_
+#define _NETNS_H_
+#include "common.h"
+
+#define NETNS_RUN_DIR "/run/netns"
+
+typedef void (*netns_change_cb)(void *data, const char *name, int present);
+
+int netns_open(const char *name);
+int netns_socket(int nsfd, int domain, int type, int protocol);
+int netns_watch(void);
+int netns_read(int fd, netns_change_cb cb, void *data);
+
+#endif
@@ -0,0 +1,290 @@
+#include "common.h"
+
+#include <signal.h>
+#include <netdb.h>
+
+#include "resolver.h"
+#include "link.h"
+
+static void * resolver_run(
+    void *arg)
+{
+  struct resolver *r = arg;
+  struct resolver_job *j;
+  struct addrinfo hints, *ai;
+
+  for (;;) {
+    pthread_mutex_lock(&r->lock);
+    while (!r->queue)
+      pthread_cond_wait(&r->wake, &r->lock);
+    j = r->queue;
+    r->queue = j->next;
+    if (!r->queue)
+      r->queue_tail = &r->queue;
+    pthread_mutex_unlock(&r->lock);
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = j->family;
+    hints.ai_socktype = SOCK_DGRAM;
+    j->error = getaddrinfo(j->host, NULL, &hints, &ai);
+    if (j->error == 0) {
+      memcpy(&j->addr, ai->ai_addr, ai->ai_addrlen);
+      j->len = ai->ai_addrlen;
+      freeaddrinfo(ai);
+    }
+
+    pthread_mutex_lock(&r->lock);
+    j->next = r->done;
+    r->done = j;
+    pthread_mutex_unlock(&r->lock);
+    ev_async_send(r->loop, &r->done_wakeup);
+  }
+  return NULL;
+}
+
+static void name_free(
+    struct resolver_name *n)
+{
+  struct resolver_name **pp;
+
+  pp = &n->r->names[link_hash_name(n->host) & (RESOLVER_BUCKETS - 1)];
+  for (; *pp != NULL; pp=&(*pp)->next) {
+    if (*pp == n) {
+      *pp = n->next;
+      break;
+    }
+  }
+  ev_timer_stop(n->r->loop, &n->refresh);
+  free(n->host);
+  free(n);
+}
+
+static void name_lookup(
+    struct resolver *r,
+    struct resolver_name *n)
+{
+  struct resolver_job *j;
+
+  j = malloc(sizeof(*j));
+  assert(j);
+  memset(j, 0, sizeof(*j));
+  j->name = n;
+  j->host = strdup(n->host);
+  assert(j->host);
+  /* Later answers are kept to the family the first one came in */
+  j->family = n->resolved ? n->addr.ss_family : n->family;
+  n->busy = 1;
+  r->lookups++;
+
+  pthread_mutex_lock(&r->lock);
+  *r->queue_tail = j;
+  r->queue_tail = &j->next;
+  pthread_cond_signal(&r->wake);
+  pthread_mutex_unlock(&r->lock);
+}
+
+static void name_refresh_cb(
+    struct ev_loop *loop,
+    ev_timer *w,
+    int revents)
+{
+  struct resolver_name *n = w->data;
+
+  if (!n->watchers)
+    name_free(n);
+  else if (!n->busy)
+    name_lookup(n->r, n);
+}
+
+static int same_address(
+    const struct sockaddr_storage *a,
+    socklen_t alen,
+    const struct sockaddr_storage *b,
+    socklen_t blen)
+{
+  return alen == blen && memcmp(a, b, alen) == 0;
+}
+
+static void name_result(
+    struct resolver *r,
+    struct resolver_job *j)
+{
+  struct resolver_name *n = j->name;
+  struct resolver_watch *w, *next;
+  double again = r->ttl;
+
+  n->busy = 0;
+  if (j->error) {
+    r->failures++;
+    warnx("Cannot obtain IP address of %s: %s", n->host,
+          gai_strerror(j->error));
+    again = RESOLVER_RETRY;
+  }
+  else if (!n->resolved ||
+           !same_address(&n->addr, n->len, &j->addr, j->len)) {
+    if (n->resolved)
+      r->changes++;
+    memcpy(&n->addr, &j->addr, j->len);
+    n->len = j->len;
+    n->resolved = 1;
+    for (w=n->watchers; w != NULL; w=next) {
+      next = w->next;
+      w->cb(w->data, (struct sockaddr *)&n->addr, n->len);
+    }
+  }
+
+  if (!n->watchers) {
+    name_free(n);
+    return;
+  }
+  if (again > 0.0) {
+    n->refresh.repeat = again;
+    ev_timer_again(r->loop, &n->refresh);
+  }
+}
+
+static void resolver_done_cb(
+    struct ev_loop *loop,
+    ev_async *w,
+    int revents)
+{
+  struct resolver *r = w->data;
+  struct resolver_job *j, *next;
+
+  pthread_mutex_lock(&r->lock);
+  j = r->done;
+  r->done = NULL;
+  pthread_mutex_unlock(&r->lock);
+
+  for (; j != NULL; j=next) {
+    next = j->next;
+    name_result(r, j);
+    free(j->host);
+    free(j);
+  }
+}
+
+/* A ttl of 0 looks every name up once only */
+int resolver_init(
+    struct resolver *r,
+    struct ev_loop *loop,
+    int threads,
+    double ttl)
+{
+  sigset_t all, old;
+  int i, rc = 0;
+
+  memset(r, 0, sizeof(*r));
+  r->loop = loop;
+  r->ttl = ttl;
+  r->queue_tail = &r->queue;
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->wake, NULL);
+  ev_async_init(&r->done_wakeup, resolver_done_cb);
+  r->done_wakeup.data = r;
+  ev_async_start(loop, &r->done_wakeup);
+
+  if (threads > RESOLVER_THREADS_MAX)
+    threads = RESOLVER_THREADS_MAX;
+
+  /* Signals belong to the main loop */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  for (i=0; i < threads; i++) {
+    rc = pthread_create(&r->threads[i], NULL, resolver_run, r);
+    if (rc != 0)
+      break;
+    r->nthreads++;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  if (r->nthreads == 0) {
+    errno = rc;
+    return -1;
+  }
+  return 0;
+}
+
+static struct resolver_name * name_find(
+    struct resolver *r,
+    const char *host,
+    int family)
+{
+  struct resolver_name *n;
+
+  n = r->names[link_hash_name(host) & (RESOLVER_BUCKETS - 1)];
+  for (; n != NULL; n=n->next) {
+    if (strcmp(n->host, host) == 0 && n->family == family)
+      return n;
+  }
+  return NULL;
+}
+
+/* cb runs straight away if the address is already known */
+void resolver_watch(
+    struct resolver *r,
+    const char *host,
+    int family,
+    resolver_cb cb,
+    void *data)
+{
+  struct resolver_name *n;
+  struct resolver_watch *w;
+  size_t b;
+
+  n = name_find(r, host, family);
+  if (!n) {
+    n = malloc(sizeof(*n));
+    assert(n);
+    memset(n, 0, sizeof(*n));
+    n->host = strdup(host);
+    assert(n->host);
+    n->family = family;
+    n->r = r;
+    ev_init(&n->refresh, name_refresh_cb);
+    n->refresh.data = n;
+    b = link_hash_name(host) & (RESOLVER_BUCKETS - 1);
+    n->next = r->names[b];
+    r->names[b] = n;
+  }
+
+  w = malloc(sizeof(*w));
+  assert(w);
+  w->cb = cb;
+  w->data = data;
+  w->next = n->watchers;
+  n->watchers = w;
+
+  if (n->resolved)
+    cb(data, (struct sockaddr *)&n->addr, n->len);
+  else if (!n->busy)
+    name_lookup(r, n);
+}
+
+/* Names nobody watches are dropped when their refresh comes due, so a
+ * section that is only replaced on reload finds its address cached */
+void resolver_unwatch(
+    struct resolver *r,
+    const char *host,
+    int family,
+    void *data)
+{
+  struct resolver_name *n;
+  struct resolver_watch *w, **pp;
+
+  n = name_find(r, host, family);
+  if (!n)
+    return;
+
+  for (pp=&n->watchers; *pp != NULL; pp=&(*pp)->next) {
+    if ((*pp)->data == data) {
+      w = *pp;
+      *pp = w->next;
+      free(w);
+      break;
+    }
+  }
+
+  if (!n->watchers && !n->busy && !ev_is_active(&n->refresh))
+    name_free(n);
+}
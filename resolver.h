@@ -0,0 +1,71 @@
+#ifndef _RESOLVER_H_
+#define _RESOLVER_H_
+#include "common.h"
+#include <ev.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#define RESOLVER_THREADS_MAX 64
+#define RESOLVER_BUCKETS 256
+/* Wait before asking again after a failed lookup */
+#define RESOLVER_RETRY 5.0
+
+typedef void (*resolver_cb)(void *data, const struct sockaddr *addr,
+                            socklen_t len);
+
+/* getaddrinfo() run on a pool of threads so lookups never block the
+ * loop and many run at once. Each name is looked up once however many
+ * sections watch it, and again every ttl seconds; watchers hear about
+ * the first address and about every change, on the loop's thread. */
+struct resolver {
+  struct ev_loop *loop;
+  double ttl;
+  int nthreads;
+  pthread_t threads[RESOLVER_THREADS_MAX];
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  ev_async done_wakeup;
+
+  /* Both under lock: lookups waiting for a thread, finished ones
+   * waiting for the loop */
+  struct resolver_job {
+    struct resolver_name *name;
+    char *host;
+    int family;
+    int error;
+    struct sockaddr_storage addr;
+    socklen_t len;
+    struct resolver_job *next;
+  } *queue, **queue_tail, *done;
+
+  /* Loop thread only */
+  struct resolver_name {
+    char *host;
+    int family;
+    int resolved;
+    int busy;
+    struct sockaddr_storage addr;
+    socklen_t len;
+    ev_timer refresh;
+    struct resolver *r;
+    struct resolver_watch {
+      resolver_cb cb;
+      void *data;
+      struct resolver_watch *next;
+    } *watchers;
+    struct resolver_name *next;
+  } *names[RESOLVER_BUCKETS];
+
+  unsigned long lookups;
+  unsigned long failures;
+  unsigned long changes;
+};
+
+int resolver_init(struct resolver *, struct ev_loop *, int threads,
+                  double ttl);
+void resolver_watch(struct resolver *, const char *host, int family,
+                    resolver_cb cb, void *data);
+void resolver_unwatch(struct resolver *, const char *host, int family,
+                      void *data);
+
+#endif
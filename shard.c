@@ -0,0 +1,148 @@
+#include "common.h"
+
+#include <sched.h>
+#include <signal.h>
+
+#include "shard.h"
+
+/* The CPUs this process may run on, in order */
+int shard_cpus(
+    int *cpus,
+    int max)
+{
+  cpu_set_t set;
+  int i, n = 0;
+
+  if (sched_getaffinity(0, sizeof(set), &set) < 0)
+    return -1;
+  for (i=0; i < CPU_SETSIZE && n < max; i++) {
+    if (CPU_ISSET(i, &set))
+      cpus[n++] = i;
+  }
+  return n;
+}
+
+static void shard_drain(
+    struct ev_loop *loop,
+    ev_async *w,
+    int revents)
+{
+  struct shard *s = w->data;
+  struct shard_msg *m, *next, *list = NULL;
+
+  /* Producers push onto a stack; take all of it and restore the order
+   * the messages were sent in */
+  m = __atomic_exchange_n(&s->queue, NULL, __ATOMIC_ACQUIRE);
+  for (; m != NULL; m=next) {
+    next = m->next;
+    m->next = list;
+    list = m;
+  }
+
+  for (m=list; m != NULL; m=next) {
+    next = m->next;
+    m->fn(loop, m->data, m->arg);
+    free(m);
+  }
+}
+
+static void * shard_run(
+    void *arg)
+{
+  struct shard *s = arg;
+
+  s->counters = &icmp_counters;
+  if (s->setup)
+    s->setup(s);
+  ev_run(s->loop, 0);
+  return NULL;
+}
+
+/* With a loop the shard runs on it, in the calling thread. Without one
+ * it gets a loop and thread of its own from shard_start(). */
+int shard_init(
+    struct shard *s,
+    int id,
+    struct ev_loop *loop)
+{
+  memset(s, 0, sizeof(*s));
+  s->id = id;
+  s->cpu = -1;
+  s->loop = loop;
+  s->threaded = loop == NULL;
+  s->counters = &icmp_counters;
+  ev_async_init(&s->wakeup, shard_drain);
+  s->wakeup.data = s;
+  return 0;
+}
+
+int shard_start(
+    struct shard *s,
+    int cpu,
+    void (*setup)(struct shard *))
+{
+  pthread_attr_t attr;
+  cpu_set_t set;
+  sigset_t all, old;
+  int rc;
+
+  if (!s->threaded) {
+    s->setup = setup;
+    if (setup)
+      setup(s);
+    return 0;
+  }
+
+  s->loop = ev_loop_new(EVFLAG_AUTO);
+  if (!s->loop)
+    return -1;
+  ev_async_start(s->loop, &s->wakeup);
+  s->setup = setup;
+  s->cpu = cpu;
+
+  pthread_attr_init(&attr);
+  if (cpu > -1) {
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+  }
+
+  /* Signals belong to the main loop */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  rc = pthread_create(&s->thread, &attr, shard_run, s);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  pthread_attr_destroy(&attr);
+
+  if (rc != 0) {
+    errno = rc;
+    return -1;
+  }
+  return 0;
+}
+
+/* Run fn on the shard's loop. Safe from any thread; messages from one
+ * sender are run in the order they were sent. */
+void shard_call(
+    struct shard *s,
+    shard_fn fn,
+    void *data,
+    int arg)
+{
+  struct shard_msg *m;
+
+  if (!s->threaded) {
+    fn(s->loop, data, arg);
+    return;
+  }
+
+  m = malloc(sizeof(*m));
+  assert(m);
+  m->fn = fn;
+  m->data = data;
+  m->arg = arg;
+  m->next = __atomic_load_n(&s->queue, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&s->queue, &m->next, m, 1,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  ev_async_send(s->loop, &s->wakeup);
+}
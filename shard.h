@@ -0,0 +1,36 @@
+#ifndef _SHARD_H_
+#define _SHARD_H_
+#include <ev.h>
+#include <pthread.h>
+#include "icmp.h"
+
+#define SHARD_MAX 256
+
+typedef void (*shard_fn)(struct ev_loop *loop, void *data, int arg);
+
+/* A loop that owns a slice of the probes: their sockets, timers and
+ * stats. Other threads hand it work with shard_call(); a shard without
+ * its own thread runs work inline on the caller's loop. */
+struct shard {
+  int id;
+  int cpu;
+  int threaded;
+  pthread_t thread;
+  struct ev_loop *loop;
+  ev_async wakeup;
+  struct shard_msg {
+    shard_fn fn;
+    void *data;
+    int arg;
+    struct shard_msg *next;
+  } *queue;
+  struct icmp_counters *counters;
+  void (*setup)(struct shard *);
+};
+
+int shard_init(struct shard *, int id, struct ev_loop *loop);
+int shard_start(struct shard *, int cpu, void (*setup)(struct shard *));
+void shard_call(struct shard *, shard_fn fn, void *data, int arg);
+int shard_cpus(int *cpus, int max);
+
+#endif
@@ -0,0 +1,623 @@
+#include "common.h"
+#include "sim.h"
+
+#include <math.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/icmp6.h>
+
+#define SIM_FD_BASE 3
+#define SIM_PACKET_LEN 64
+#define SIM_MIN_RTT 0.000001
+
+/* Two cache lines: every packet in flight is touched on send, delivery
+ * and receive, and with many tunnels none of them are still cached */
+struct sim_packet {
+  double at;
+  int fd;
+  unsigned incarnation;
+  struct sim_packet *next;
+  uint16_t len;
+  socklen_t fromlen;
+  struct sockaddr_in6 from;
+  unsigned char data[SIM_PACKET_LEN];
+};
+
+/* The arrival time is kept next to the packet so sifting the heap never
+ * touches the packets themselves */
+struct sim_arrival {
+  double at;
+  struct sim_packet *pk;
+};
+
+struct sim_socket {
+  int open;
+  unsigned incarnation;
+  int family;
+  struct sockaddr_storage peer;
+  socklen_t peerlen;
+  int stamps;
+  struct sim_packet *head;
+  struct sim_packet *tail;
+};
+
+static struct {
+  struct sim_profile profile;
+  uint64_t rng;
+  double now;
+  double last_arrival;
+  struct sim_counters counters;
+
+  struct sim_socket *sockets;
+  size_t nsockets;
+  size_t hint;
+
+  /* Replies in flight, a binary heap on arrival time */
+  struct sim_arrival *heap;
+  size_t len;
+  size_t size;
+  struct sim_packet *free;
+
+  int *ready;
+  size_t nready;
+  size_t readysize;
+} sim;
+
+/* xorshift64*: cheap, and the same seed replays the same run */
+static double uniform(
+    void)
+{
+  sim.rng ^= sim.rng >> 12;
+  sim.rng ^= sim.rng << 25;
+  sim.rng ^= sim.rng >> 27;
+  return (double)((sim.rng * 2685821657736338717ull) >> 11) /
+         9007199254740992.0;
+}
+
+static double draw_rtt(
+    void)
+{
+  struct sim_profile *p = &sim.profile;
+  double u, v, rtt;
+
+  switch (p->distribution) {
+  case SIM_RTT_UNIFORM:
+    rtt = p->rtt + p->spread * (2.0 * uniform() - 1.0);
+    break;
+  case SIM_RTT_NORMAL:
+    do
+      u = uniform();
+    while (u == 0.0);
+    v = uniform();
+    rtt = p->rtt + p->spread * sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+    break;
+  case SIM_RTT_EXPONENTIAL:
+    rtt = p->rtt - p->spread * log(1.0 - uniform());
+    break;
+  default:
+    rtt = p->rtt;
+    break;
+  }
+
+  /* A zero round trip reads as a failure to the callers */
+  return rtt < SIM_MIN_RTT ? SIM_MIN_RTT : rtt;
+}
+
+static uint32_t address_hash(
+    const struct sockaddr *sa)
+{
+  const unsigned char *p;
+  size_t len;
+  uint32_t h = 2166136261u;
+
+  if (sa->sa_family == AF_INET) {
+    p = (const void *)&((const struct sockaddr_in *)sa)->sin_addr;
+    len = sizeof(struct in_addr);
+  }
+  else {
+    p = (const void *)&((const struct sockaddr_in6 *)sa)->sin6_addr;
+    len = sizeof(struct in6_addr);
+  }
+
+  while (len--) {
+    h ^= *p++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static int is_dead(
+    const struct sockaddr *sa)
+{
+  if (sim.profile.dead <= 0.0)
+    return 0;
+  return (double)address_hash(sa) / 4294967296.0 < sim.profile.dead;
+}
+
+static struct sim_socket * get_socket(
+    int fd)
+{
+  if (fd < SIM_FD_BASE || (size_t)(fd - SIM_FD_BASE) >= sim.nsockets ||
+      !sim.sockets[fd - SIM_FD_BASE].open) {
+    errno = EBADF;
+    return NULL;
+  }
+  return &sim.sockets[fd - SIM_FD_BASE];
+}
+
+static struct sim_packet * packet_get(
+    void)
+{
+  struct sim_packet *pk = sim.free;
+
+  if (pk) {
+    sim.free = pk->next;
+    return pk;
+  }
+  if (posix_memalign((void **)&pk, 64, sizeof(*pk)) != 0)
+    return NULL;
+  return pk;
+}
+
+static void packet_put(
+    struct sim_packet *pk)
+{
+  pk->next = sim.free;
+  sim.free = pk;
+}
+
+static void heap_push(
+    struct sim_packet *pk)
+{
+  struct sim_arrival *heap;
+  size_t i, parent;
+
+  if (sim.len == sim.size) {
+    heap = realloc(sim.heap, (sim.size ? sim.size * 2 : 1024) *
+                             sizeof(*heap));
+    assert(heap);
+    sim.heap = heap;
+    sim.size = sim.size ? sim.size * 2 : 1024;
+  }
+
+  for (i=sim.len++; i > 0; i=parent) {
+    parent = (i - 1) / 2;
+    if (sim.heap[parent].at <= pk->at)
+      break;
+    sim.heap[i] = sim.heap[parent];
+  }
+  sim.heap[i].at = pk->at;
+  sim.heap[i].pk = pk;
+}
+
+static struct sim_packet * heap_pop(
+    void)
+{
+  struct sim_packet *top;
+  struct sim_arrival last;
+  size_t i, child;
+
+  top = sim.heap[0].pk;
+  last = sim.heap[--sim.len];
+  for (i=0; (child = 2 * i + 1) < sim.len; i=child) {
+    if (child + 1 < sim.len && sim.heap[child + 1].at < sim.heap[child].at)
+      child++;
+    if (last.at <= sim.heap[child].at)
+      break;
+    sim.heap[i] = sim.heap[child];
+  }
+  sim.heap[i] = last;
+  return top;
+}
+
+static void mark_ready(
+    int fd)
+{
+  int *ready;
+
+  if (sim.nready == sim.readysize) {
+    ready = realloc(sim.ready, (sim.readysize ? sim.readysize * 2 : 1024) *
+                               sizeof(*ready));
+    assert(ready);
+    sim.ready = ready;
+    sim.readysize = sim.readysize ? sim.readysize * 2 : 1024;
+  }
+  sim.ready[sim.nready++] = fd;
+}
+
+
+static int sim_socket(
+    int netns,
+    int family,
+    int type,
+    int protocol)
+{
+  struct sim_socket *s;
+  size_t i, n;
+
+  for (i=sim.hint; i < sim.nsockets; i++) {
+    if (!sim.sockets[i].open)
+      break;
+  }
+
+  if (i == sim.nsockets) {
+    n = sim.nsockets ? sim.nsockets * 2 : 1024;
+    s = realloc(sim.sockets, n * sizeof(*s));
+    if (!s)
+      return -1;
+    memset(s + sim.nsockets, 0, (n - sim.nsockets) * sizeof(*s));
+    sim.sockets = s;
+    sim.nsockets = n;
+  }
+
+  s = &sim.sockets[i];
+  s->open = 1;
+  s->incarnation++;
+  s->family = family;
+  s->peerlen = 0;
+  s->stamps = 0;
+  s->head = s->tail = NULL;
+  sim.hint = i + 1;
+  return (int)i + SIM_FD_BASE;
+}
+
+static int sim_close(
+    int fd)
+{
+  struct sim_socket *s = get_socket(fd);
+  struct sim_packet *pk;
+
+  if (!s)
+    return -1;
+
+  /* Replies still in flight are dropped on arrival by incarnation */
+  while ((pk = s->head) != NULL) {
+    s->head = pk->next;
+    packet_put(pk);
+  }
+  s->open = 0;
+  if ((size_t)(fd - SIM_FD_BASE) < sim.hint)
+    sim.hint = fd - SIM_FD_BASE;
+  return 0;
+}
+
+static int sim_setsockopt(
+    int fd,
+    int level,
+    int name,
+    const void *val,
+    socklen_t len)
+{
+  if (!get_socket(fd))
+    return -1;
+
+  /* Replies are stamped with the virtual time they landed at, so a
+   * reply read late still measures its own round trip. There are no
+   * send stamps. */
+  if (level == SOL_SOCKET && name == SO_TIMESTAMPING) {
+    errno = ENOPROTOOPT;
+    return -1;
+  }
+  if (level == SOL_SOCKET && name == SO_TIMESTAMPNS)
+    get_socket(fd)->stamps = 1;
+  return 0;
+}
+
+static int sim_connect(
+    int fd,
+    const struct sockaddr *peer,
+    socklen_t len)
+{
+  struct sim_socket *s = get_socket(fd);
+
+  if (!s)
+    return -1;
+  if (len > sizeof(s->peer)) {
+    errno = EINVAL;
+    return -1;
+  }
+  memcpy(&s->peer, peer, len);
+  s->peerlen = len;
+  return 0;
+}
+
+static ssize_t sim_sendmsg(
+    int fd,
+    const struct msghdr *msg,
+    int flags)
+{
+  struct sim_socket *s = get_socket(fd);
+  const struct sockaddr *to;
+  struct sim_packet *pk;
+  struct icmphdr *hdr;
+  socklen_t tolen;
+  size_t len = 0, i;
+
+  if (!s)
+    return -1;
+
+  if (msg->msg_name) {
+    to = msg->msg_name;
+    tolen = msg->msg_namelen;
+  }
+  else {
+    to = (struct sockaddr *)&s->peer;
+    tolen = s->peerlen;
+  }
+  if (!tolen) {
+    errno = EDESTADDRREQ;
+    return -1;
+  }
+  if (tolen > sizeof(pk->from)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  for (i=0; i < msg->msg_iovlen; i++)
+    len += msg->msg_iov[i].iov_len;
+  if (len < sizeof(*hdr) || len > SIM_PACKET_LEN) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  sim.counters.sent++;
+
+  if (is_dead(to) ||
+      (sim.profile.loss > 0.0 && uniform() < sim.profile.loss)) {
+    sim.counters.lost++;
+    return len;
+  }
+
+  pk = packet_get();
+  if (!pk) {
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  pk->len = 0;
+  for (i=0; i < msg->msg_iovlen; i++) {
+    memcpy(pk->data + pk->len, msg->msg_iov[i].iov_base,
+           msg->msg_iov[i].iov_len);
+    pk->len += msg->msg_iov[i].iov_len;
+  }
+
+  /* The peer turns the request round; id and payload come back as is */
+  hdr = (struct icmphdr *)pk->data;
+  hdr->type = s->family == AF_INET6 ? ICMP6_ECHO_REPLY : ICMP_ECHOREPLY;
+  hdr->code = 0;
+
+  memcpy(&pk->from, to, tolen);
+  pk->fromlen = tolen;
+  pk->fd = fd;
+  pk->incarnation = s->incarnation;
+  pk->at = sim.now + draw_rtt();
+  if (sim.profile.reorder > 0.0 && uniform() < sim.profile.reorder) {
+    pk->at += sim.profile.reorder_delay * uniform();
+    sim.counters.reordered++;
+  }
+  heap_push(pk);
+  return len;
+}
+
+static int sim_sendmmsg(
+    int fd,
+    struct mmsghdr *msgs,
+    unsigned int n,
+    int flags)
+{
+  unsigned int i;
+  ssize_t rc;
+
+  for (i=0; i < n; i++) {
+    rc = sim_sendmsg(fd, &msgs[i].msg_hdr, flags);
+    if (rc < 0)
+      return i ? (int)i : -1;
+    msgs[i].msg_len = rc;
+  }
+  return n;
+}
+
+static ssize_t sim_recvmsg(
+    int fd,
+    struct msghdr *msg,
+    int flags)
+{
+  struct sim_socket *s = get_socket(fd);
+  struct sim_packet *pk;
+  struct cmsghdr *c;
+  struct timespec ts;
+  size_t len = 0, n, i;
+
+  if (!s)
+    return -1;
+
+  if ((flags & MSG_ERRQUEUE) || !s->head) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  pk = s->head;
+  s->head = pk->next;
+  if (!s->head)
+    s->tail = NULL;
+
+  msg->msg_flags = 0;
+  for (i=0; i < msg->msg_iovlen && len < pk->len; i++) {
+    n = pk->len - len;
+    if (n > msg->msg_iov[i].iov_len)
+      n = msg->msg_iov[i].iov_len;
+    memcpy(msg->msg_iov[i].iov_base, pk->data + len, n);
+    len += n;
+  }
+  if (len < pk->len)
+    msg->msg_flags |= MSG_TRUNC;
+
+  if (msg->msg_name) {
+    if (msg->msg_namelen > pk->fromlen)
+      msg->msg_namelen = pk->fromlen;
+    memcpy(msg->msg_name, &pk->from, msg->msg_namelen);
+  }
+  if (s->stamps && msg->msg_control &&
+      msg->msg_controllen >= CMSG_SPACE(sizeof(ts))) {
+    ts.tv_sec = (time_t)pk->at;
+    ts.tv_nsec = (long)((pk->at - ts.tv_sec) * 1000000000.0);
+    c = msg->msg_control;
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SO_TIMESTAMPNS;
+    c->cmsg_len = CMSG_LEN(sizeof(ts));
+    memcpy(CMSG_DATA(c), &ts, sizeof(ts));
+    msg->msg_controllen = CMSG_SPACE(sizeof(ts));
+  }
+  else
+    msg->msg_controllen = 0;
+
+  packet_put(pk);
+  return len;
+}
+
+static int sim_recvmmsg(
+    int fd,
+    struct mmsghdr *msgs,
+    unsigned int n,
+    int flags)
+{
+  unsigned int i;
+  ssize_t rc;
+
+  for (i=0; i < n; i++) {
+    rc = sim_recvmsg(fd, &msgs[i].msg_hdr, flags);
+    if (rc < 0)
+      return i ? (int)i : -1;
+    msgs[i].msg_len = rc;
+  }
+  return n;
+}
+
+static uint64_t sim_clock(
+    void)
+{
+  return (uint64_t)(sim.now * 1000000000.0);
+}
+
+static double sim_realtime(
+    void)
+{
+  return sim.now;
+}
+
+const struct icmp_transport sim_transport = {
+  .socket = sim_socket,
+  .close = sim_close,
+  .setsockopt = sim_setsockopt,
+  .connect = sim_connect,
+  .sendmsg = sim_sendmsg,
+  .sendmmsg = sim_sendmmsg,
+  .recvmsg = sim_recvmsg,
+  .recvmmsg = sim_recvmmsg,
+  .clock = sim_clock,
+  .realtime = sim_realtime,
+};
+
+
+int sim_init(
+    const struct sim_profile *p,
+    uint64_t seed)
+{
+  sim_destroy();
+  memcpy(&sim.profile, p, sizeof(*p));
+  sim.rng = seed ? seed : 0x9e3779b97f4a7c15ull;
+  sim.now = 0.0;
+  return 0;
+}
+
+void sim_destroy(
+    void)
+{
+  struct sim_packet *pk;
+  size_t i;
+
+  for (i=0; i < sim.nsockets; i++) {
+    if (sim.sockets[i].open)
+      sim_close(i + SIM_FD_BASE);
+  }
+  while (sim.len)
+    packet_put(heap_pop());
+  while ((pk = sim.free) != NULL) {
+    sim.free = pk->next;
+    free(pk);
+  }
+  free(sim.sockets);
+  free(sim.heap);
+  free(sim.ready);
+  memset(&sim, 0, sizeof(sim));
+}
+
+double sim_now(
+    void)
+{
+  return sim.now;
+}
+
+/* Time only goes forward */
+void sim_set_now(
+    double now)
+{
+  if (now > sim.now)
+    sim.now = now;
+}
+
+/* When the next reply lands, or -1 if none is in flight */
+double sim_next(
+    void)
+{
+  return sim.len ? sim.heap[0].at : -1.0;
+}
+
+/* Queues every reply due by now on its socket. Hands back the sockets
+ * that had nothing to read before, in the order they became readable. */
+size_t sim_deliver(
+    const int **ready)
+{
+  struct sim_packet *pk;
+  struct sim_socket *s;
+
+  sim.nready = 0;
+  while (sim.len && sim.heap[0].at <= sim.now) {
+    pk = heap_pop();
+    s = get_socket(pk->fd);
+    if (!s || s->incarnation != pk->incarnation) {
+      sim.counters.stale++;
+      packet_put(pk);
+      continue;
+    }
+
+    pk->next = NULL;
+    if (s->tail)
+      s->tail->next = pk;
+    else {
+      s->head = pk;
+      mark_ready(pk->fd);
+    }
+    s->tail = pk;
+    sim.counters.delivered++;
+    if (pk->at != sim.last_arrival)
+      sim.counters.arrivals++;
+    sim.last_arrival = pk->at;
+  }
+
+  *ready = sim.ready;
+  return sim.nready;
+}
+
+int sim_readable(
+    int fd)
+{
+  struct sim_socket *s = get_socket(fd);
+  return s && s->head != NULL;
+}
+
+void sim_counters(
+    struct sim_counters *c)
+{
+  memcpy(c, &sim.counters, sizeof(*c));
+}
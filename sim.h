@@ -0,0 +1,52 @@
+#ifndef _SIM_H_
+#define _SIM_H_
+#include "common.h"
+#include "icmp.h"
+
+enum {
+  SIM_RTT_FIXED,
+  SIM_RTT_UNIFORM,
+  SIM_RTT_NORMAL,
+  SIM_RTT_EXPONENTIAL,
+};
+
+/* How the simulated network answers. rtt is the mean round trip, or
+ * the floor for SIM_RTT_EXPONENTIAL, and spread the half width, the
+ * standard deviation or the mean of the tail. A fraction dead of the
+ * targets, picked by address, never answer. All times in seconds. */
+struct sim_profile {
+  int distribution;
+  double rtt;
+  double spread;
+  double loss;
+  double reorder;
+  double reorder_delay;
+  double dead;
+};
+
+struct sim_counters {
+  unsigned long sent;
+  unsigned long delivered;
+  unsigned long lost;
+  unsigned long reordered;
+  unsigned long stale;
+  /* Distinct instants replies landed at, each a wakeup for a real loop */
+  unsigned long arrivals;
+};
+
+/* An in-memory network behind the icmp transport interface, on a
+ * virtual clock that only moves when told to. Every echo request sent
+ * becomes a reply queued on the sending socket at a time drawn from the
+ * profile. Single threaded, and there is only one. */
+extern const struct icmp_transport sim_transport;
+
+int sim_init(const struct sim_profile *, uint64_t seed);
+void sim_destroy(void);
+double sim_now(void);
+void sim_set_now(double now);
+double sim_next(void);
+size_t sim_deliver(const int **ready);
+int sim_readable(int fd);
+void sim_counters(struct sim_counters *);
+
+#endif
@@ -0,0 +1,213 @@
+#include "common.h"
+
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "stats.h"
+
+/* The file is built under a temporary name and renamed into place, so
+ * a reader never maps a half initialised file and one still holding the
+ * previous daemon's file keeps a consistent, if stale, copy */
+int stats_create(
+    struct stats *s,
+    const char *path,
+    uint32_t nrecords)
+{
+  char tmp[PATH_MAX];
+  struct timespec ts;
+  void *map = MAP_FAILED;
+  int fd = -1, saved;
+
+  memset(s, 0, sizeof(*s));
+  s->fd = -1;
+  s->size = sizeof(struct stats_header) +
+            (size_t)nrecords * sizeof(struct stats_record);
+
+  if (snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid()) >= sizeof(tmp)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  fd = open(tmp, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+  if (fd < 0)
+    goto fail;
+  if (ftruncate(fd, s->size) < 0)
+    goto fail;
+  map = mmap(NULL, s->size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    goto fail;
+
+  s->used = calloc(nrecords, sizeof(*s->used));
+  if (!s->used)
+    goto fail;
+
+  s->header = map;
+  s->records = (struct stats_record *)(s->header + 1);
+  memcpy(s->header->magic, STATS_MAGIC, sizeof(s->header->magic));
+  s->header->header_size = sizeof(struct stats_header);
+  s->header->record_size = sizeof(struct stats_record);
+  s->header->nrecords = nrecords;
+  s->header->pid = getpid();
+  clock_gettime(CLOCK_REALTIME, &ts);
+  s->header->started = ts.tv_sec + ts.tv_nsec / 1e9;
+  /* Readers check the version last, so it goes in last */
+  __atomic_store_n(&s->header->version, STATS_VERSION, __ATOMIC_RELEASE);
+
+  if (rename(tmp, path) < 0)
+    goto fail;
+
+  s->fd = fd;
+  return 0;
+
+fail:
+  saved = errno;
+  if (map != MAP_FAILED)
+    munmap(map, s->size);
+  if (fd > -1) {
+    close(fd);
+    unlink(tmp);
+  }
+  free(s->used);
+  memset(s, 0, sizeof(*s));
+  s->fd = -1;
+  errno = saved;
+  return -1;
+}
+
+/* Called from the main thread; slots are given back by the threads that
+ * own them */
+int stats_alloc(
+    struct stats *s)
+{
+  uint32_t i, expect;
+
+  if (!s->header)
+    return -1;
+  for (i=0; i < s->header->nrecords; i++) {
+    if (__atomic_load_n(&s->used[i], __ATOMIC_ACQUIRE))
+      continue;
+    expect = 0;
+    if (__atomic_compare_exchange_n(&s->used[i], &expect, 1, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      return i;
+  }
+  return -1;
+}
+
+void stats_free(
+    struct stats *s,
+    int slot)
+{
+  struct stats_record *r;
+
+  if (slot < 0 || !s->header)
+    return;
+  r = stats_begin(s, slot);
+  r->state = STATS_EMPTY;
+  stats_end(r);
+  __atomic_store_n(&s->used[slot], 0, __ATOMIC_RELEASE);
+}
+
+struct stats_record * stats_begin(
+    struct stats *s,
+    int slot)
+{
+  struct stats_record *r = &s->records[slot];
+
+  __atomic_store_n(&r->seq, r->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  return r;
+}
+
+void stats_end(
+    struct stats_record *r)
+{
+  __atomic_store_n(&r->seq, r->seq + 1, __ATOMIC_RELEASE);
+}
+
+int stats_open(
+    struct stats *s,
+    const char *path)
+{
+  struct stat st;
+  void *map = MAP_FAILED;
+  int saved;
+
+  memset(s, 0, sizeof(*s));
+  s->fd = open(path, O_RDONLY|O_CLOEXEC);
+  if (s->fd < 0)
+    return -1;
+  if (fstat(s->fd, &st) < 0)
+    goto fail;
+  if (st.st_size < sizeof(struct stats_header)) {
+    errno = EINVAL;
+    goto fail;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, s->fd, 0);
+  if (map == MAP_FAILED)
+    goto fail;
+  s->header = map;
+  s->size = st.st_size;
+
+  if (memcmp(s->header->magic, STATS_MAGIC, sizeof(s->header->magic)) ||
+      __atomic_load_n(&s->header->version, __ATOMIC_ACQUIRE) !=
+        STATS_VERSION ||
+      s->header->header_size != sizeof(struct stats_header) ||
+      s->header->record_size != sizeof(struct stats_record) ||
+      s->size < sizeof(struct stats_header) +
+                (size_t)s->header->nrecords * sizeof(struct stats_record)) {
+    errno = EPROTO;
+    goto fail;
+  }
+  s->records = (struct stats_record *)(s->header + 1);
+  return 0;
+
+fail:
+  saved = errno;
+  if (map != MAP_FAILED)
+    munmap(map, st.st_size);
+  close(s->fd);
+  memset(s, 0, sizeof(*s));
+  s->fd = -1;
+  errno = saved;
+  return -1;
+}
+
+/* Copy a record, retrying while the daemon is part way through writing
+ * it. Returns 0 for a slot that holds no section, and -1 if the record
+ * never settles, as when the daemon died in the middle of a write. */
+int stats_snapshot(
+    const struct stats *s,
+    int slot,
+    struct stats_record *out)
+{
+  const struct stats_record *r = &s->records[slot];
+  uint32_t seq;
+  int tries;
+
+  for (tries=0; tries < STATS_RETRIES; tries++) {
+    seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+      continue;
+    memcpy(out, r, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&r->seq, __ATOMIC_RELAXED) == seq)
+      return out->state != STATS_EMPTY;
+  }
+  errno = EAGAIN;
+  return -1;
+}
+
+void stats_close(
+    struct stats *s)
+{
+  if (s->header)
+    munmap(s->header, s->size);
+  if (s->fd > -1)
+    close(s->fd);
+  free(s->used);
+  memset(s, 0, sizeof(*s));
+  s->fd = -1;
+}
@@ -0,0 +1,69 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+#include "common.h"
+
+#define STATS_FILE "/run/tupperware.stats"
+#define STATS_MAGIC "TUPSTATS"
+#define STATS_VERSION 1
+#define STATS_RETRIES 100000
+
+/* A file of fixed-size records, one per section, that the daemon maps
+ * and updates in place. Each record is written only by the thread that
+ * owns its section and is guarded by a sequence count: odd while a write
+ * is in progress, and changed by every write. Readers map the file and
+ * copy records without ever talking to the daemon. */
+enum {
+  STATS_EMPTY = 0,
+  STATS_DOWN,
+  STATS_UP,
+};
+
+struct stats_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint32_t record_size;
+  uint32_t nrecords;
+  uint64_t pid;
+  double started;
+  char pad[24];
+};
+
+struct stats_record {
+  uint32_t seq;
+  uint32_t state;
+  char section[64];
+  char device[16];
+  char address[64];
+  char netns[40];
+  uint64_t samples;
+  uint64_t failures;
+  /* Round trip times in seconds; last_sent is wall clock time */
+  double mean;
+  double ewma;
+  double min;
+  double max;
+  double jitter;
+  double last_sent;
+} __attribute__((aligned(64)));
+
+struct stats {
+  int fd;
+  size_t size;
+  struct stats_header *header;
+  struct stats_record *records;
+  /* Slot ownership, private to the daemon */
+  uint32_t *used;
+};
+
+int stats_create(struct stats *, const char *path, uint32_t nrecords);
+int stats_alloc(struct stats *);
+void stats_free(struct stats *, int slot);
+struct stats_record * stats_begin(struct stats *, int slot);
+void stats_end(struct stats_record *);
+
+int stats_open(struct stats *, const char *path);
+int stats_snapshot(const struct stats *, int slot, struct stats_record *);
+void stats_close(struct stats *);
+
+#endif
@@ -0,0 +1,502 @@
+#include "common.h"
+#include "hist.h"
+#include "icmp.h"
+
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip_icmp.h>
+
+/* Microbenchmarks of single pieces of the probe path, each printing one
+ * JSON line per configuration. Linked with malloc and friends wrapped
+ * (-Wl,--wrap) so every allocation made by the code under test is
+ * counted. */
+
+#define BENCH_PACKET_LEN 64
+
+static unsigned long allocations;
+
+void * __real_malloc(size_t);
+void * __real_calloc(size_t, size_t);
+void * __real_realloc(void *, size_t);
+
+void * __wrap_malloc(
+    size_t size)
+{
+  allocations++;
+  return __real_malloc(size);
+}
+
+void * __wrap_calloc(
+    size_t n,
+    size_t size)
+{
+  allocations++;
+  return __real_calloc(n, size);
+}
+
+void * __wrap_realloc(
+    void *p,
+    size_t size)
+{
+  allocations++;
+  return __real_realloc(p, size);
+}
+
+static uint64_t rng = 1;
+
+/* xorshift64*, as in sim.c */
+static double uniform(
+    void)
+{
+  rng ^= rng >> 12;
+  rng ^= rng << 25;
+  rng ^= rng >> 27;
+  return (double)((rng * 2685821657736338717ull) >> 11) / 9007199254740992.0;
+}
+
+static uint64_t clock_cost;
+
+static uint64_t now_ns(
+    void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000000ull) + (uint64_t)ts.tv_nsec;
+}
+
+/* Phases can be a handful of operations long, so the cost of reading
+ * the clock itself is taken off every interval */
+static void clock_calibrate(
+    void)
+{
+  uint64_t t0, t;
+  int i;
+
+  clock_cost = UINT64_MAX;
+  for (i=0; i < 10000; i++) {
+    t0 = now_ns();
+    t = now_ns() - t0;
+    if (t < clock_cost)
+      clock_cost = t;
+  }
+}
+
+static uint64_t elapsed(
+    uint64_t t0)
+{
+  uint64_t t = now_ns() - t0;
+  return t > clock_cost ? t - clock_cost : 0;
+}
+
+/* A transport that costs next to nothing: every probe sent is kept by
+ * sequence number, and a read returns the reply to whichever probe the
+ * benchmark picked, so only the bookkeeping around them is timed. */
+static struct {
+  unsigned char sent[65536][BENCH_PACKET_LEN];
+  size_t len[65536];
+  uint16_t reply;
+  uint64_t clock;
+} wire;
+
+static int null_socket(
+    int netns,
+    int family,
+    int type,
+    int protocol)
+{
+  return 3;
+}
+
+static int null_close(
+    int fd)
+{
+  return 0;
+}
+
+static int null_setsockopt(
+    int fd,
+    int level,
+    int name,
+    const void *val,
+    socklen_t len)
+{
+  return 0;
+}
+
+static int null_connect(
+    int fd,
+    const struct sockaddr *peer,
+    socklen_t len)
+{
+  return 0;
+}
+
+static ssize_t null_sendmsg(
+    int fd,
+    const struct msghdr *msg,
+    int flags)
+{
+  const struct icmphdr *hdr = msg->msg_iov->iov_base;
+  uint16_t seq = ntohs(hdr->un.echo.sequence);
+  size_t len = msg->msg_iov->iov_len;
+
+  if (len > BENCH_PACKET_LEN)
+    len = BENCH_PACKET_LEN;
+  memcpy(wire.sent[seq], hdr, len);
+  wire.len[seq] = len;
+  return msg->msg_iov->iov_len;
+}
+
+static ssize_t null_recvmsg(
+    int fd,
+    struct msghdr *msg,
+    int flags)
+{
+  struct icmphdr *hdr = msg->msg_iov->iov_base;
+  size_t len = wire.len[wire.reply];
+
+  if (flags & MSG_ERRQUEUE) {
+    errno = EAGAIN;
+    return -1;
+  }
+  memcpy(hdr, wire.sent[wire.reply], len);
+  hdr->type = ICMP_ECHOREPLY;
+  msg->msg_controllen = 0;
+  msg->msg_flags = 0;
+  return len;
+}
+
+static uint64_t null_clock(
+    void)
+{
+  return ++wire.clock;
+}
+
+static const struct icmp_transport null_transport = {
+  .socket = null_socket,
+  .close = null_close,
+  .setsockopt = null_setsockopt,
+  .connect = null_connect,
+  .sendmsg = null_sendmsg,
+  .recvmsg = null_recvmsg,
+  .clock = null_clock,
+};
+
+/* The outstanding probe list icmp.c kept before the ring: appended to
+ * at the tail on every send, searched from the head for every reply and
+ * popped from the head on expiry. Sends and reads go through the same
+ * transport as the ring's. */
+struct rlist {
+  uint16_t sequence;
+  double sent_time;
+  double recv_time;
+  struct rlist *next;
+};
+
+struct list_socket {
+  uint16_t seqno;
+  double timeout;
+  struct rlist *results;
+  size_t results_len;
+};
+
+static int list_send(
+    struct list_socket *ls,
+    double timestamp)
+{
+  unsigned char packet[sizeof(struct icmphdr) + 16];
+  struct icmphdr *rq = (struct icmphdr *)packet;
+  struct rlist *rl, *t;
+  struct msghdr msg;
+  struct iovec iov;
+  uint64_t sent = null_transport.clock();
+
+  memset(packet, 0, sizeof(packet));
+  rq->type = ICMP_ECHO;
+  rq->un.echo.sequence = htons(++ls->seqno);
+  memcpy(packet + sizeof(*rq), &sent, sizeof(sent));
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = packet;
+  iov.iov_len = sizeof(packet);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (null_transport.sendmsg(3, &msg, MSG_NOSIGNAL) != sizeof(packet))
+    return -1;
+
+  rl = malloc(sizeof(*rl));
+  assert(rl);
+  rl->sequence = ls->seqno;
+  rl->sent_time = timestamp;
+  rl->recv_time = -1.0;
+  rl->next = NULL;
+  if (!ls->results)
+    ls->results = rl;
+  else {
+    for (t=ls->results; t->next != NULL; t=t->next);
+    t->next = rl;
+  }
+  ls->results_len++;
+  return sizeof(packet);
+}
+
+static int list_recv(
+    struct list_socket *ls,
+    double *timestamp)
+{
+  unsigned char packet[sizeof(struct icmphdr) + 16];
+  struct icmphdr *hdr = (struct icmphdr *)packet;
+  struct rlist *rl, *la = NULL;
+  struct msghdr msg;
+  struct iovec iov;
+  uint16_t seq;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = packet;
+  iov.iov_len = sizeof(packet);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (null_transport.recvmsg(3, &msg, 0) != sizeof(packet))
+    return -1;
+
+  seq = ntohs(hdr->un.echo.sequence);
+  for (rl=ls->results; rl != NULL; la=rl, rl=rl->next) {
+    if (rl->sequence != seq)
+      continue;
+    if (!la)
+      ls->results = rl->next;
+    else
+      la->next = rl->next;
+    *timestamp = rl->sent_time;
+    free(rl);
+    ls->results_len--;
+    return seq;
+  }
+  return 0;
+}
+
+static int list_timeout(
+    struct list_socket *ls,
+    double now)
+{
+  struct rlist *rl = ls->results;
+  int rc;
+
+  if (!rl || rl->sent_time + ls->timeout - now >= 0.0)
+    return 0;
+  ls->results = rl->next;
+  rc = rl->sequence;
+  free(rl);
+  ls->results_len--;
+  return rc;
+}
+
+/* Replies to a round's probes, in random order, some of them lost */
+static size_t pick_replies(
+    uint16_t *replies,
+    uint16_t first,
+    size_t window,
+    double loss)
+{
+  size_t i, j, n = 0;
+  uint16_t seq = first, t;
+
+  for (i=0; i < window; i++, seq++) {
+    /* Sequence zero is never sent */
+    if (seq == 0)
+      seq++;
+    if (uniform() >= loss)
+      replies[n++] = seq;
+  }
+  for (i=n; i > 1; i--) {
+    j = (size_t)(uniform() * i);
+    t = replies[i - 1];
+    replies[i - 1] = replies[j];
+    replies[j] = t;
+  }
+  return n;
+}
+
+/* Rounds of: send a full window of probes, read the replies that were
+ * not lost in random order, then expire the rest. Send and expiry times
+ * are per probe sent, so expiry includes the checks that found nothing;
+ * match time is per reply. */
+static void bench_ring(
+    const char *impl,
+    size_t window,
+    unsigned long probes,
+    double loss)
+{
+  struct sockaddr_in sin;
+  struct icmp_socket *ic = NULL;
+  struct list_socket ls;
+  uint16_t *replies, first = 1;
+  uint64_t t0, send_ns = 0, match_ns = 0, expire_ns = 0;
+  unsigned long sent = 0, matched = 0, expired = 0, allocs;
+  size_t i, n;
+  double rtt;
+  int list = strcmp(impl, "list") == 0;
+
+  replies = malloc(window * sizeof(*replies));
+  assert(replies);
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(0x0a000001);
+  memset(&ls, 0, sizeof(ls));
+  ls.timeout = 1.0;
+  if (!list) {
+    ic = icmp_socket_create((struct sockaddr *)&sin, sizeof(sin), 1.0, 1.0,
+                            window, 0, -1);
+    if (!ic)
+      err(EXIT_FAILURE, "Cannot create socket");
+  }
+
+  allocs = allocations;
+  while (sent < probes) {
+    t0 = now_ns();
+    for (i=0; i < window; i++) {
+      if ((list ? list_send(&ls, 0.0) : icmp_socket_send(ic, 0.0)) < 0)
+        errx(EXIT_FAILURE, "Cannot send probe %lu", sent);
+    }
+    send_ns += elapsed(t0);
+    sent += window;
+
+    n = pick_replies(replies, first, window, loss);
+    t0 = now_ns();
+    for (i=0; i < n; i++) {
+      wire.reply = replies[i];
+      if ((list ? list_recv(&ls, &rtt) : icmp_socket_recv(ic, &rtt)) > 0)
+        matched++;
+    }
+    match_ns += elapsed(t0);
+
+    t0 = now_ns();
+    while (list ? list_timeout(&ls, 2.0) : icmp_socket_timeout(ic, 2.0))
+      expired++;
+    expire_ns += elapsed(t0);
+
+    first = list ? ls.seqno + 1 : ic->seqno + 1;
+  }
+  allocs = allocations - allocs;
+
+  printf("{\"benchmark\":\"ring\",\"impl\":\"%s\",\"window\":%zu,"
+         "\"probes\":%lu,\"loss\":%g,\"matched\":%lu,\"expired\":%lu,"
+         "\"send_ns\":%.1f,\"match_ns\":%.1f,\"expire_ns\":%.1f,"
+         "\"allocs_per_probe\":%.3f}\n",
+         impl, window, sent, loss, matched, expired,
+         (double)send_ns / sent, matched ? (double)match_ns / matched : 0.0,
+         (double)expire_ns / sent,
+         (double)allocs / sent);
+
+  icmp_socket_destroy(ic);
+  free(replies);
+}
+
+#define BENCH_RTTS 4096
+
+/* hist_record() on every reply, for round trips all close together and
+ * for ones spread log-uniformly from 10us to 10s over every bucket
+ * group. Runs on the daemon's reply path, so it must never allocate. */
+static void bench_hist(
+    const char *shape,
+    unsigned long samples)
+{
+  struct hist *h;
+  double *rtts;
+  uint64_t t0, record_ns = 0;
+  unsigned long done = 0, allocs;
+  size_t i;
+  int wide = strcmp(shape, "wide") == 0;
+
+  h = malloc(sizeof(*h));
+  rtts = malloc(BENCH_RTTS * sizeof(*rtts));
+  assert(h && rtts);
+  for (i=0; i < BENCH_RTTS; i++)
+    rtts[i] = wide ? 1e-5 * pow(1e6, uniform()) : 0.018 + 0.004 * uniform();
+  hist_init(h);
+
+  allocs = allocations;
+  while (done < samples) {
+    t0 = now_ns();
+    for (i=0; i < BENCH_RTTS; i++)
+      hist_record(h, rtts[i]);
+    record_ns += elapsed(t0);
+    done += BENCH_RTTS;
+  }
+  allocs = allocations - allocs;
+
+  printf("{\"benchmark\":\"hist\",\"rtts\":\"%s\",\"samples\":%lu,"
+         "\"record_ns\":%.2f,\"p99_ms\":%.3f,\"allocs\":%lu}\n",
+         shape, done, (double)record_ns / done,
+         hist_percentile(h, 0.99) * 1000, allocs);
+  if (allocs)
+    errx(EXIT_FAILURE, "hist_record allocated %lu times", allocs);
+
+  free(rtts);
+  free(h);
+}
+
+static void usage(
+    const char *prog)
+{
+  fprintf(stderr,
+  "Usage: %s [options] ring|hist\n"
+  "  -n count        probes or samples per run         (200000)\n"
+  "  -w outstanding  ring: in flight, repeatable       (1 12 256 4096)\n"
+  "  -l fraction     ring: probes lost                 (0.01)\n"
+  "  -s seed         random seed                       (1)\n",
+  prog);
+  exit(EXIT_FAILURE);
+}
+
+int main(
+    int argc,
+    char **argv)
+{
+  size_t windows[16] = { 1, 12, 256, 4096 };
+  size_t nwindows = 4, i;
+  unsigned long probes = 200000;
+  double loss = 0.01;
+  int opt, custom = 0;
+
+  while ((opt = getopt(argc, argv, "n:w:l:s:")) != -1) {
+    switch (opt) {
+    case 'n': probes = strtoul(optarg, NULL, 10); break;
+    case 'l': loss = atof(optarg); break;
+    case 's': rng = strtoull(optarg, NULL, 10) | 1; break;
+    case 'w':
+      if (!custom)
+        nwindows = 0;
+      custom = 1;
+      if (nwindows == sizeof(windows) / sizeof(*windows))
+        usage(argv[0]);
+      windows[nwindows] = strtoul(optarg, NULL, 10);
+      if (windows[nwindows] < 1 || windows[nwindows] > ICMP_OUTSTANDING_MAX)
+        usage(argv[0]);
+      nwindows++;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1 || probes == 0 || loss < 0.0 || loss > 1.0)
+    usage(argv[0]);
+
+  icmp_transport_set(&null_transport);
+  clock_calibrate();
+  if (strcmp(argv[optind], "ring") == 0) {
+    for (i=0; i < nwindows; i++) {
+      bench_ring("ring", windows[i], probes, loss);
+      bench_ring("list", windows[i], probes, loss);
+    }
+  }
+  else if (strcmp(argv[optind], "hist") == 0) {
+    bench_hist("narrow", probes);
+    bench_hist("wide", probes);
+  }
+  else
+    usage(argv[0]);
+  return 0;
+}
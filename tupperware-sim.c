@@ -0,0 +1,292 @@
+#include "common.h"
+#include "ev_icmp.h"
+#include "hist.h"
+#include "sim.h"
+
+#include <ev.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+
+/* Replays probing of many tunnels against the in-memory network in
+ * sim.c, on a virtual clock, through the same ev_icmp and icmp code
+ * the daemon runs. The loop is never run: time jumps straight to the
+ * next timer deadline, reply or, with the wheel, the tick replies are
+ * read at, so a day passes in however long the probing code itself
+ * takes. Prints one JSON line. */
+
+struct tunnel {
+  ev_icmp icmp;
+  struct probe_results results;
+};
+
+static const char *distributions[] = {
+  [SIM_RTT_FIXED] = "fixed",
+  [SIM_RTT_UNIFORM] = "uniform",
+  [SIM_RTT_NORMAL] = "normal",
+  [SIM_RTT_EXPONENTIAL] = "exponential",
+};
+
+static ev_tstamp virtual_now(
+    struct ev_loop *loop)
+{
+  return sim_now();
+}
+
+/* The daemon's update_stats(), less publishing the record */
+static void tunnel_result(
+    void *data,
+    int seqno,
+    double rtt)
+{
+  struct tunnel *t = data;
+
+  results_record(&t->results, sim_now(), rtt);
+}
+
+static double wall_time(
+    void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void usage(
+    const char *prog)
+{
+  fprintf(stderr,
+  "Usage: %s [options]\n"
+  "  -n tunnels      tunnels to probe                  (100000)\n"
+  "  -d seconds      simulated time                    (86400)\n"
+  "  -i seconds      probe interval                    (60)\n"
+  "  -I fraction     spread intervals up to this much longer (0)\n"
+  "  -t seconds      probe timeout                     (5)\n"
+  "  -m mode         dedicated, shared or batch        (batch)\n"
+  "  -k seconds      wheel tick, 0 for the timer heap  (0.01)\n"
+  "  -r ms           round trip time                   (20)\n"
+  "  -j ms           round trip spread                 (5)\n"
+  "  -D name         fixed, uniform, normal or exponential (normal)\n"
+  "  -l fraction     probes lost                       (0.001)\n"
+  "  -o fraction     replies held back                 (0.001)\n"
+  "  -O ms           longest hold back                 (50)\n"
+  "  -x fraction     targets that never answer         (0.01)\n"
+  "  -B misses       back off after this many misses   (0)\n"
+  "  -S seconds      probe slack                       (0)\n"
+  "  -s seed         random seed                       (1)\n",
+  prog);
+  exit(EXIT_FAILURE);
+}
+
+static int parse_distribution(
+    const char *name)
+{
+  size_t i;
+
+  for (i=0; i < sizeof(distributions) / sizeof(*distributions); i++) {
+    if (strcmp(name, distributions[i]) == 0)
+      return i;
+  }
+  return -1;
+}
+
+int main(
+    int argc,
+    char **argv)
+{
+  struct sim_profile profile = {
+    .distribution = SIM_RTT_NORMAL,
+    .rtt = 0.020,
+    .spread = 0.005,
+    .loss = 0.001,
+    .reorder = 0.001,
+    .reorder_delay = 0.050,
+    .dead = 0.01,
+  };
+  struct sim_counters sc;
+  struct icmp_shared *shared = NULL;
+  struct sockaddr_in sin;
+  struct tunnel *tunnels;
+  struct ev_loop *loop;
+  struct rusage ru;
+  const char *mode = "batch";
+  const int *ready;
+  double duration = 86400.0, interval = 60.0, timeout = 5.0, tick = 0.01;
+  double slack = 0.0, spread = 0.0;
+  double wake, arrive, next, started, elapsed, rtt = 0.0;
+  unsigned long ntunnels = 100000, i, answered = 0, steps = 0;
+  unsigned long timer_steps = 0;
+  uint64_t seed = 1;
+  size_t nready, j;
+  int opt, flags = 0, backoff = 0, more;
+
+  while ((opt = getopt(argc, argv, "n:d:i:I:t:m:k:r:j:D:l:o:O:x:B:S:s:")) != -1) {
+    switch (opt) {
+    case 'n': ntunnels = strtoul(optarg, NULL, 10); break;
+    case 'd': duration = atof(optarg); break;
+    case 'i': interval = atof(optarg); break;
+    case 'I': spread = atof(optarg); break;
+    case 't': timeout = atof(optarg); break;
+    case 'm': mode = optarg; break;
+    case 'k': tick = atof(optarg); break;
+    case 'r': profile.rtt = atof(optarg) / 1000.0; break;
+    case 'j': profile.spread = atof(optarg) / 1000.0; break;
+    case 'l': profile.loss = atof(optarg); break;
+    case 'o': profile.reorder = atof(optarg); break;
+    case 'O': profile.reorder_delay = atof(optarg) / 1000.0; break;
+    case 'x': profile.dead = atof(optarg); break;
+    case 'B': backoff = atoi(optarg); break;
+    case 'S': slack = atof(optarg); break;
+    case 's': seed = strtoull(optarg, NULL, 10); break;
+    case 'D':
+      profile.distribution = parse_distribution(optarg);
+      if (profile.distribution < 0)
+        usage(argv[0]);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (strcmp(mode, "batch") == 0)
+    flags = ICMP_SOCKET_SHARED|ICMP_SOCKET_BATCH;
+  else if (strcmp(mode, "shared") == 0)
+    flags = ICMP_SOCKET_SHARED;
+  else if (strcmp(mode, "dedicated") != 0)
+    usage(argv[0]);
+  /* Replies are read up to a tick after they land, so round trips are
+   * taken from their receive stamps, as with timestamps = software */
+  flags |= ICMP_SOCKET_TIMESTAMP;
+  if (ntunnels == 0 || ntunnels > (1ul << 23) || tick < 0.0 ||
+      duration <= 0.0 || spread < 0.0)
+    usage(argv[0]);
+
+  /* Deadlines only come out of the wheel or, with no tick, ev_icmp's
+   * timer heap; libev's timers would run on the wall clock */
+  loop = ev_loop_new(EVFLAG_AUTO);
+  if (!loop)
+    errx(EXIT_FAILURE, "Cannot create event loop");
+  ev_icmp_scheduler(tick);
+  ev_icmp_clock(virtual_now);
+  icmp_transport_set(&sim_transport);
+  sim_init(&profile, seed);
+
+  tunnels = calloc(ntunnels, sizeof(*tunnels));
+  if (!tunnels)
+    err(EXIT_FAILURE, "Cannot allocate %lu tunnels", ntunnels);
+
+  /* With a spread every tunnel runs at its own interval, so they drift
+   * apart from their common start as a real mix of sections would */
+  for (i=0; i < ntunnels; i++) {
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(0x0a000000 | (uint32_t)(i + 1));
+    results_init(&tunnels[i].results);
+    if (!ev_icmp_init(&tunnels[i].icmp, tunnel_result,
+                      (struct sockaddr *)&sin, sizeof(sin),
+                      interval * (1.0 + spread * i / ntunnels),
+                      timeout, 0, flags, -1))
+      err(EXIT_FAILURE, "Cannot create tunnel %lu", i);
+    tunnels[i].icmp.data = &tunnels[i];
+    if (backoff)
+      ev_icmp_backoff(&tunnels[i].icmp, backoff, interval * 64);
+    ev_icmp_slack(&tunnels[i].icmp, slack);
+    ev_icmp_start(loop, &tunnels[i].icmp);
+  }
+  shared = tunnels[0].icmp.ic->shared;
+
+  started = wall_time();
+  for (;;) {
+    wake = ev_icmp_next();
+    arrive = sim_next();
+    next = wake;
+    if (next < 0.0 || (arrive >= 0.0 && arrive < next))
+      next = arrive;
+    if (next < 0.0 || next > duration)
+      break;
+
+    /* With the wheel every reply landing before the next tick, or the
+     * next deadline, is read in one step. Each is stamped with the time
+     * it landed, so round trips still come out exact. */
+    if (next != wake && tick > 0.0) {
+      next = (floor(arrive / tick) + 1.0) * tick;
+      if (wake >= 0.0 && wake <= next)
+        next = wake;
+      else if (next > duration)
+        next = duration;
+    }
+
+    /* Wheel deadlines sit exactly on a tick; step just past it so the
+     * wheel sees the tick as reached */
+    sim_set_now(next == wake ? next + tick * 1e-6 : next);
+    steps++;
+
+    /* A dedicated socket is read once per readiness, so it is fed
+     * again for as long as it has more, as a level triggered poll would */
+    nready = sim_deliver(&ready);
+    do {
+      more = 0;
+      for (j=0; j < nready; j++) {
+        if (sim_readable(ready[j])) {
+          ev_feed_fd_event(loop, ready[j], EV_READ);
+          more = 1;
+        }
+      }
+      if (more)
+        ev_invoke_pending(loop);
+    } while (more);
+
+    if (wake >= 0.0 && wake <= sim_now()) {
+      ev_icmp_advance(loop);
+      timer_steps++;
+    }
+
+    /* Stands in for the prepare watcher the loop would run */
+    if (shared && shared->tx.len)
+      icmp_shared_flush(shared);
+  }
+  elapsed = wall_time() - started;
+
+  for (i=0; i < ntunnels; i++) {
+    if (tunnels[i].results.hist.count) {
+      rtt += hist_mean(&tunnels[i].results.hist);
+      answered++;
+    }
+  }
+  sim_counters(&sc);
+  getrusage(RUSAGE_SELF, &ru);
+
+  printf("{\"benchmark\":\"sim\",\"mode\":\"%s\",\"scheduler\":\"%s\","
+         "\"tunnels\":%lu,"
+         "\"interval\":%g,\"spread\":%g,\"timeout\":%g,\"tick\":%g,"
+         "\"slack\":%g,\"distribution\":\"%s\","
+         "\"rtt_ms\":%g,\"spread_ms\":%g,\"loss\":%g,\"reorder\":%g,"
+         "\"dead\":%g,\"simulated_seconds\":%g,\"wall_seconds\":%.3f,"
+         "\"speedup\":%.0f,\"steps\":%lu,\"wakeups_per_second\":%.1f,"
+         "\"timer_wakeups_per_second\":%.1f,\"send_delay_ms\":%.3f,"
+         "\"probes\":%lu,\"replies\":%lu,"
+         "\"rejected\":%lu,\"lost\":%lu,\"reordered\":%lu,"
+         "\"ns_per_probe\":%.1f,\"syscalls_per_probe\":%.3f,"
+         "\"rtt_mean_ms\":%.4f,\"max_rss_kb\":%ld}\n",
+         mode, tick > 0.0 ? "wheel" : "heap", ntunnels, interval, spread, timeout, tick, slack,
+         distributions[profile.distribution], profile.rtt * 1000,
+         profile.spread * 1000, profile.loss, profile.reorder, profile.dead,
+         duration, elapsed, elapsed > 0.0 ? duration / elapsed : 0.0, steps,
+         (sc.arrivals + timer_steps) / duration, timer_steps / duration, icmp_counters.scheduled ?
+         (double)icmp_counters.late_ns / icmp_counters.scheduled / 1e6 : 0.0,
+         icmp_counters.sent, sc.delivered, icmp_counters.rejected, sc.lost,
+         sc.reordered,
+         icmp_counters.sent ? elapsed * 1e9 / icmp_counters.sent : 0.0,
+         icmp_counters.sent ?
+         (double)icmp_counters.syscalls / icmp_counters.sent : 0.0,
+         answered ? rtt / answered * 1000 : 0.0, ru.ru_maxrss);
+
+  for (i=0; i < ntunnels; i++)
+    ev_icmp_destroy(loop, &tunnels[i].icmp);
+  free(tunnels);
+  sim_destroy();
+  ev_loop_destroy(loop);
+  return 0;
+}
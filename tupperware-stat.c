@@ -0,0 +1,71 @@
+#include "common.h"
+#include "stats.h"
+
+#include <signal.h>
+#include <time.h>
+
+/* Prints the statistics a running daemon publishes to its stats_file.
+ * Reads the mapped file only; the daemon is never contacted. */
+int main(
+    int argc,
+    char **argv)
+{
+  struct stats s;
+  struct stats_record r;
+  struct timespec ts;
+  const char *path = STATS_FILE;
+  double now;
+  uint64_t successes;
+  uint32_t i;
+  int rc;
+
+  if (argc > 2) {
+    fprintf(stderr, "Usage: %s [stats file]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  if (argc > 1)
+    path = argv[1];
+
+  if (stats_open(&s, path) < 0)
+    err(EXIT_FAILURE, "Cannot open %s", path);
+
+  if (kill(s.header->pid, 0) < 0 && errno == ESRCH)
+    warnx("Daemon %lu is not running, statistics are stale",
+          (unsigned long)s.header->pid);
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  now = ts.tv_sec + ts.tv_nsec / 1e9;
+
+  printf("%-16s %16s/%-16s %4s %6s %11s %8s %8s %8s %8s %8s %8s\n",
+  "section", "device", "addr", "link", "last", "rcv/sent", "percent",
+  "mean", "ewma", "min", "max", "jitter");
+
+  for (i=0; i < s.header->nrecords; i++) {
+    rc = stats_snapshot(&s, i, &r);
+    if (rc < 0) {
+      warn("Cannot read record %u", i);
+      continue;
+    }
+    if (rc == 0)
+      continue;
+
+    /* The strings are written by the daemon; do not trust their ends */
+    r.section[sizeof(r.section)-1] = 0;
+    r.device[sizeof(r.device)-1] = 0;
+    r.address[sizeof(r.address)-1] = 0;
+    r.netns[sizeof(r.netns)-1] = 0;
+
+    successes = r.samples - r.failures;
+    printf("%-16s %16s/%-16s %4s %5.1fs %5lu/%-5lu %6.1f%% "
+    "%6.2fms %6.2fms %6.2fms %6.2fms %6.2fms\n",
+    r.section, r.device, r.address, r.state == STATS_UP ? "up" : "down",
+    r.samples ? now - r.last_sent : 0.0,
+    (unsigned long)successes, (unsigned long)r.samples,
+    r.samples ? ((double)successes/(double)r.samples) * 100 : 0.0,
+    r.mean * 1000, r.ewma * 1000, r.min * 1000, r.max * 1000,
+    r.jitter * 1000);
+  }
+
+  stats_close(&s);
+  exit(0);
+}
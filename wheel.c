@@ -0,0 +1,252 @@
+#include "common.h"
+#include "wheel.h"
+
+#include <math.h>
+
+static void slot_insert(
+    struct wheel_timer **slot,
+    struct wheel_timer *t)
+{
+  t->next = *slot;
+  if (t->next)
+    t->next->pprev = &t->next;
+  t->pprev = slot;
+  *slot = t;
+}
+
+static void slot_remove(
+    struct wheel_timer *t)
+{
+  *t->pprev = t->next;
+  if (t->next)
+    t->next->pprev = t->pprev;
+  t->next = NULL;
+  t->pprev = NULL;
+}
+
+static void slot_mark(
+    struct wheel *w,
+    size_t slot)
+{
+  w->occupied[slot >> 6] |= 1ull << (slot & 63);
+  w->summary[slot >> 12] |= 1ull << ((slot >> 6) & 63);
+}
+
+/* Clears the slot's bit once nothing is left in it */
+static void slot_unmark(
+    struct wheel *w,
+    size_t slot)
+{
+  if (w->slots[slot])
+    return;
+  w->occupied[slot >> 6] &= ~(1ull << (slot & 63));
+  if (!w->occupied[slot >> 6])
+    w->summary[slot >> 12] &= ~(1ull << ((slot >> 6) & 63));
+}
+
+/* The first occupied slot at or after from, or -1 */
+static ssize_t slot_find(
+    struct wheel *w,
+    size_t from)
+{
+  size_t word = from >> 6, s;
+  uint64_t bits;
+
+  bits = w->occupied[word] & (~0ull << (from & 63));
+  if (bits)
+    return (word << 6) + __builtin_ctzll(bits);
+
+  for (++word, s=word >> 6; s <= w->mask >> 12; s++) {
+    bits = w->summary[s];
+    if (s == word >> 6)
+      bits &= ~0ull << (word & 63);
+    if (bits) {
+      word = (s << 6) + __builtin_ctzll(bits);
+      return (word << 6) + __builtin_ctzll(w->occupied[word]);
+    }
+  }
+  return -1;
+}
+
+struct wheel * wheel_create(
+    double tick,
+    size_t slots,
+    double now)
+{
+  struct wheel *w = NULL;
+  size_t n = 1;
+
+  if (tick <= 0.0)
+    return NULL;
+
+  while (n < slots)
+    n <<= 1;
+
+  w = malloc(sizeof(*w));
+  if (!w)
+    return NULL;
+  memset(w, 0, sizeof(*w));
+
+  w->slots = calloc(n, sizeof(*w->slots));
+  w->occupied = calloc((n >> 6) + 1, sizeof(*w->occupied));
+  w->summary = calloc((n >> 12) + 1, sizeof(*w->summary));
+  if (!w->slots || !w->occupied || !w->summary) {
+    free(w->slots);
+    free(w->occupied);
+    free(w->summary);
+    free(w);
+    return NULL;
+  }
+
+  w->tick = tick;
+  w->epoch = now;
+  w->now = 0;
+  w->mask = n - 1;
+  w->len = 0;
+  return w;
+}
+
+void wheel_destroy(
+    struct wheel *w)
+{
+  size_t i;
+
+  if (!w)
+    return;
+
+  for (i=0; i <= w->mask; i++) {
+    while (w->slots[i])
+      slot_remove(w->slots[i]);
+  }
+  free(w->slots);
+  free(w->occupied);
+  free(w->summary);
+  free(w);
+}
+
+void wheel_timer_init(
+    struct wheel_timer *t,
+    void (*cb)(struct wheel_timer *, void *),
+    void *data)
+{
+  memset(t, 0, sizeof(*t));
+  t->cb = cb;
+  t->data = data;
+}
+
+int wheel_pending(
+    struct wheel_timer *t)
+{
+  return t->pprev != NULL;
+}
+
+void wheel_add(
+    struct wheel *w,
+    struct wheel_timer *t,
+    double at)
+{
+  double ticks;
+
+  if (wheel_pending(t))
+    wheel_del(w, t);
+
+  /* Round up so a timer never fires before its deadline, and never
+   * land on a tick that has already been processed. */
+  ticks = ceil((at - w->epoch) / w->tick);
+  if (ticks <= (double)w->now)
+    t->expires = w->now + 1;
+  else
+    t->expires = (uint64_t)ticks;
+
+  slot_insert(&w->slots[t->expires & w->mask], t);
+  slot_mark(w, t->expires & w->mask);
+  w->len++;
+}
+
+void wheel_del(
+    struct wheel *w,
+    struct wheel_timer *t)
+{
+  if (!wheel_pending(t))
+    return;
+
+  slot_remove(t);
+  slot_unmark(w, t->expires & w->mask);
+  w->len--;
+}
+
+static void wheel_run_slot(
+    struct wheel *w,
+    size_t slot,
+    uint64_t upto)
+{
+  struct wheel_timer *list = NULL, *t;
+
+  /* Detach the slot so callbacks that re-arm onto it, or cancel a
+   * timer further down it, cannot disturb the walk. */
+  list = w->slots[slot];
+  w->slots[slot] = NULL;
+  slot_unmark(w, slot);
+  if (list)
+    list->pprev = &list;
+
+  while ((t = list) != NULL) {
+    slot_remove(t);
+    if (t->expires <= upto) {
+      w->len--;
+      t->cb(t, t->data);
+    }
+    else {
+      slot_insert(&w->slots[slot], t);
+      slot_mark(w, slot);
+    }
+  }
+}
+
+void wheel_advance(
+    struct wheel *w,
+    double now)
+{
+  uint64_t target;
+  size_t i;
+
+  if (now < w->epoch)
+    return;
+
+  target = (uint64_t)floor((now - w->epoch) / w->tick);
+  if (target <= w->now)
+    return;
+
+  if (target - w->now > w->mask) {
+    w->now = target;
+    for (i=0; i <= w->mask; i++)
+      wheel_run_slot(w, i, target);
+    return;
+  }
+
+  while (w->now < target) {
+    w->now++;
+    wheel_run_slot(w, w->now & w->mask, w->now);
+  }
+}
+
+double wheel_next(
+    struct wheel *w)
+{
+  size_t start = (w->now + 1) & w->mask;
+  ssize_t slot;
+
+  if (w->len == 0)
+    return -1.0;
+
+  /* Slots from the next tick to the end, then round from the start */
+  slot = slot_find(w, start);
+  if (slot < 0)
+    slot = slot_find(w, 0);
+  /* Only while a slot is being run are its timers in none */
+  if (slot < 0)
+    return w->epoch + (double)(w->now + w->mask + 1) * w->tick;
+
+  return w->epoch +
+         (double)(w->now + 1 + (((size_t)slot - start) & w->mask)) * w->tick;
+}
@@ -0,0 +1,43 @@
+#ifndef _WHEEL_H_
+#define _WHEEL_H_
+#include "common.h"
+
+/* Hashed timing wheel. Timers are bucketed by expiry tick modulo the
+ * number of slots; a timer further out than one revolution simply stays
+ * in its slot until the wheel comes round to its tick. Insert and cancel
+ * are O(1), and so is finding the next occupied slot for up to 4096
+ * slots. */
+struct wheel_timer {
+  struct wheel_timer *next;
+  struct wheel_timer **pprev;
+  uint64_t expires;
+  void (*cb)(struct wheel_timer *, void *);
+  void *data;
+};
+
+struct wheel {
+  double tick;
+  double epoch;
+  uint64_t now;
+  size_t mask;
+  size_t len;
+  struct wheel_timer **slots;
+  /* A bit per slot, set while the slot holds a timer, and above it a
+   * bit per word of those, set while the word has any bit set */
+  uint64_t *occupied;
+  uint64_t *summary;
+};
+
+struct wheel * wheel_create(double tick, size_t slots, double now);
+void wheel_destroy(struct wheel *);
+
+void wheel_timer_init(struct wheel_timer *,
+                      void (*cb)(struct wheel_timer *, void *), void *data);
+void wheel_add(struct wheel *, struct wheel_timer *, double at);
+void wheel_del(struct wheel *, struct wheel_timer *);
+int wheel_pending(struct wheel_timer *);
+
+void wheel_advance(struct wheel *, double now);
+double wheel_next(struct wheel *);
+
+#endif